@@ -53,6 +53,10 @@ namespace Hash {
 			void digest(uint8_t *out, size_t outlen);
 
 			virtual void reset();
+
+			size_t state_size() override;
+			size_t export_state(uint8_t *buf, size_t len) override;
+			bool   import_state(uint8_t const *buf, size_t len) override;
 	};
 };
 
@@ -43,6 +43,26 @@ struct Hash::Function
 	 * Reset the internal state of the hash function.
 	 */
 	virtual void reset() = 0;
+
+	/**
+	 * Size of the internal state as exported by 'export_state',
+	 * zero if the state cannot be exported.
+	 */
+	virtual size_t state_size() { return 0; }
+
+	/**
+	 * Write the internal state to a buffer.
+	 *
+	 * \return number of bytes written, zero if 'len' is too small
+	 */
+	virtual size_t export_state(uint8_t *buf, size_t len) { return 0; }
+
+	/**
+	 * Restore an internal state written by 'export_state'.
+	 *
+	 * \return false if the state is not from this function
+	 */
+	virtual bool import_state(uint8_t const *buf, size_t len) { return false; }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+/*
+ * \brief  Record stream for bulk ingest
+ * \author Emery Hemingway
+ * \date   2017-02-14
+ *
+ * A file opened at the top of an ingest session with a name
+ * beginning with 'PREFIX' is not a file but a stream of records
+ * that describe a whole tree. The stream is written sequentially
+ * and the tree is created, hashed, and finalised by the server
+ * without a session RPC per node. The object is then found by
+ * reading the root symlink of the name without the prefix.
+ *
+ * Each record is a header, a path relative to the root, and
+ * 'size' bytes of content. The root is the record with an empty
+ * path and must come first, a directory must come before its
+ * children, and the stream ends with a 'TYPE_END' record.
+ *
+ * The path of the end record is empty or the name of the object,
+ * which replaces the name that the stream was opened with. This
+ * lets a client stream content whose name is not known until the
+ * content has been written, the root symlink is still found by
+ * the name that the stream was opened with.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _INCLUDE__NIX_STORE__INGEST_STREAM_H_
+#define _INCLUDE__NIX_STORE__INGEST_STREAM_H_
+
+/* Genode includes */
+#include <base/stdint.h>
+
+namespace Nix_store { namespace Ingest_stream {
+
+	/* not valid in a store object name */
+	enum { PREFIX = '!' };
+
+	enum Type {
+		TYPE_END       = 0,
+		TYPE_DIRECTORY = 1,
+		TYPE_FILE      = 2,
+		TYPE_SYMLINK   = 3,
+	};
+
+	struct Record
+	{
+		Genode::uint64_t size;     /* length of the content after the path */
+		Genode::uint16_t path_len; /* length of the path, without termination */
+		Genode::uint8_t  type;
+		Genode::uint8_t  reserved[5];
+	} __attribute__((packed));
+
+} }
+
+#endif
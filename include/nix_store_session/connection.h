@@ -21,17 +21,65 @@ namespace Nix_store { struct Connection; }
 
 struct Nix_store::Connection : public Genode::Connection<Session>, public Genode::Rpc_client<Session>
 {
+	Genode::Env &_env;
+
+	/* temporary roots are charged to the session quota */
+	void _upgrade() { _env.parent().upgrade(cap(), "ram_quota=8K"); }
+
 	Connection(Genode::Env &env, char const *label = "")
 	:
 		Genode::Connection<Session>(
-			env, session(env.parent(), "ram_quota=8K, label=\"%s\"", label)),
-		Genode::Rpc_client<Session>(cap())
+			env, session(env.parent(), "ram_quota=16K, label=\"%s\"", label)),
+		Genode::Rpc_client<Session>(cap()),
+		_env(env)
 	{}
 
 	Name dereference(Name const &name) { return call<Rpc_dereference>(name); }
 
-	void realize(Name const  &drv, Genode::Signal_context_capability sigh) {
-		call<Rpc_realize>(drv, sigh); }
+	void realize(Name const  &drv, Genode::Signal_context_capability sigh)
+	{
+		for (;;) try { call<Rpc_realize>(drv, sigh); return; }
+		catch (Out_of_quota) { _upgrade(); }
+	}
+
+	void add_temp_root(Name const &name)
+	{
+		for (;;) try { call<Rpc_add_temp_root>(name); return; }
+		catch (Out_of_quota) { _upgrade(); }
+	}
+
+	void add_root(Name const &link, Name const &target) {
+		call<Rpc_add_root>(link, target); }
+
+	bool root(unsigned index, Name &link, Name &target) {
+		return call<Rpc_root>(index, link, target); }
+
+	void add_reference(Name const &from, Name const &to) {
+		call<Rpc_add_reference>(from, to); }
+
+	bool reference(Name const &from, unsigned index, Name &to) {
+		return call<Rpc_reference>(from, index, to); }
+
+	bool referrer(Name const &to, unsigned index, Name &from) {
+		return call<Rpc_referrer>(to, index, from); }
+
+	bool deriver(Name const &output, Name &drv) {
+		return call<Rpc_deriver>(output, drv); }
+
+	bool output(Name const &drv, unsigned index, Name &output) {
+		return call<Rpc_output>(drv, index, output); }
+
+	bool from_hash_part(Name const &hash_part, Name &name) {
+		return call<Rpc_from_hash_part>(hash_part, name); }
+
+	bool substitutable(Name const &path) {
+		return call<Rpc_substitutable>(path); }
+
+	void collect_garbage(Genode::Signal_context_capability sigh,
+	                     Genode::uint64_t max_freed) {
+		call<Rpc_collect_garbage>(sigh, max_freed); }
+
+	Gc_result gc_result() { return call<Rpc_gc_result>(); }
 };
 
 #endif
\ No newline at end of file
@@ -29,6 +29,20 @@ namespace Nix_store {
 	struct Session;
 
 	struct Missing_dependency { };
+	struct Out_of_quota       { };
+	struct Invalid_reference  { };
+	struct Invalid_root       { };
+	struct Root_exists        { };
+	struct Root_failed        { };
+
+	/**
+	 * Outcome of a garbage collection
+	 */
+	struct Gc_result
+	{
+		Genode::uint64_t objects; /* store objects removed */
+		Genode::uint64_t bytes;   /* file content freed */
+	};
 
 }
 
@@ -59,10 +73,101 @@ struct Nix_store::Session : public Genode::Session
 	 *                            or failed to parse
 	 * \throw Missing_dependency  a derivation dependency is not
 	 *                            present in the store
+	 * \throw Out_of_quota        session quota does not suffice
+	 *                            for the temporary roots
 	 */
 	virtual void realize(Name const &drv,
 	                     Genode::Signal_context_capability sigh) = 0;
 
+	/**
+	 * Keep an object from collection until the session is closed
+	 *
+	 * \throw Out_of_quota  session quota does not suffice
+	 */
+	virtual void add_temp_root(Name const &name) = 0;
+
+	/**
+	 * Keep an object from collection until the root 'link' is removed
+	 *
+	 * \throw Invalid_root  'link' is not a plain file name
+	 *                      or 'target' is empty
+	 * \throw Root_exists   'link' already refers to another object
+	 * \throw Root_failed   the root could not be written
+	 */
+	virtual void add_root(Name const &link, Name const &target) = 0;
+
+	/**
+	 * Return the permanent root at 'index'
+	 *
+	 * \return false if there is no root at 'index'
+	 */
+	virtual bool root(unsigned index, Name &link, Name &target) = 0;
+
+	/**
+	 * Record that object 'from' refers to object 'to'
+	 *
+	 * \throw Invalid_reference  'from' was not just imported by
+	 *                           the ingest session of this client
+	 */
+	virtual void add_reference(Name const &from, Name const &to) = 0;
+
+	/**
+	 * Return the object at 'index' that object 'from' refers to
+	 *
+	 * \return false if there is no reference at 'index'
+	 */
+	virtual bool reference(Name const &from, unsigned index, Name &to) = 0;
+
+	/**
+	 * Return the object at 'index' that refers to object 'to'
+	 *
+	 * Referrers may include objects that are no longer present.
+	 *
+	 * \return false if there is no referrer at 'index'
+	 */
+	virtual bool referrer(Name const &to, unsigned index, Name &from) = 0;
+
+	/**
+	 * Return the derivation that produced an output
+	 *
+	 * \return false if the deriver is unknown
+	 */
+	virtual bool deriver(Name const &output, Name &drv) = 0;
+
+	/**
+	 * Return the output at 'index' produced by a derivation
+	 *
+	 * \return false if there is no output at 'index'
+	 */
+	virtual bool output(Name const &drv, unsigned index, Name &output) = 0;
+
+	/**
+	 * Find a present object by the hash part of its name
+	 *
+	 * \return false if no such object is present
+	 */
+	virtual bool from_hash_part(Name const &hash_part, Name &name) = 0;
+
+	/**
+	 * Return true if a path may be copied from the binary cache
+	 */
+	virtual bool substitutable(Name const &path) = 0;
+
+	/**
+	 * Start the removal of objects not reachable from a root
+	 *
+	 * \param sigh       signaled when the collection is complete
+	 * \param max_freed  stop after freeing this many bytes,
+	 *                   zero for no limit
+	 */
+	virtual void collect_garbage(Genode::Signal_context_capability sigh,
+	                             Genode::uint64_t max_freed) = 0;
+
+	/**
+	 * Return the result of the last complete collection
+	 */
+	virtual Gc_result gc_result() = 0;
+
 
 	/*********************
 	 ** RPC declaration **
@@ -71,10 +176,33 @@ struct Nix_store::Session : public Genode::Session
 	GENODE_RPC(Rpc_dereference, Name, dereference, Name const&);
 
 	GENODE_RPC_THROW(Rpc_realize, void, realize,
-	                 GENODE_TYPE_LIST(Invalid_derivation, Missing_dependency),
+	                 GENODE_TYPE_LIST(Invalid_derivation, Missing_dependency,
+	                                  Out_of_quota),
 	                 Name const&, Genode::Signal_context_capability);
 
-	GENODE_RPC_INTERFACE(Rpc_dereference, Rpc_realize);
+	GENODE_RPC_THROW(Rpc_add_temp_root, void, add_temp_root,
+	                 GENODE_TYPE_LIST(Out_of_quota), Name const&);
+	GENODE_RPC_THROW(Rpc_add_root, void, add_root,
+	                 GENODE_TYPE_LIST(Invalid_root, Root_exists, Root_failed),
+	                 Name const&, Name const&);
+	GENODE_RPC(Rpc_root, bool, root, unsigned, Name&, Name&);
+	GENODE_RPC_THROW(Rpc_add_reference, void, add_reference,
+	                 GENODE_TYPE_LIST(Invalid_reference), Name const&, Name const&);
+	GENODE_RPC(Rpc_reference, bool, reference, Name const&, unsigned, Name&);
+	GENODE_RPC(Rpc_referrer, bool, referrer, Name const&, unsigned, Name&);
+	GENODE_RPC(Rpc_deriver, bool, deriver, Name const&, Name&);
+	GENODE_RPC(Rpc_output, bool, output, Name const&, unsigned, Name&);
+	GENODE_RPC(Rpc_from_hash_part, bool, from_hash_part, Name const&, Name&);
+	GENODE_RPC(Rpc_substitutable, bool, substitutable, Name const&);
+	GENODE_RPC(Rpc_collect_garbage, void, collect_garbage,
+	           Genode::Signal_context_capability, Genode::uint64_t);
+	GENODE_RPC(Rpc_gc_result, Gc_result, gc_result);
+
+	GENODE_RPC_INTERFACE(Rpc_dereference, Rpc_realize, Rpc_add_temp_root,
+	                     Rpc_add_root, Rpc_root,
+	                     Rpc_add_reference, Rpc_reference, Rpc_referrer,
+	                     Rpc_deriver, Rpc_output, Rpc_from_hash_part,
+	                     Rpc_substitutable, Rpc_collect_garbage, Rpc_gc_result);
 
 };
 
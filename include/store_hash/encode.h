@@ -2,6 +2,11 @@
  * \brief  Digest encoding
  * \author Emery Hemingway
  * \date   2015-06-02
+ *
+ * Encoders and decoders between digests and their text forms.
+ * The decoders and 'equal' do not branch or index on the digits
+ * and bytes they process, so the time they take tells nothing of
+ * the digest that is expected.
  */
 
 #ifndef _STORE_HASH__ENCODE_H_
@@ -25,43 +30,247 @@ namespace Store_hash {
 		'q','r','s','v','w','x','y','z'
 	};
 
+	static uint8_t const base16[] = {
+		'0','1','2','3','4','5','6','7',
+		'8','9','a','b','c','d','e','f'
+	};
+
+	/**
+	 * Number of base32 digits that encode 'len' bytes
+	 */
+	inline size_t base32_len(size_t len) { return (len*8+4)/5; }
+
+	/**
+	 * Value of 'c' plus one if it lies within 'lo' to 'hi', otherwise zero
+	 *
+	 * The range is tested by the sign of two differences
+	 * rather than by comparison, so there is no branch.
+	 */
+	inline int _range(uint8_t c, uint8_t lo, uint8_t hi, int base)
+	{
+		int const mask = (((int)lo - 1 - c) & ((int)c - (hi + 1))) >> 8;
+		return (c - lo + base + 1) & mask;
+	}
+
+	/**
+	 * Value of a base16 digit, -1 if it is not a digit
+	 */
+	inline int _base16_value(uint8_t c)
+	{
+		return -1
+			+ _range(c, '0', '9', 0)
+			+ _range(c, 'a', 'f', 10)
+			+ _range(c, 'A', 'F', 10);
+	}
+
+	/**
+	 * Value of a base32 digit, -1 if it is not a digit
+	 */
+	inline int _base32_value(uint8_t c)
+	{
+		return -1
+			+ _range(c, '0', '9', 0)
+			+ _range(c, 'a', 'd', 10)
+			+ _range(c, 'f', 'n', 14)
+			+ _range(c, 'p', 's', 23)
+			+ _range(c, 'v', 'z', 27);
+	}
+
+	/**
+	 * Compare two digests in time that depends only on their length
+	 */
+	inline bool equal(uint8_t const *a, uint8_t const *b, size_t len)
+	{
+		uint8_t diff = 0;
+		for (size_t i = 0; i < len; ++i)
+			diff |= a[i] ^ b[i];
+		return diff == 0;
+	}
+
+	/**
+	 * Base16 decode 'src' into 'dst'
+	 *
+	 * \return false if 'src' is not 'dst_len' bytes of base16
+	 */
+	inline bool decode_base16(uint8_t *dst, size_t dst_len,
+	                          char const *src, size_t src_len)
+	{
+		if (src_len != dst_len*2)
+			return false;
+
+		int err = 0;
+		for (size_t i = 0; i < dst_len; ++i) {
+			int const hi = _base16_value(src[i*2]);
+			int const lo = _base16_value(src[i*2+1]);
+			err |= hi | lo;
+			dst[i] = (hi << 4) | (lo & 0x0F);
+		}
+		return err >= 0;
+	}
+
 	/**
-	 * Base32 encode the buffer
+	 * Base32 decode digits written by 'encode_base32'
+	 *
+	 * \return false if 'src' is not 'dst_len' bytes of base32
 	 */
-	void encode_hash(uint8_t *buf, size_t len)
+	inline bool decode_base32(uint8_t *dst, size_t dst_len,
+	                          char const *src, size_t src_len)
+	{
+		if (src_len != base32_len(dst_len))
+			return false;
+
+		int      err  = 0;
+		uint32_t acc  = 0;
+		unsigned bits = 0;
+		size_t   j    = 0;
+
+		for (size_t i = 0; i < src_len; ++i) {
+			int const v = _base32_value(src[i]);
+			err |= v;
+			acc   = (acc << 5) | (v & 0x1F);
+			bits += 5;
+			if (bits >= 8) {
+				bits -= 8;
+				dst[j++] = acc >> bits;
+			}
+		}
+
+		/* the padding of the last digit must be clear */
+		err |= -(int)(acc & ((1U << bits) - 1));
+		return err >= 0;
+	}
+
+	/**
+	 * Base32 decode a digest in the digit order of Nix
+	 *
+	 * Nix writes the last digit first and packs digits from the
+	 * least significant bits, as in the hashes of derivations.
+	 *
+	 * \return false if 'src' is not 'dst_len' bytes of Nix base32
+	 */
+	inline bool decode_nix_base32(uint8_t *dst, size_t dst_len,
+	                              char const *src, size_t src_len)
+	{
+		if (!dst_len || src_len != base32_len(dst_len))
+			return false;
+
+		memset(dst, 0, dst_len);
+
+		int err = 0;
+		for (size_t n = 0; n < src_len; ++n) {
+			int const v = _base32_value(src[src_len - n - 1]);
+			err |= v;
+
+			unsigned const digit = v & 0x1F;
+			size_t   const b = n*5;
+			size_t   const i = b / 8;
+			unsigned const j = b % 8;
+
+			dst[i] |= digit << j;
+			if (i < dst_len - 1)
+				dst[i+1] |= digit >> (8 - j);
+			else
+				err |= -(int)(digit >> (8 - j));
+		}
+		return err >= 0;
+	}
+
+	/**
+	 * Base32 encode 'len' bytes of 'src', most significant bits first
+	 *
+	 * Whole groups of five bytes are loaded as one word and cut
+	 * into eight digits, the tail is padded with zero bits.
+	 *
+	 * \return number of digits written to 'dst'
+	 */
+	inline size_t encode_base32(char *dst, uint8_t const *src, size_t len)
+	{
+		size_t i = 0, j = 0;
+
+		for (; i + 5 <= len; i += 5) {
+			uint64_t const w =
+				((uint64_t)src[i]   << 32) | ((uint64_t)src[i+1] << 24) |
+				((uint64_t)src[i+2] << 16) | ((uint64_t)src[i+3] <<  8) |
+				 (uint64_t)src[i+4];
+
+			for (int k = 35; k >= 0; k -= 5)
+				dst[j++] = base32[(w >> k) & 0x1F];
+		}
+
+		uint32_t acc  = 0;
+		unsigned bits = 0;
+		for (; i < len; ++i) {
+			acc   = (acc << 8) | src[i];
+			bits += 8;
+			while (bits >= 5) {
+				bits -= 5;
+				dst[j++] = base32[(acc >> bits) & 0x1F];
+			}
+		}
+		if (bits)
+			dst[j++] = base32[(acc << (5 - bits)) & 0x1F];
+
+		return j;
+	}
+
+	/**
+	 * Base16 encode 'len' bytes of 'src'
+	 *
+	 * \return number of digits written to 'dst'
+	 */
+	inline size_t encode_base16(char *dst, uint8_t const *src, size_t len)
+	{
+		for (size_t i = 0; i < len; ++i) {
+			dst[i*2]   = base16[src[i] >> 4];
+			dst[i*2+1] = base16[src[i] & 0x0F];
+		}
+		return len*2;
+	}
+
+	/**
+	 * Encode five bytes of a digest as the eight digits of a name
+	 *
+	 * The second digit takes the six high bits of the first byte
+	 * rather than its three low bits, it is kept that way so that
+	 * names do not change.
+	 */
+	inline void _encode_name_group(uint8_t *dst, uint8_t const *src)
+	{
+		uint64_t const w =
+			((uint64_t)src[0] << 32) | ((uint64_t)src[1] << 24) |
+			((uint64_t)src[2] << 16) | ((uint64_t)src[3] <<  8) |
+			 (uint64_t)src[4];
+		uint8_t const first = src[0];
+
+		dst[0] = base32[(w >> 35) & 0x1F];
+		dst[1] = base32[((w >> 30) & 0x03) | ((first >> 2) & 0x1F)];
+		for (int k = 25, i = 2; k >= 0; k -= 5, ++i)
+			dst[i] = base32[(w >> k) & 0x1F];
+	}
+
+	/**
+	 * Base32 encode the 256 bit digest at the start of the buffer
+	 *
+	 * The digest is cut into groups of five bytes from its end
+	 * and each group is encoded as in a name. The leading group
+	 * is filled with zero bytes before the digest.
+	 */
+	inline void encode_hash(uint8_t *buf, size_t len)
 	{
 		if (len < 52) {
 			*buf = 0;
 			return;
 		}
-		unsigned i = 32;
-		unsigned j = 52;
-		do {
-			uint8_t b7, b6, b5 , b4, b3, b2, b1, b0;
-
-			b7  =  buf[--i]       & 0x1F;
-			b6  =  buf[i]   >> 5;
-			b6 |= (buf[--i] << 3) & 0x1F;
-			b5  = (buf[i]   >> 2) & 0x1F;
-			b4  =  buf[i]   >> 7;
-			b4 |= (buf[--i] << 1) & 0x1F;
-			b3  = (buf[i]   >> 4) & 0x1F;
-			b3 |= (buf[--i] << 4) & 0x1F;
-			b2  = (buf[i]   >> 1) & 0x1F;
-			b1  = (buf[i]   >> 6) & 0x1F;
-			b1 |= (buf[--i] >> 2) & 0x1F;
-			b0  = (buf[i]   >> 3);
-
-			buf[--j]   = base32[b7];
-			buf[--j] = base32[b6];
-			buf[--j] = base32[b5];
-			buf[--j] = base32[b4];
-			buf[--j] = base32[b3];
-			buf[--j] = base32[b2];
-			buf[--j] = base32[b1];
-			buf[--j] = base32[b0];
-		} while (i);
 
+		uint8_t digest[35];
+		memset(digest, 0, 3);
+		memcpy(digest+3, buf, 32);
+
+		uint8_t digits[56];
+		for (int i = 0, j = 0; i < 35; i += 5, j += 8)
+			_encode_name_group(digits+j, digest+i);
+
+		memcpy(buf, digits+4, 52);
 		for (size_t k = 52; k < len; ++k)
 			buf[k] = 0x00;
 	}
@@ -69,43 +278,22 @@ namespace Store_hash {
 	/**
 	 * Get the base32 encoding of the first 160 bits of the digest
 	 */
-	void encode(uint8_t *buf, char const *name, size_t len)
+	inline void encode(uint8_t *buf, char const *name, size_t len)
 	{
 		if (len < HASH_PREFIX_LEN+2) {
 			*buf = 0;
 			return;
 		}
-		int i = 20;
-		int j = 32;
-		do {
-			uint8_t b7, b6, b5 , b4, b3, b2, b1, b0;
-
-			b7  =  buf[--i]       & 0x1F;
-			b6  =  buf[i]   >> 5;
-			b6 |= (buf[--i] << 3) & 0x1F;
-			b5  = (buf[i]   >> 2) & 0x1F;
-			b4  =  buf[i]   >> 7;
-			b4 |= (buf[--i] << 1) & 0x1F;
-			b3  = (buf[i]   >> 4) & 0x1F;
-			b3 |= (buf[--i] << 4) & 0x1F;
-			b2  = (buf[i]   >> 1) & 0x1F;
-			b1  = (buf[i]   >> 6) & 0x1F;
-			b1 |= (buf[--i] >> 2) & 0x1F;
-			b0  = (buf[i]   >> 3);
-
-			buf[--j]   = base32[b7];
-			buf[--j] = base32[b6];
-			buf[--j] = base32[b5];
-			buf[--j] = base32[b4];
-			buf[--j] = base32[b3];
-			buf[--j] = base32[b2];
-			buf[--j] = base32[b1];
-			buf[--j] = base32[b0];
-		} while (i);
+
+		/* groups are encoded from the end so that the
+		   digits do not overwrite bytes not yet read */
+		for (int i = 15, j = 24; i >= 0; i -= 5, j -= 8)
+			_encode_name_group(buf+j, buf+i);
+
 		buf[HASH_PREFIX_LEN] = '-';
 		strncpy((char *)buf+(HASH_PREFIX_LEN+1), name, len-(HASH_PREFIX_LEN+1));
 	}
 
 }
 
-#endif
\ No newline at end of file
+#endif
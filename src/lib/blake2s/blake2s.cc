@@ -296,3 +296,41 @@ void Hash::Blake2s::digest(uint8_t *out, size_t outlen)
 void Hash::Blake2s::reset() { blake2s_init(&S, 32); }
 
 Hash::Blake2s::Blake2s() { reset(); }
+
+
+/*
+ * The exported state is tagged so that the state of
+ * another function or layout is not imported.
+ */
+static Genode::uint32_t const BLAKE2S_STATE_TAG = 0x62327331; /* "b2s1" */
+
+
+size_t Hash::Blake2s::state_size() {
+	return sizeof(BLAKE2S_STATE_TAG) + sizeof(S); }
+
+
+size_t Hash::Blake2s::export_state(uint8_t *buf, size_t len)
+{
+	if (len < state_size()) return 0;
+
+	memcpy(buf, &BLAKE2S_STATE_TAG, sizeof(BLAKE2S_STATE_TAG));
+	memcpy(buf+sizeof(BLAKE2S_STATE_TAG), &S, sizeof(S));
+	return state_size();
+}
+
+
+bool Hash::Blake2s::import_state(uint8_t const *buf, size_t len)
+{
+	Genode::uint32_t tag;
+	if (len != state_size()) return false;
+
+	memcpy(&tag, buf, sizeof(tag));
+	if (tag != BLAKE2S_STATE_TAG) return false;
+
+	blake2s_state state;
+	memcpy(&state, buf+sizeof(tag), sizeof(state));
+	if (state.buflen > sizeof(state.buf)) return false;
+
+	S = state;
+	return true;
+}
@@ -630,7 +630,11 @@ bool willBuildLocally(const BasicDerivation & drv)
 }
 
 
-bool substitutesAllowed(const BasicDerivation & drv) { return false; }
+bool substitutesAllowed(const BasicDerivation & drv)
+{
+    /* the store substitutes the outputs when the job is scheduled */
+    return get(drv.env, "allowSubstitutes", "1") == "1";
+}
 
 
 void Goal::tryToBuild()
@@ -7,10 +7,12 @@
 /* Nix includes */
 #include "store.hh"
 #include <libutil/util.hh>
+#include <libutil/archive.hh>
 
 /* Genode includes */
 #include <file_system_session/connection.h>
 #include <store_hash/encode.h>
+#include <nix_store/ingest_stream.h>
 #include <hash/blake2s.h>
 #include <os/config.h>
 #include <dataspace/client.h>
@@ -19,6 +21,11 @@
 
 #define NOT_IMP Genode::error(__func__, " not implemented")
 
+enum {
+	EXPORT_MAGIC    = 0x4558494e,
+	NAR_TX_BUF_SIZE = 1024*1024
+};
+
 
 using namespace nix;
 
@@ -114,13 +121,486 @@ static nix::Path finalize_ingest(File_system::Session &fs, char const *name)
 }
 
 
-void Store::copy_dir(File_system::Session   &fs,
-                            File_system::Dir_handle ingest_dir,
-                            nix::Path const        &src_path,
-                            nix::Path const        &dst_path)
+/**
+ * Writer of a bulk ingest stream
+ *
+ * Records are packed into one packet that is submitted
+ * whenever it fills, so a tree of small files costs a few
+ * packets rather than several RPCs per file.
+ */
+class Ingest_stream_writer
+{
+	private:
+
+		File_system::Session             &_fs;
+		File_system::Session::Tx::Source &_source;
+		File_system::File_handle          _handle;
+		File_system::Packet_descriptor    _raw;
+		size_t                            _fill   = 0;
+		File_system::seek_off_t           _offset = 0;
+
+		static File_system::File_handle _open(File_system::Session &fs,
+		                                      string const &name)
+		{
+			using namespace File_system;
+
+			string const stream_name =
+				string(1, (char)Nix_store::Ingest_stream::PREFIX) + name;
+
+			Dir_handle root = fs.dir("/", false);
+			Handle_guard root_guard(fs, root);
+			return fs.file(root, stream_name.c_str(), WRITE_ONLY, true);
+		}
+
+		void _flush()
+		{
+			if (!_fill) return;
+
+			File_system::Packet_descriptor
+				packet(_raw, _handle, File_system::Packet_descriptor::WRITE,
+				       _fill, _offset);
+
+			_source.submit_packet(packet);
+			packet = _source.get_acked_packet();
+			if (packet.length() != _fill)
+				throw nix::Error("writing ingest stream failed");
+
+			_offset += _fill;
+			_fill = 0;
+		}
+
+		char *_dst() { return _source.packet_content(_raw) + _fill; }
+
+	public:
+
+		Ingest_stream_writer(File_system::Session &fs, string const &name)
+		:
+			_fs(fs), _source(*fs.tx()), _handle(_open(fs, name))
+		{
+			collect_acknowledgements(_source);
+			try { _raw = _source.alloc_packet(_source.bulk_buffer_size() / 2); }
+			catch (...) { _fs.close(_handle); throw; }
+		}
+
+		~Ingest_stream_writer()
+		{
+			_source.release_packet(_raw);
+			_fs.close(_handle);
+		}
+
+		/**
+		 * Append 'len' bytes produced by 'read(dst, count)'
+		 */
+		template <typename FUNC>
+		void fill(Genode::uint64_t len, FUNC const &read)
+		{
+			while (len) {
+				if (_fill == _raw.size())
+					_flush();
+
+				size_t const count =
+					std::min(len, (Genode::uint64_t)(_raw.size() - _fill));
+				size_t const n = read(_dst(), count);
+				if (!n)
+					throw nix::Error("short read while writing ingest stream");
+
+				_fill += n;
+				len   -= n;
+			}
+		}
+
+		void write(void const *buf, size_t len)
+		{
+			char const *src = (char const *)buf;
+			fill(len, [&] (char *dst, size_t count) {
+				memcpy(dst, src, count);
+				src += count;
+				return count;
+			});
+		}
+
+		void record(Nix_store::Ingest_stream::Type type,
+		            string const &path, Genode::uint64_t size)
+		{
+			Nix_store::Ingest_stream::Record r;
+			memset(&r, 0, sizeof(r));
+			r.size     = size;
+			r.path_len = path.size();
+			r.type     = type;
+
+			write(&r, sizeof(r));
+			write(path.data(), path.size());
+		}
+
+		/**
+		 * Terminate the stream, the server finalises the object
+		 *
+		 * \param name  name of the object if it differs from the
+		 *              name that the stream was opened with
+		 */
+		void finish(string const &name = "")
+		{
+			record(Nix_store::Ingest_stream::TYPE_END, name, 0);
+			_flush();
+		}
+};
+
+
+/**
+ * Writer of the NAR serialisation of a store object
+ *
+ * Objects are read through a File_system session of the store.
+ * File content is read in windows of consecutive packets that
+ * are in flight together and passed to the sink in order, so
+ * memory use is bounded by the packet buffer.
+ */
+class Nar_writer
+{
+	private:
+
+		enum { READ_WINDOW = 4 };
+
+		File_system::Session             &_fs;
+		File_system::Session::Tx::Source &_source;
+		Sink                             &_sink;
+
+		size_t                         _packet_size;
+		File_system::Packet_descriptor _raw[READ_WINDOW];
+		unsigned                       _count = 0;
+
+		void _string(string const &s) { writeString(s, _sink); }
+
+		void _file(File_system::Dir_handle dir, char const *name)
+		{
+			using namespace File_system;
+
+			File_handle handle = _fs.file(dir, name, READ_ONLY, false);
+			Handle_guard guard(_fs, handle);
+
+			file_size_t const size = _fs.status(handle).size;
+
+			/* the store has no executable bit */
+			_string("type"); _string("regular");
+			_string("contents");
+			writeLongLong(size, _sink);
+
+			seek_off_t offset = 0;
+			while (offset < size) {
+				Packet_descriptor acked[READ_WINDOW];
+				size_t            requested[READ_WINDOW];
+				seek_off_t const  base = offset;
+
+				unsigned n = 0;
+				for (seek_off_t pos = base; n < _count && pos < size; ++n) {
+					requested[n] = std::min(size - pos, (file_size_t)_packet_size);
+					_source.submit_packet(Packet_descriptor(
+						_raw[n], handle, Packet_descriptor::READ,
+						requested[n], pos));
+					pos += requested[n];
+				}
+
+				/* acknowledgements are not necessarily in order */
+				for (unsigned i = 0; i < n; ++i) {
+					Packet_descriptor packet = _source.get_acked_packet();
+					unsigned const j = (packet.position() - base) / _packet_size;
+					if (packet.position() < base || j >= n)
+						throw Error(format("unexpected packet reading ‘%1%’") % name);
+					acked[j] = packet;
+				}
+
+				for (unsigned i = 0; i < n; ++i) {
+					size_t const length = acked[i].length();
+					if (length != requested[i])
+						throw Error(format("short read of ‘%1%’") % name);
+					_sink((unsigned char const *)_source.packet_content(acked[i]), length);
+					offset += length;
+				}
+			}
+
+			writePadding(size, _sink);
+		}
+
+		void _symlink(File_system::Dir_handle dir, char const *name)
+		{
+			using namespace File_system;
+
+			Symlink_handle link = _fs.symlink(dir, name, false);
+			Handle_guard guard(_fs, link);
+
+			char target[MAX_PATH_LEN];
+			size_t const n = read(_fs, link, target, sizeof(target));
+
+			/* links written by the store carry a terminating byte */
+			size_t const len = strnlen(target, n);
+
+			_string("type"); _string("symlink");
+			_string("target"); _string(string(target, len));
+		}
+
+		void _directory(string const &path)
+		{
+			using namespace File_system;
+
+			Dir_handle dir = _fs.dir(path.c_str(), false);
+			Handle_guard guard(_fs, dir);
+
+			/* entries are serialised in name order */
+			std::map<string, Directory_entry::Type> entries;
+			Directory_entry dirent;
+			for (unsigned i = 0;
+			     read(_fs, dir, &dirent, sizeof(dirent), i*sizeof(dirent)) == sizeof(dirent);
+			     ++i)
+				entries[dirent.name] = dirent.type;
+
+			_string("type"); _string("directory");
+
+			for (auto const &e : entries) {
+				_string("entry"); _string("(");
+				_string("name");  _string(e.first);
+				_string("node");
+				_node(dir, path, e.first, e.second);
+				_string(")");
+			}
+		}
+
+		void _node(File_system::Dir_handle  dir,
+		           string           const  &parent,
+		           string           const  &name,
+		           File_system::Directory_entry::Type type)
+		{
+			using namespace File_system;
+
+			_string("(");
+			switch (type) {
+			case Directory_entry::TYPE_FILE:
+				_file(dir, name.c_str()); break;
+			case Directory_entry::TYPE_SYMLINK:
+				_symlink(dir, name.c_str()); break;
+			case Directory_entry::TYPE_DIRECTORY:
+				_directory(parent == "/" ? "/" + name : parent + "/" + name); break;
+			}
+			_string(")");
+		}
+
+	public:
+
+		Nar_writer(File_system::Session &fs, Sink &sink)
+		:
+			_fs(fs), _source(*fs.tx()), _sink(sink),
+			_packet_size(_source.bulk_buffer_size() / (2*READ_WINDOW))
+		{
+			collect_acknowledgements(_source);
+			try {
+				for (; _count < READ_WINDOW; ++_count)
+					_raw[_count] = _source.alloc_packet(_packet_size);
+			} catch (File_system::Session::Tx::Source::Packet_alloc_failed) {
+				if (!_count) throw;
+			}
+		}
+
+		~Nar_writer()
+		{
+			for (unsigned i = 0; i < _count; ++i)
+				_source.release_packet(_raw[i]);
+		}
+
+		/**
+		 * Write the archive of the object at the top of the store
+		 */
+		void dump(char const *name)
+		{
+			using namespace File_system;
+
+			Dir_handle root = _fs.dir("/", false);
+			Handle_guard guard(_fs, root);
+
+			Node_handle node = _fs.node((string("/") + name).c_str());
+			Status const status = _fs.status(node);
+			_fs.close(node);
+
+			Directory_entry::Type type = Directory_entry::TYPE_FILE;
+			if (status.mode == Status::MODE_DIRECTORY)
+				type = Directory_entry::TYPE_DIRECTORY;
+			else if (status.mode == Status::MODE_SYMLINK)
+				type = Directory_entry::TYPE_SYMLINK;
+
+			_string(narVersionMagic1);
+			_node(root, "/", name, type);
+		}
+};
+
+
+/**
+ * Reader of the NAR serialisation of a store object
+ *
+ * Nodes are written to a bulk ingest stream as they are parsed
+ * and are hashed as the server hashes them, so the name that the
+ * server reports is checked without reading the object back.
+ * The name of a node is hashed after its content, so the name of
+ * the root need not be known until the archive has been read.
+ */
+class Nar_reader
+{
+	private:
+
+		Source               &_source;
+		Ingest_stream_writer &_stream;
+
+		::Hash::Blake2s _root_hash;
+		char            _root_type = 0;
+
+		string _string() { return readString(_source); }
+
+		void _expect(char const *token)
+		{
+			if (_string() != token)
+				throw Error(format("bad archive: expected ‘%1%’") % token);
+		}
+
+		/**
+		 * Append the type and name of a node to its hash
+		 */
+		static void _digest(::Hash::Blake2s &hash, char type,
+		                    string const &name, uint8_t *buf)
+		{
+			uint8_t const tag[3] = { 0, (uint8_t)type, 0 };
+			hash.update(tag, sizeof(tag));
+			hash.update((uint8_t*)name.data(), name.size());
+			hash.digest(buf, hash.size());
+		}
+
+		void _file(::Hash::Blake2s &hash, string const &path)
+		{
+			using namespace Nix_store::Ingest_stream;
+
+			/* the store has no executable bit */
+			string token = _string();
+			if (token == "executable") {
+				_expect("");
+				token = _string();
+			}
+			if (token != "contents")
+				throw Error("bad archive: expected ‘contents’");
+
+			unsigned long long const size = readLongLong(_source);
+			_stream.record(TYPE_FILE, path, size);
+			_stream.fill(size, [&] (char *dst, size_t count) {
+				_source((unsigned char *)dst, count);
+				hash.update((uint8_t *)dst, count);
+				return count;
+			});
+			readPadding(size, _source);
+			_expect(")");
+		}
+
+		void _symlink(::Hash::Blake2s &hash, string const &path)
+		{
+			using namespace Nix_store::Ingest_stream;
+
+			_expect("target");
+			string const target = _string();
+			if (target.empty() || target.size() >= File_system::MAX_PATH_LEN)
+				throw Error(format("bad archive: invalid symlink ‘%1%’") % path);
+
+			_stream.record(TYPE_SYMLINK, path, target.size());
+			_stream.write(target.data(), target.size());
+			hash.update((uint8_t*)target.data(), target.size());
+			_expect(")");
+		}
+
+		void _directory(::Hash::Blake2s &hash, string const &path)
+		{
+			using namespace Nix_store::Ingest_stream;
+
+			_stream.record(TYPE_DIRECTORY, path, 0);
+
+			/* entries are in name order, as the server hashes them */
+			string prev;
+			for (string token = _string(); token != ")"; token = _string()) {
+				if (token != "entry")
+					throw Error("bad archive: expected ‘entry’");
+				_expect("("); _expect("name");
+
+				string const name = _string();
+				if (name.empty() || name == "." || name == ".."
+				 || name.find('/') != string::npos
+				 || (!prev.empty() && name <= prev))
+					throw Error(format("bad archive: invalid entry ‘%1%’") % name);
+				prev = name;
+
+				_expect("node");
+
+				::Hash::Blake2s child;
+				uint8_t         buf[Nix_store::MAX_NAME_LEN];
+
+				char const type = _node(child, path.empty() ? name : path + "/" + name);
+				_digest(child, type, name, buf);
+				hash.update(buf, hash.size());
+				_expect(")");
+			}
+		}
+
+		/**
+		 * Parse a node into the stream and hash its content
+		 *
+		 * \return type character of the node
+		 */
+		char _node(::Hash::Blake2s &hash, string const &path)
+		{
+			_expect("(");
+			_expect("type");
+
+			string const type = _string();
+			if (type == "regular") {
+				_file(hash, path);
+				return 'f';
+			}
+			if (type == "directory") {
+				_directory(hash, path);
+				return 'd';
+			}
+			/* the root of an object is a file or directory */
+			if (type == "symlink" && !path.empty()) {
+				_symlink(hash, path);
+				return 's';
+			}
+			throw Error(format("bad archive: unsupported node type ‘%1%’") % type);
+		}
+
+	public:
+
+		Nar_reader(Source &source, Ingest_stream_writer &stream)
+		: _source(source), _stream(stream) { }
+
+		/**
+		 * Read an archive into the stream
+		 */
+		void read()
+		{
+			if (_string() != narVersionMagic1)
+				throw Error("input doesn't look like a Nix archive");
+			_root_type = _node(_root_hash, "");
+		}
+
+		/**
+		 * Return the name that the object hashes to under 'name'
+		 */
+		string hashed_name(string const &name)
+		{
+			uint8_t buf[Nix_store::MAX_NAME_LEN];
+			_digest(_root_hash, _root_type, name, buf);
+			Store_hash::encode(buf, name.c_str(), sizeof(buf));
+			return (char *)buf;
+		}
+};
+
+
+void Store::stream_dir(Ingest_stream_writer &stream,
+                       nix::Path const      &src_path,
+                       string const         &dst_path)
 {
 	using namespace Vfs;
-	using namespace File_system;
+	using namespace Nix_store::Ingest_stream;
 
 	Directory_service::Dirent dirent;
 
@@ -137,55 +617,32 @@ void Store::copy_dir(File_system::Session   &fs,
 	}
 
 	for (auto i = entries.cbegin(); i != entries.cend(); ++i) {
-		nix::Path subpath = src_path + "/" + i->first;
-
-		nix::Path sub_src_path = src_path + "/" + i->first;
-		nix::Path sub_dst_path = dst_path + "/" + i->first;
+		nix::Path const sub_src_path = src_path + "/" + i->first;
+		string    const sub_dst_path = dst_path.empty()
+			? i->first : dst_path + "/" + i->first;
 
 		switch (i->second) {
-		case Directory_service::DIRENT_TYPE_DIRECTORY: {
-			File_system::Dir_handle sub_handle;
-			try {
-				sub_handle = fs.dir(sub_dst_path.c_str(), true);
-			} catch (...) {
-				Genode::error("error opening ingest directory handle for ", sub_dst_path.c_str());
-				throw;
-			}
-			File_system::Handle_guard sub_guard(fs, sub_handle);
-
-			copy_dir(fs, sub_handle, sub_src_path, sub_dst_path);
+		case Directory_service::DIRENT_TYPE_DIRECTORY:
+			stream.record(TYPE_DIRECTORY, sub_dst_path, 0);
+			stream_dir(stream, sub_src_path, sub_dst_path);
 			break;
-		}
-		
-		case Directory_service::DIRENT_TYPE_FILE: {
-			File_system::File_handle file_handle;
-			try {
-				file_handle = fs.file(ingest_dir, i->first.c_str(),
-				                      File_system::WRITE_ONLY, true);
-			} catch (...) {
-				Genode::error("error opening ingest file handle for ", sub_dst_path.c_str());
-				throw;
-			}
-			File_system::Handle_guard sub_guard(fs, file_handle);
 
-			copy_file(fs, file_handle, sub_src_path, sub_dst_path);
+		case Directory_service::DIRENT_TYPE_FILE:
+			stream_file(stream, sub_src_path, sub_dst_path);
 			break;
-		}
-		
-		case Directory_service::DIRENT_TYPE_SYMLINK: {
-			File_system::Symlink_handle link_handle;
-			try {
-				link_handle = fs.symlink(ingest_dir, i->first.c_str(), true);
-			} catch (...) {
-				Genode::error("error opening ingest symlink handle for ", sub_dst_path.c_str());
-				throw;
-			}
-			File_system::Handle_guard sub_guard(fs, link_handle);
 
-			copy_symlink(fs, link_handle, sub_src_path, sub_dst_path);
+		case Directory_service::DIRENT_TYPE_SYMLINK: {
+			char target[File_system::MAX_PATH_LEN];
+			file_size n;
+			if (_vfs->readlink(sub_src_path.c_str(), target, sizeof(target), n)
+			    != Directory_service::READLINK_OK)
+				throw Error(format("reading symlink ‘%1%’") % sub_src_path);
+
+			stream.record(TYPE_SYMLINK, sub_dst_path, n);
+			stream.write(target, n);
 			break;
 		}
-		
+
 		default:
 			Genode::error("skipping irregular file ", sub_src_path.c_str());
 		}
@@ -193,98 +650,33 @@ void Store::copy_dir(File_system::Session   &fs,
 }
 
 
-void Store::copy_file(File_system::Session    &fs,
-                             File_system::File_handle file_handle,
-                             nix::Path const         &src_path,
-                             nix::Path const         &dst_path)
+void Store::stream_file(Ingest_stream_writer &stream,
+                        nix::Path const      &src_path,
+                        string const         &dst_path)
 {
 	using namespace Vfs;
 
 	Directory_service::Stat stat = status(src_path);
-	file_size remaining_count    = stat.size;
-	file_size seek_offset        = 0;
 
 	Vfs_handle *vfs_handle = nullptr;
 	if (_vfs->open(src_path.c_str(),
 	                   Directory_service::OPEN_MODE_RDONLY,
 	                   &vfs_handle, *Genode::env()->heap()) != Directory_service::OPEN_OK)
-		throw Error(format("getting handle on file ‘%1%’") % dst_path);
+		throw Error(format("getting handle on file ‘%1%’") % src_path);
 	Vfs_handle::Guard vfs_guard(vfs_handle);
 
-	/* Preallocate the file space. */
-	fs.truncate(file_handle, remaining_count);
-
-	File_system::Session::Tx::Source &source = *fs.tx();
-	file_size const max_packet_size = source.bulk_buffer_size();
-
-	while (remaining_count) {
-		collect_acknowledgements(source);
-		size_t const curr_packet_size = std::min(remaining_count, max_packet_size);
-
-		File_system::Packet_descriptor
-			packet(source.alloc_packet(curr_packet_size),
-			       file_handle,
-			       File_system::Packet_descriptor::WRITE,
-			       0, seek_offset);
-		File_system::Packet_guard packet_guard(source, packet);
-
-		/* Read from the VFS to a packet. */
-		file_size vfs_count;
-		if (vfs_handle->fs().read(vfs_handle, source.packet_content(packet),
-		                          curr_packet_size, vfs_count) != File_io_service::READ_OK)
-			throw Error(format("reading file ‘%1%’") % dst_path);
-
-		packet.length(vfs_count);
-
-		/* pass packet to server side */
-		source.submit_packet(packet);
-
-		packet = source.get_acked_packet();
-		if (!packet.length())
-			throw nix::Error(format("writing file ‘%1%’") % dst_path);
-
-		/* prepare next iteration */
-		remaining_count -= packet.length();
-		if (remaining_count) {
-			seek_offset += packet.length();
-			vfs_handle->seek(seek_offset);
-		}
-	}
-}
-
-
-void Store::copy_symlink(File_system::Session       &fs,
-                                File_system::Symlink_handle symlink_handle,
-                                nix::Path const            &src_path,
-                                nix::Path const            &dst_path)
-{
-	using namespace Vfs;
-
-	File_system::Session::Tx::Source &source = *fs.tx();
-	bool success = false;
-	collect_acknowledgements(source);
-	File_system::Packet_descriptor
-		packet(source.alloc_packet(File_system::MAX_PATH_LEN),
-		       symlink_handle,
-		       File_system::Packet_descriptor::WRITE,
-		       0, 0);
-	File_system::Packet_guard packet_guard(source, packet);
-
-	/* Read from the VFS to a packet. */
-	file_size vfs_count;
-	if (_vfs->readlink(src_path.c_str(), source.packet_content(packet),
-	                            packet.size(), vfs_count) != Directory_service::READLINK_OK)
-		throw Error(format("reading symlink ‘%1%’") % src_path);
-	if (vfs_count) {
-		packet.length(vfs_count);
-
-		/* pass packet to server side */
-		source.submit_packet(packet);
+	stream.record(Nix_store::Ingest_stream::TYPE_FILE, dst_path, stat.size);
 
-		packet = source.get_acked_packet();
-		if (!packet.length())
-			throw Error(format("copying symlink ‘%1%’ to `%2%'") % src_path % dst_path);
-	}
+	/* read from the VFS directly into the stream packet */
+	file_size offset = 0;
+	stream.fill(stat.size, [&] (char *dst, size_t count) {
+		file_size n = 0;
+		vfs_handle->seek(offset);
+		if (vfs_handle->fs().read(vfs_handle, dst, count, n) != File_io_service::READ_OK)
+			throw Error(format("reading file ‘%1%’") % src_path);
+		offset += n;
+		return (size_t)n;
+	});
 }
 
 
@@ -407,7 +799,9 @@ Store::add_file(const string &name, nix::Path const &src_path)
 		offset    += packet.length();
 	}
 
-	return finalize_ingest(fs, name.c_str());
+	string const final_name = finalize_ingest(fs, name.c_str());
+	_store_session.add_temp_root(final_name.c_str());
+	return final_name;
 }
 
 
@@ -461,24 +855,82 @@ Store::hash_dir(uint8_t *buf, const string &name, nix::Path const &src_path)
 string
 Store::add_dir(const string &name, nix::Path const &src_path)
 {
-	using namespace File_system;
-
 	File_system::Connection fs(_env, _fs_tx_alloc, "ingest");
-	nix::Path const dst_path = "/" + name;
 
+	/* the whole tree is written as a single stream */
 	try_file_system([&] {
-		File_system::Dir_handle ingest_dir;
-		try { ingest_dir = fs.dir(dst_path.c_str(), true); }
-		catch (...) {
-			Genode::error("opening ingest directory handle for ", name.c_str());
-			throw;
-		}
-		File_system::Handle_guard dir_guard(fs, ingest_dir);
+		Ingest_stream_writer stream(fs, name);
+		stream.record(Nix_store::Ingest_stream::TYPE_DIRECTORY, "", 0);
+		stream_dir(stream, src_path, "");
+		stream.finish();
+	});
+
+	string const final_name = finalize_ingest(fs, name.c_str());
+	_store_session.add_temp_root(final_name.c_str());
+	return final_name;
+}
+
+
+nix::Path
+Store::import_path(Source &source)
+{
+	/* the object is renamed when the trailer has been read */
+	char const *stream_name = "import";
+
+	File_system::Connection fs(_env, _fs_tx_alloc, "ingest", "/",
+	                           true, NAR_TX_BUF_SIZE);
 
-		copy_dir(fs, ingest_dir, src_path, dst_path);
+	nix::Path path;
+	PathSet   references;
+	string    hashed_name;
+
+	try_file_system([&] {
+		Ingest_stream_writer stream(fs, stream_name);
+		Nar_reader           nar(source, stream);
+		nar.read();
+
+		if (readInt(source) != EXPORT_MAGIC)
+			throw Error("Nix archive cannot be imported; wrong format");
+
+		path       = readStorePath(source);
+		references = readStorePaths<PathSet>(source);
+		readString(source); /* the deriver is not recorded */
+		if (readInt(source) == 1)
+			readString(source); /* signature */
+
+		char const *object = path.c_str();
+		while (*object == '/') ++object;
+		if (strlen(object) <= Store_hash::HASH_PREFIX_LEN+1
+		 || object[Store_hash::HASH_PREFIX_LEN] != '-')
+			throw Error(format("invalid store path ‘%1%’") % path);
+
+		/* references are exported before their referrers */
+		for (auto const &ref : references)
+			if (ref != path && !isValidPath(ref))
+				throw Error(format("cannot import ‘%1%’, its reference ‘%2%’ is not valid")
+				            % path % ref);
+
+		string const name(object + Store_hash::HASH_PREFIX_LEN+1);
+		hashed_name = nar.hashed_name(name);
+		stream.finish(name);
 	});
 
-	return finalize_ingest(fs, name.c_str());
+	string const final_name = finalize_ingest(fs, stream_name);
+	_store_session.add_temp_root(final_name.c_str());
+	if (final_name != hashed_name)
+		throw Error(format("importPaths: %1% hashed locally to ‘%2%’ but ingest reports ‘%3%’")
+		            % path % hashed_name % final_name);
+
+	/* a derivation output is named by its inputs, not its content */
+	if ("/" + final_name != path)
+		Genode::warning(path.c_str(), " is not content-addressed, "
+		                "imported as /", final_name.c_str());
+
+	for (auto const &ref : references)
+		_store_session.add_reference(final_name.c_str(),
+		                             ref == path ? final_name.c_str() : ref.c_str());
+
+	return "/" + final_name;
 }
 
 
@@ -510,12 +962,25 @@ PathSet nix::Store::queryAllValidPaths() {
 	NOT_IMP; return PathSet(); };
 
 /* Query information about a valid path. */
-ValidPathInfo nix::Store::queryPathInfo(const Path & path) {
-	NOT_IMP; return ValidPathInfo(); };
+ValidPathInfo nix::Store::queryPathInfo(const Path & path)
+{
+	if (!isValidPath(path))
+		throw Error(format("path ‘%1%’ is not valid") % path);
+
+	/* the store does not record NAR hashes or sizes */
+	ValidPathInfo info;
+	info.path    = path;
+	info.deriver = queryDeriver(path);
+	queryReferences(path, info.references);
+	return info;
+};
 
 /* Query the hash of a valid path. */
-nix::Hash nix::Store::queryPathHash(const Path & path) {
-	NOT_IMP; return Hash(); };
+nix::Hash nix::Store::queryPathHash(const Path & path)
+{
+	/* objects are named by their content, NAR hashes are not kept */
+	throw Error(format("the store does not record the NAR hash of ‘%1%’") % path);
+};
 
 /* Query the set of outgoing FS references for a store path.	The
 	 result is not cleared. */
@@ -524,28 +989,59 @@ void nix::Store::queryReferences(const nix::Path & path,
 {
 	if (!isValidPath(path))
 		throw Error(format("path ‘%1%’ is not valid") % path);
+
+	Nix_store::Name name;
+	for (unsigned i = 0; _store_session.reference(path.c_str(), i, name); ++i)
+		references.insert("/" + string(name.string()));
 };
 
 	/* Queries the set of incoming FS references for a store path.
 	 The result is not cleared. */
 void nix::Store::queryReferrers(const nix::Path & path,
-		PathSet & referrers) { NOT_IMP; };
+		PathSet & referrers)
+{
+	Nix_store::Name name;
+	for (unsigned i = 0; _store_session.referrer(path.c_str(), i, name); ++i) {
+		/* referrers are not removed with the objects that refer */
+		nix::Path const referrer = "/" + string(name.string());
+		if (isValidPath(referrer))
+			referrers.insert(referrer);
+	}
+};
 
 /* Query the deriver of a store path.	Return the empty string if
 	 no deriver has been set. */
-nix::Path nix::Store::queryDeriver(const Path & path) {
-	NOT_IMP; return nix::Path(); };
+nix::Path nix::Store::queryDeriver(const Path & path)
+{
+	Nix_store::Name drv;
+	if (_store_session.deriver(path.c_str(), drv))
+		return "/" + string(drv.string());
+	return nix::Path();
+};
 
 /* Return all currently valid derivations that have `path' as an
 	 output.	(Note that the result of `queryDeriver()' is the
 	 derivation that was actually used to produce `path', which may
 	 not exist anymore.) */
-PathSet nix::Store::queryValidDerivers(const Path & path) {
-	NOT_IMP; return PathSet(); };
+PathSet nix::Store::queryValidDerivers(const Path & path)
+{
+	/* only the recorded deriver is known */
+	PathSet derivers;
+	nix::Path const drv = queryDeriver(path);
+	if (!drv.empty() && isValidPath(drv))
+		derivers.insert(drv);
+	return derivers;
+};
 
 /* Query the outputs of the derivation denoted by `path'. */
-PathSet nix::Store::queryDerivationOutputs(const Path & path) {
-	NOT_IMP; return PathSet(); };
+PathSet nix::Store::queryDerivationOutputs(const Path & path)
+{
+	PathSet outputs;
+	Nix_store::Name output;
+	for (unsigned i = 0; _store_session.output(path.c_str(), i, output); ++i)
+		outputs.insert("/" + string(output.string()));
+	return outputs;
+};
 
 /* Query the output names of the derivation denoted by `path'. */
 StringSet nix::Store::queryDerivationOutputNames(const Path & path) {
@@ -553,19 +1049,39 @@ StringSet nix::Store::queryDerivationOutputNames(const Path & path) {
 
 /* Query the full store path given the hash part of a valid store
 	 path, or "" if the path doesn't exist. */
-nix::Path nix::Store::queryPathFromHashPart(const string & hashPart) {
-	NOT_IMP; return Path(); };
+nix::Path nix::Store::queryPathFromHashPart(const string & hashPart)
+{
+	Nix_store::Name name;
+	if (_store_session.from_hash_part(hashPart.c_str(), name))
+		return "/" + string(name.string());
+	return Path();
+};
 
 /* Query which of the given paths have substitutes. */
-PathSet nix::Store::querySubstitutablePaths(const PathSet & paths) {
-	NOT_IMP; return PathSet(); };
+PathSet nix::Store::querySubstitutablePaths(const PathSet & paths)
+{
+	/* the store copies from its binary cache in place of a build */
+	PathSet res;
+	for (auto const &path : paths)
+		if (_store_session.substitutable(path.c_str()))
+			res.insert(path);
+	return res;
+};
 
 /* Query substitute info (i.e. references, derivers and download
 	 sizes) of a set of paths.	If a path does not have substitute
 	 info, it's omitted from the resulting ‘infos’ map. */
 void nix::Store::querySubstitutablePathInfos(const PathSet & paths,
-	                                                SubstitutablePathInfos & infos) {
-	NOT_IMP; };
+	                                                SubstitutablePathInfos & infos)
+{
+	/* the cache is a store directory, sizes and references are not kept */
+	for (auto const &path : querySubstitutablePaths(paths)) {
+		SubstitutablePathInfo info;
+		info.downloadSize = 0;
+		info.narSize      = 0;
+		infos[path] = info;
+	}
+};
 
 /**
  * Copy the contents of a path to the store and register the
@@ -594,6 +1110,7 @@ Store::addToStore(const string &name, const nix::Path &path,
 	if ((stat.mode&STAT_TYPE_MASK)==Vfs::Directory_service::STAT_MODE_DIRECTORY) {
 		hash_dir(buf, name, srcPath);
 		Store_hash::encode(buf, name.c_str(), sizeof(buf));
+		_store_session.add_temp_root((char *)buf);
 		if (_store_session.dereference(Genode::Cstring((char*)buf)) != "") {
 			return "/" + string((char *) buf);
 		}
@@ -602,6 +1119,7 @@ Store::addToStore(const string &name, const nix::Path &path,
 	} else if ((stat.mode&STAT_TYPE_MASK)==Vfs::Directory_service::STAT_MODE_FILE) {
 		hash_file(buf, name, srcPath);
 		Store_hash::encode(buf, name.c_str(), sizeof(buf));
+		_store_session.add_temp_root((char *)buf);
 		if (_store_session.dereference(Genode::Cstring((char *)buf)) != "") {
 			return "/" + string((char *) buf);
 		}
@@ -626,8 +1144,9 @@ nix::Path nix::Store::addTextToStore(const string & name, const string & text,
 	using namespace File_system;
 
 	string hashed_name = hash_text(name, text);
+	_store_session.add_temp_root(hashed_name.c_str());
 	if (_store_session.dereference(hashed_name.c_str()) != "")
-		return hashed_name;
+		return "/" + hashed_name;
 
 	{
 		debug(format("adding text ‘%1%’ to the store") % name);
@@ -676,9 +1195,13 @@ nix::Path nix::Store::addTextToStore(const string & name, const string & text,
 
 
 		nix::Path final_name = finalize_ingest(fs, name_str);
+		_store_session.add_temp_root(final_name.c_str());
 		if (final_name != hashed_name)
 			throw nix::Error(format("addTextToStore: %1% hashed locally to '%2%' but ingest reports `%3%' ") % name % hashed_name % final_name);
 
+		for (auto const &ref : references)
+			_store_session.add_reference(final_name.c_str(), ref.c_str());
+
 		return "/" + final_name;
 	}
 };
@@ -702,8 +1225,9 @@ nix::Path nix::Store::addDataToStore(const string & name,
 
 	hash.digest(path_buf, sizeof(path_buf));
 	Store_hash::encode(path_buf, name.c_str(), sizeof(path_buf));
+	_store_session.add_temp_root((char *)path_buf);
 	if (_store_session.dereference(Genode::Cstring((char*)path_buf)) != "")
-		return nix::Path((char *)path_buf);
+		return "/" + nix::Path((char *)path_buf);
 	{
 		debug(format("adding dataspace ‘%1%’ to the store") % name);
 
@@ -748,6 +1272,7 @@ nix::Path nix::Store::addDataToStore(const string & name,
 		}
 
 		nix::Path final_name = finalize_ingest(fs, name_str);
+		_store_session.add_temp_root(final_name.c_str());
 
 		if (final_name.compare((char *)path_buf))
 			throw nix::Error(format("addDataToStore: %1% hashed locally to '%2%' but ingest reports `%3%' ") % name % (char *)path_buf % final_name);
@@ -762,23 +1287,82 @@ nix::Path nix::Store::addDataToStore(const string & name,
 			 cryptographic signature (created by OpenSSL) of the preceding
 			 data is attached. */
 		void nix::Store::exportPath(const nix::Path & path, bool sign,
-				Sink & sink) { NOT_IMP; };
+				Sink & sink)
+		{
+			if (sign)
+				throw Error("signed exports are not supported");
+
+			/* an input-addressed path is a link to the content */
+			char const *name = path.c_str();
+			while (*name == '/') ++name;
+			Nix_store::Name const object = _store_session.dereference(name);
+			if (object == "")
+				throw Error(format("path ‘%1%’ is not valid") % path);
+
+			/* the marker before each dump is written by exportPaths() */
+			{
+				File_system::Connection fs(_env, _fs_tx_alloc, "store", "/",
+				                           false, NAR_TX_BUF_SIZE);
+				Nar_writer(fs, sink).dump(object.string());
+			}
+
+			PathSet references;
+			queryReferences(path, references);
+
+			writeInt(EXPORT_MAGIC, sink);
+			writeString(path, sink);
+			writeStrings(references, sink);
+			writeString(queryDeriver(path), sink);
+			writeInt(0, sink); /* no signature */
+		};
 
 		/* Import a sequence of NAR dumps created by exportPaths() into
 			 the Nix store. */
-		Paths nix::Store::importPaths(bool requireSignature, Source & source) {
-			NOT_IMP; return Paths(); };
+		Paths nix::Store::importPaths(bool requireSignature, Source & source)
+		{
+			if (requireSignature)
+				throw Error("the store cannot check the signatures of imports");
+
+			Paths paths;
+			for (;;) {
+				unsigned long long const n = readLongLong(source);
+				if (n == 0) break;
+				if (n != 1)
+					throw Error("input doesn't look like something created by ‘nix-store --export’");
+				paths.push_back(import_path(source));
+			}
+			return paths;
+		};
 
 		/* Add a store path as a temporary root of the garbage collector.
 			 The root disappears as soon as we exit. */
-		void nix::Store::addTempRoot(const nix::Path & path) { NOT_IMP; };
+		void nix::Store::addTempRoot(const nix::Path & path) {
+			_store_session.add_temp_root(path.c_str()); };
 
 		/* Add an indirect root, which is merely a symlink to `path' from
 			 /nix/var/nix/gcroots/auto/<hash of `path'>.	`path' is supposed
 			 to be a symlink to a store path.	The garbage collector will
 			 automatically remove the indirect root when it finds that
 			 `path' has disappeared. */
-		void nix::Store::addIndirectRoot(const nix::Path & path) { NOT_IMP; };
+		void nix::Store::addIndirectRoot(const nix::Path & path)
+		{
+			/* the root is named by the hash of the link */
+			::Hash::Blake2s hash;
+			uint8_t         buf[Nix_store::MAX_NAME_LEN];
+
+			hash.update((uint8_t*)path.data(), path.size());
+			hash.digest(buf, sizeof(buf));
+			Store_hash::encode(buf, "auto", sizeof(buf));
+
+			Path const target = readLink(path);
+			try { _store_session.add_root((char const *)buf, target.c_str()); }
+			catch (Nix_store::Invalid_root) {
+				throw Error(format("invalid root ‘%1%’ -> ‘%2%’") % path % target); }
+			catch (Nix_store::Root_exists) {
+				throw Error(format("root ‘%1%’ already refers to another object") % path); }
+			catch (Nix_store::Root_failed) {
+				throw Error(format("adding root ‘%1%’") % path); }
+		};
 
 		/* Acquire the global GC lock, then immediately release it.	This
 			 function must be called after registering a new permanent root,
@@ -798,15 +1382,45 @@ nix::Path nix::Store::addDataToStore(const string & name,
 				 permanent root and sees our's.
 
 			 In either case the permanent root is seen by the collector. */
-		void nix::Store::syncWithGC() { NOT_IMP; };
+		void nix::Store::syncWithGC()
+		{
+			/*
+			 * Roots added while the store is collecting are marked
+			 * as they are added, so there is nothing to wait for.
+			 */
+		};
 
 		/* Find the roots of the garbage collector.	Each root is a pair
 			 (link, storepath) where `link' is the path of the symlink
 			 outside of the Nix store that point to `storePath'.	*/
-		Roots nix::Store::findRoots() { NOT_IMP; return Roots(); };
+		Roots nix::Store::findRoots()
+		{
+			Roots roots;
+			Nix_store::Name link;
+			Nix_store::Name target;
+
+			for (unsigned i = 0; _store_session.root(i, link, target); ++i)
+				roots["/.gcroots/" + string(link.string())] =
+					"/" + string(target.string());
+			return roots;
+		};
 
 		/* Perform a garbage collection. */
-		void nix::Store::collectGarbage(const GCOptions & options, GCResults & results) { NOT_IMP; };
+		void nix::Store::collectGarbage(const GCOptions & options, GCResults & results)
+		{
+			if (options.action != GCOptions::gcDeleteDead)
+				throw Error("the store only supports deleting dead paths");
+
+			Genode::Signal_receiver sig_rec;
+			Genode::Signal_context  sig_ctx;
+
+			_store_session.collect_garbage(sig_rec.manage(&sig_ctx),
+			                               options.maxFreed);
+			sig_rec.wait_for_signal();
+			sig_rec.dissolve(&sig_ctx);
+
+			results.bytesFreed = _store_session.gc_result().bytes;
+		};
 
 		/* Return the set of paths that have failed to build.*/
 		PathSet nix::Store::queryFailedPaths() {
@@ -25,6 +25,8 @@
 #include <nix_store_session/connection.h>
 
 
+class Ingest_stream_writer;
+
 namespace nix {
 
 	class Store;
@@ -51,23 +53,17 @@ class nix::Store : public nix::StoreAPI
 		void hash_file(uint8_t *buf, const string &name, nix::Path const &src_path);
 		void hash_symlink(uint8_t *buf, const string &name, nix::Path const &src_path);
 
-		void copy_dir(File_system::Session   &fs,
-		              File_system::Dir_handle handle,
-		              nix::Path const         &src_path,
-		              nix::Path const         &dst_path);
-
-		void copy_file(File_system::Session  &fs,
-		               File_system::File_handle handle,
-		               nix::Path const         &src_path,
-		               nix::Path const         &dst_path);
+		void stream_dir(Ingest_stream_writer &stream,
+		                nix::Path const      &src_path,
+		                string const         &dst_path);
 
-		void copy_symlink(File_system::Session       &fs,
-		                  File_system::Symlink_handle symlink_handle,
-		                  nix::Path const            &src_path,
-		                  nix::Path const            &dst_path);
+		void stream_file(Ingest_stream_writer &stream,
+		                 nix::Path const      &src_path,
+		                 string const         &dst_path);
 
 		string add_file(const string &name, const nix::Path &path);
 		string add_dir(const string &name, const nix::Path &path);
+		nix::Path import_path(Source &source);
 
 	public:
 
@@ -0,0 +1,285 @@
+/*
+ * \brief  ROM session verified as its chunks are first touched
+ * \author Emery Hemingway
+ * \date   2017-02-23
+ *
+ * The dataspace handed to the client is a managed dataspace that
+ * starts out empty. A fault within it is resolved by hashing the
+ * chunk of the upstream ROM that holds the faulting address and
+ * attaching the chunk only if it matches its digest. A chunk that
+ * does not match is never attached and the faulting thread stays
+ * blocked.
+ *
+ * The digests of the chunks are leaves of a Merkle tree whose root
+ * is the 'sha256' digest of the policy, the leaves themselves are
+ * listed as base16 within a 'chunks' node of the policy:
+ *
+ * ! <policy label="..." sha256="<root>" chunk_size="65536">
+ * !   <chunks> <digest of chunk 0> <digest of chunk 1> ... </chunks>
+ * ! </policy>
+ *
+ * A leaf is the SHA256 of a zero byte followed by the chunk, a node
+ * is the SHA256 of a one byte followed by the two nodes below it,
+ * a node without a sibling is carried up to the next level as is.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _ROM_VERIFY__LAZY_ROM_H_
+#define _ROM_VERIFY__LAZY_ROM_H_
+
+/* Crypto++ includes */
+#include <sha.h>
+
+/* Genode includes */
+#include <os/session_policy.h>
+#include <rom_session/rom_session.h>
+#include <rm_session/connection.h>
+#include <region_map/client.h>
+#include <base/attached_dataspace.h>
+#include <base/rpc_server.h>
+#include <base/log.h>
+
+/* Nix includes */
+#include <store_hash/encode.h>
+
+namespace Rom_hash {
+	using namespace Genode;
+
+	class Lazy_rom;
+}
+
+
+class Rom_hash::Lazy_rom : public Genode::Rpc_object<Genode::Rom_session>
+{
+	public:
+
+		enum { DIGEST_SIZE = CryptoPP::SHA256::DIGESTSIZE };
+
+		struct Invalid_policy : Genode::Exception { };
+
+		/**
+		 * Return true if a policy asks for lazy verification
+		 */
+		static bool lazy(Session_policy const &policy) {
+			return policy.has_attribute("chunk_size"); }
+
+	private:
+
+		enum { MIN_CHUNK_SIZE = 4096 };
+
+		Genode::Env          &_env;
+		Genode::Allocator    &_alloc;
+		Session_label const   _label;
+		Dataspace_capability  _ds_cap;
+		Attached_dataspace    _upstream { _env.rm(), _ds_cap };
+		size_t const          _size = _checked_size(_upstream.size(), _label);
+		size_t const          _chunk_size;
+		size_t const          _chunk_count = (_size + _chunk_size - 1) / _chunk_size;
+		uint8_t              *_digests;
+		bool                  _failed = false;
+
+		Rm_connection     _rm { _env };
+		Region_map_client _map { _rm.create(_size) };
+
+		static void _leaf(uint8_t *digest, uint8_t const *chunk, size_t len)
+		{
+			byte const prefix = 0;
+			CryptoPP::SHA256 hash;
+			hash.Update(&prefix, 1);
+			hash.Update(chunk, len);
+			hash.Final(digest);
+		}
+
+		static void _node(uint8_t *digest, uint8_t const *left, uint8_t const *right)
+		{
+			byte const prefix = 1;
+			CryptoPP::SHA256 hash;
+			hash.Update(&prefix, 1);
+			hash.Update(left,  DIGEST_SIZE);
+			hash.Update(right, DIGEST_SIZE);
+			hash.Final(digest);
+		}
+
+		/**
+		 * An empty ROM has no chunks to check the root against
+		 */
+		static size_t _checked_size(size_t size, Session_label const &label)
+		{
+			if (!size) {
+				error("cannot verify empty ROM '", label, "' lazily");
+				throw Invalid_policy();
+			}
+			return size;
+		}
+
+		static size_t _checked_chunk_size(Session_policy const &policy)
+		{
+			size_t const size = policy.attribute_value("chunk_size", 0UL);
+			if (size < MIN_CHUNK_SIZE || (size & (size - 1))) {
+				error("'chunk_size' must be a power of two of at least ",
+				      (unsigned)MIN_CHUNK_SIZE, " on ", policy);
+				throw Invalid_policy();
+			}
+			return size;
+		}
+
+		/**
+		 * Read the leaf digests listed at the policy
+		 */
+		void _read_chunks(Session_policy const &policy)
+		{
+			Xml_node const chunks = policy.sub_node("chunks");
+
+			char const *p   = chunks.content_base();
+			char const *end = p + chunks.content_size();
+
+			for (size_t i = 0; i < _chunk_count; ++i) {
+				while (p < end && is_whitespace(*p)) ++p;
+
+				size_t len = 0;
+				while (p+len < end && !is_whitespace(p[len])) ++len;
+
+				if (!Store_hash::decode_base16(&_digests[i*DIGEST_SIZE],
+				                               DIGEST_SIZE, p, len))
+				{
+					error("invalid digest of chunk ", i, " on ", policy);
+					throw Invalid_policy();
+				}
+				p += len;
+			}
+
+			while (p < end && is_whitespace(*p)) ++p;
+			if (p != end) {
+				error("more chunks than ", _chunk_count, " on ", policy);
+				throw Invalid_policy();
+			}
+		}
+
+		/**
+		 * Check the leaf digests against the root digest
+		 */
+		bool _check_root(uint8_t const *root)
+		{
+			size_t const bytes = _chunk_count*DIGEST_SIZE;
+			uint8_t *level = (uint8_t *)_alloc.alloc(bytes);
+			memcpy(level, _digests, bytes);
+
+			for (size_t n = _chunk_count; n > 1; n = (n+1)/2) {
+				for (size_t i = 0; i < n/2; ++i)
+					_node(&level[i*DIGEST_SIZE],
+					      &level[(i*2)*DIGEST_SIZE],
+					      &level[(i*2+1)*DIGEST_SIZE]);
+				if (n & 1)
+					memcpy(&level[(n/2)*DIGEST_SIZE],
+					       &level[(n-1)*DIGEST_SIZE], DIGEST_SIZE);
+			}
+
+			bool const match = Store_hash::equal(level, root, DIGEST_SIZE);
+			_alloc.free(level, bytes);
+			return match;
+		}
+
+		bool _verify_chunk(size_t i)
+		{
+			size_t const offset = i*_chunk_size;
+			size_t const len    = min(_chunk_size, _size - offset);
+
+			uint8_t digest[DIGEST_SIZE];
+			_leaf(digest, _upstream.local_addr<uint8_t const>() + offset, len);
+			return Store_hash::equal(digest, &_digests[i*DIGEST_SIZE], DIGEST_SIZE);
+		}
+
+		void _handle_fault()
+		{
+			for (;;) {
+				Region_map::State const state = _map.state();
+				if (state.type == Region_map::State::READY || _failed)
+					return;
+
+				size_t const i = state.addr / _chunk_size;
+				if (i >= _chunk_count) {
+					error("fault outside of '", _label, "'");
+					_failed = true;
+					return;
+				}
+
+				if (!_verify_chunk(i)) {
+					error("verification failed for '", _label, "' at chunk ", i);
+					_failed = true;
+					return;
+				}
+
+				size_t const offset = i*_chunk_size;
+				_map.attach(_ds_cap, min(_chunk_size, _size - offset),
+				            offset, true, (addr_t)offset, true);
+			}
+		}
+
+		Signal_handler<Lazy_rom> _fault_handler {
+			_env.ep(), *this, &Lazy_rom::_handle_fault };
+
+	public:
+
+		/**
+		 * Constructor
+		 *
+		 * \param ds    dataspace of the upstream ROM session
+		 * \param root  root digest of the policy
+		 *
+		 * \throw Invalid_policy
+		 */
+		Lazy_rom(Genode::Env &env, Genode::Allocator &alloc,
+		         Session_label const &label,
+		         Dataspace_capability ds,
+		         Session_policy const &policy,
+		         uint8_t const *root)
+		:
+			_env(env), _alloc(alloc), _label(label), _ds_cap(ds),
+			_chunk_size(_checked_chunk_size(policy)),
+			_digests((uint8_t *)alloc.alloc(_chunk_count*DIGEST_SIZE))
+		{
+			try {
+				_read_chunks(policy);
+				if (!_check_root(root)) {
+					error("chunks do not match the digest of ", policy);
+					throw Invalid_policy();
+				}
+			} catch (Xml_node::Nonexistent_sub_node) {
+				error("no 'chunks' found on ", policy);
+				_alloc.free(_digests, _chunk_count*DIGEST_SIZE);
+				throw Invalid_policy();
+			} catch (...) {
+				_alloc.free(_digests, _chunk_count*DIGEST_SIZE);
+				throw;
+			}
+
+			_map.fault_handler(_fault_handler);
+			_env.ep().manage(*this);
+		}
+
+		~Lazy_rom()
+		{
+			_env.ep().dissolve(*this);
+			_alloc.free(_digests, _chunk_count*DIGEST_SIZE);
+		}
+
+
+		/***************************
+		 ** Rom_session interface **
+		 ***************************/
+
+		Rom_dataspace_capability dataspace() override {
+			return static_cap_cast<Rom_dataspace>(_map.dataspace()); }
+
+		/* the content of a verified ROM does not change */
+		bool update() override { return false; }
+		void sigh(Signal_context_capability) override { }
+};
+
+#endif /* _ROM_VERIFY__LAZY_ROM_H_ */
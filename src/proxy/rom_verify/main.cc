@@ -17,21 +17,27 @@
 /* Genode includes */
 #include <os/session_policy.h>
 #include <rom_session/connection.h>
+#include <dataspace/client.h>
 #include <base/attached_rom_dataspace.h>
 #include <base/heap.h>
+#include <util/reconstructible.h>
 #include <base/service.h>
 #include <base/session_label.h>
 #include <base/component.h>
 #include <base/log.h>
 
-static char const alph[0x10] = {
-	'0','1','2','3','4','5','6','7',
-	'8','9','a','b','c','d','e','f'
-};
+/* Nix includes */
+#include <store_hash/encode.h>
+
+/* Local includes */
+#include "lazy_rom.h"
+#include "workers.h"
 
 namespace Rom_hash {
 	using namespace Genode;
 
+	struct Verified;
+	struct Cache;
 	struct Session;
 	struct Main;
 
@@ -39,64 +45,186 @@ namespace Rom_hash {
 }
 
 
+/**
+ * Dataspace and the digest it hashed to
+ */
+struct Rom_hash::Verified : Genode::List<Verified>::Element
+{
+	Dataspace_capability const ds;
+	size_t               const size;
+
+	/* attached while a worker hashes it */
+	Constructible<Attached_dataspace> attached;
+
+	Hash_job job;
+	bool     hashed = false;
+
+	/* sessions that wait for the digest */
+	List<Session> waiting;
+
+	unsigned users = 0;
+	bool     stale = false;
+
+	Verified(Dataspace_capability ds, size_t size)
+	: ds(ds), size(size) { }
+
+	uint8_t const *digest() const { return job.digest; }
+};
+
+
+/**
+ * Dataspaces hashed for the open sessions
+ *
+ * Core hands out the same dataspace to each session of a ROM
+ * module, so a library loaded by every component is hashed once
+ * rather than at each component start, sessions that arrive while
+ * it is hashed wait for the same digest. An entry lives only as
+ * long as a session holds its dataspace, so the capability that
+ * keys it cannot be reused for other content.
+ */
+struct Rom_hash::Cache
+{
+	Allocator      &alloc;
+	List<Verified>  entries;
+
+	Cache(Allocator &alloc) : alloc(alloc) { }
+
+	Verified *lookup(Dataspace_capability ds, size_t size)
+	{
+		for (Verified *v = entries.first(); v; v = v->next())
+			if (!v->stale && v->ds == ds && v->size == size)
+				return v;
+		return nullptr;
+	}
+
+	Verified *lookup(Hash_job const &job)
+	{
+		for (Verified *v = entries.first(); v; v = v->next())
+			if (&v->job == &job)
+				return v;
+		return nullptr;
+	}
+
+	Verified &insert(Dataspace_capability ds, size_t size)
+	{
+		Verified *v = new (alloc) Verified(ds, size);
+		entries.insert(v);
+		return *v;
+	}
+
+	void release(Verified &v)
+	{
+		if (--v.users == 0) {
+			entries.remove(&v);
+			destroy(alloc, &v);
+		}
+	}
+};
+
+
 struct Rom_hash::Session :
 	Genode::Parent::Server,
-	Genode::Connection<Rom_session>
+	Genode::Connection<Rom_session>,
+	Genode::List<Session>::Element
 {
+	enum { DIGEST_SIZE = Hash_job::DIGEST_SIZE };
+
 	Parent::Client parent_client;
 
 	Id_space<Parent::Client>::Element client_id;
 	Id_space<Parent::Server>::Element server_id;
 
+	Session_label const label;
+
+	Cache    &cache;
+	Verified *verified = nullptr;
+
+	uint8_t expected[DIGEST_SIZE];
+
+	/* the client closed the session while it was hashed */
+	bool close_pending = false;
+
+	/* session served in place of the upstream session */
+	Constructible<Lazy_rom> lazy;
+
+	/**
+	 * The content of the dataspace may change with an update,
+	 * it must be hashed again for the next session
+	 */
+	void handle_update() {
+		if (verified) verified->stale = true; }
+
+	Signal_handler<Session> update_handler;
+
 	Session(Id_space<Parent::Client> &client_space,
 	        Id_space<Parent::Server> &server_space,
 	        Parent::Server::Id server_id,
-	        Genode::Env &env, Args const &args,
-	        Session_policy const &policy);
+	        Genode::Env &env, Allocator &alloc, Args const &args,
+	        Session_policy const &policy,
+	        Cache &cache);
+
+	~Session() { if (verified) cache.release(*verified); }
+
+	/**
+	 * Return true if the session waits for the digest of its dataspace
+	 */
+	bool pending() const { return verified && !verified->hashed; }
+
+	bool matches() const {
+		return Store_hash::equal(expected, verified->digest(), DIGEST_SIZE); }
+
+	/**
+	 * Capability to deliver to the client
+	 */
+	Capability<Rom_session> client_cap() {
+		return lazy.constructed() ? lazy->cap() : cap(); }
 };
 
 Rom_hash::Session::Session(Id_space<Parent::Client> &client_space,
                            Id_space<Parent::Server> &server_space,
                            Parent::Server::Id server_id,
-                           Genode::Env &env, Args const &args,
-                           Session_policy const &policy)
+                           Genode::Env &env, Allocator &alloc, Args const &args,
+                           Session_policy const &policy,
+                           Cache &cache)
 :
 	Connection<Rom_session>(env, session(env.parent(), args.string())),
 	client_id(parent_client, client_space),
-	server_id(*this, server_space, server_id)
+	server_id(*this, server_space, server_id),
+	label(label_from_args(args.string())),
+	cache(cache),
+	update_handler(env.ep(), *this, &Session::handle_update)
 {
-	/************
-	 ** verify **
-	 ************/
-
-	CryptoPP::SHA256 hash;
-	unsigned const digest_size = hash.DigestSize();
-	unsigned const encoded_size = digest_size*2+1;
-
-	char text[encoded_size];
-	uint8_t digest[digest_size];
+	char text[DIGEST_SIZE*2+1];
 
 	try {
-		policy.attribute("sha256").value(text, encoded_size);
+		policy.attribute("sha256").value(text, sizeof(text));
 	} catch (...) {
 		error("no 'sha256' digest found on ",policy);
 		throw;
 	}
 
-	/* read the connection dataspace */
+	if (!Store_hash::decode_base16(expected, DIGEST_SIZE, text, strlen(text))) {
+		error("invalid 'sha256' digest on ",policy);
+		throw ~0;
+	}
+
 	Rom_session_client rom(cap());
-	Attached_dataspace ds(env.rm(), rom.dataspace());
 
-	hash.CalculateDigest(digest, ds.local_addr<const byte>(), ds.size());
+	/* verify each chunk as it is first touched */
+	if (Lazy_rom::lazy(policy)) {
+		lazy.construct(env, alloc, label, rom.dataspace(), policy, expected);
+		return;
+	}
 
-	/* compare with hexadecimal */
-	for (unsigned i = 0, j = 0; i < digest_size; ++i)
-		if ((alph[digest[i] >> 4] != text[j++]) ||
-		    (alph[digest[i]&0x0F] != text[j++]))
-		{
-			error("verification failed for '",label_from_args(args.string()),"'");
-			throw ~0;
-		}
+	rom.sigh(update_handler);
+
+	Dataspace_capability const ds_cap = rom.dataspace();
+	size_t const size = Dataspace_client(ds_cap).size();
+
+	verified = cache.lookup(ds_cap, size);
+	if (!verified)
+		verified = &cache.insert(ds_cap, size);
+	++verified->users;
 }
 
 
@@ -112,6 +240,8 @@ struct Rom_hash::Main
 
 	Sliced_heap alloc { env.ram(), env.rm() };
 
+	Cache cache { alloc };
+
 	bool config_stale = false;
 
 	void handle_config() {
@@ -135,12 +265,78 @@ struct Rom_hash::Main
 		});
 	}
 
+	/**
+	 * Return true if a request is being served
+	 *
+	 * A request is listed until it is answered, so the
+	 * create requests of pending sessions are seen again.
+	 */
+	bool known(Parent::Server::Id id)
+	{
+		try {
+			server_id_space.apply<Session>(id, [&] (Session &) { });
+			return true;
+		} catch (Id_space<Parent::Server>::Unknown_id) { }
+		return false;
+	}
+
+	void close(Session &session, Parent::Session_response response)
+	{
+		Parent::Server::Id const id = session.server_id.id();
+		env.close(session.client_id.id());
+		destroy(alloc, &session);
+		env.parent().session_response(id, response);
+	}
+
+	/**
+	 * Answer a session whose dataspace is hashed
+	 */
+	void answer(Session &session)
+	{
+		if (session.close_pending) {
+			close(session, Parent::SESSION_CLOSED);
+
+		} else if (session.lazy.constructed() || session.matches()) {
+			env.parent().deliver_session_cap(
+				session.server_id.id(), session.client_cap());
+
+		} else {
+			error("verification failed for '",session.label,"'");
+			close(session, Parent::INVALID_ARGS);
+		}
+	}
+
+	void handle_hashed()
+	{
+		while (Hash_job *job = workers.finished()) {
+			Verified *v = cache.lookup(*job);
+			if (!v) continue;
+
+			v->attached.destruct();
+			v->hashed = true;
+
+			/* hold the entry while its sessions are answered */
+			++v->users;
+			while (Session *s = v->waiting.first()) {
+				v->waiting.remove(s);
+				answer(*s);
+			}
+			cache.release(*v);
+		}
+	}
+
 	Signal_handler<Main> config_handler {
 		env.ep(), *this, &Main::handle_config };
 
 	Signal_handler<Main> session_request_handler {
 		env.ep(), *this, &Main::handle_session_requests };
 
+	Signal_handler<Main> hashed_handler {
+		env.ep(), *this, &Main::handle_hashed };
+
+	Workers workers { env, alloc,
+		config_rom.xml().attribute_value("workers", 2U), hashed_handler };
+
 	Main(Genode::Env &env) : env(env)
 	{
 		config_rom.sigh(config_handler);
@@ -161,21 +357,39 @@ void Rom_hash::Main::handle_session_request(Xml_node request)
 		if (!request.has_sub_node("args"))
 			return;
 
+		if (known(server_id))
+			return;
+
 		typedef Session_state::Args Args;
 		Args const args = request.sub_node("args").decoded_content<Args>();
 
 		/* fetch and serve it again */
+		Session *session = nullptr;
 		try {
 			Session_label const label = label_from_args(args.string());
 			Session_policy const policy(label, config_rom.xml());
 
-			Session *session = new (alloc)
-				Session(env.id_space(), server_id_space, server_id, env, args, policy);
-			if (session)
-				env.parent().deliver_session_cap(server_id, session->cap());
+			session = new (alloc)
+				Session(env.id_space(), server_id_space, server_id, env, alloc, args, policy, cache);
 		} catch (...) {
 			env.parent().session_response(server_id, Parent::INVALID_ARGS);
+			return;
+		}
+
+		Verified *v = session->verified;
+		if (!v || v->hashed) {
+			answer(*session);
+			return;
 		}
+
+		/* the first session of a dataspace hands it to a worker */
+		if (!v->attached.constructed()) {
+			v->attached.construct(env.rm(), v->ds);
+			v->job.base = v->attached->local_addr<uint8_t const>();
+			v->job.size = v->attached->size();
+			workers.submit(v->job);
+		}
+		v->waiting.insert(session);
 	}
 
 	if (request.has_type("upgrade")) {
@@ -193,9 +407,12 @@ void Rom_hash::Main::handle_session_request(Xml_node request)
 
 	if (request.has_type("close")) {
 		server_id_space.apply<Session>(server_id, [&] (Session &session) {
-			env.close(session.client_id.id());
-			destroy(alloc, &session);
-			env.parent().session_response(server_id, Parent::SESSION_CLOSED);
+
+			/* the worker may still read the dataspace */
+			if (session.pending())
+				session.close_pending = true;
+			else
+				close(session, Parent::SESSION_CLOSED);
 		});
 	}
 
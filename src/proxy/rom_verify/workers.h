@@ -0,0 +1,128 @@
+/*
+ * \brief  Threads that hash ROM dataspaces
+ * \author Emery Hemingway
+ * \date   2017-02-23
+ *
+ * Session requests are answered at the entrypoint, only the hashing
+ * of dataspaces is handed to the workers. The session of a small ROM
+ * is not held back by that of a large one and the large ROMs of a
+ * boot storm are hashed side by side. Finished jobs are returned to
+ * the entrypoint with a signal.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _ROM_VERIFY__WORKERS_H_
+#define _ROM_VERIFY__WORKERS_H_
+
+/* Crypto++ includes */
+#include <sha.h>
+
+/* Genode includes */
+#include <base/thread.h>
+#include <base/semaphore.h>
+#include <base/lock.h>
+#include <base/signal.h>
+#include <util/fifo.h>
+
+namespace Rom_hash {
+	using namespace Genode;
+
+	struct Hash_job;
+	class Workers;
+}
+
+
+struct Rom_hash::Hash_job : Genode::Fifo<Hash_job>::Element
+{
+	enum { DIGEST_SIZE = CryptoPP::SHA256::DIGESTSIZE };
+
+	uint8_t const *base = nullptr;
+	size_t         size = 0;
+	uint8_t        digest[DIGEST_SIZE];
+};
+
+
+class Rom_hash::Workers
+{
+	private:
+
+		enum { STACK_SIZE = 4*1024*sizeof(long) };
+
+		struct Worker : Genode::Thread
+		{
+			Workers &workers;
+
+			Worker(Genode::Env &env, Workers &workers)
+			: Thread(env, "worker", STACK_SIZE), workers(workers) { start(); }
+
+			void entry() override { for (;;) workers._process(); }
+		};
+
+		Genode::Lock           _lock;
+		Genode::Semaphore      _pending;
+		Genode::Fifo<Hash_job> _queue;
+		Genode::Fifo<Hash_job> _finished;
+
+		Genode::Signal_context_capability _finished_sigh;
+
+		void _process()
+		{
+			_pending.down();
+
+			Hash_job *job = nullptr;
+			{
+				Genode::Lock::Guard guard(_lock);
+				job = _queue.dequeue();
+			}
+			if (!job) return;
+
+			CryptoPP::SHA256().CalculateDigest(job->digest, job->base, job->size);
+
+			{
+				Genode::Lock::Guard guard(_lock);
+				_finished.enqueue(job);
+			}
+			Genode::Signal_transmitter(_finished_sigh).submit();
+		}
+
+	public:
+
+		Workers(Genode::Env &env, Genode::Allocator &alloc, unsigned count,
+		        Genode::Signal_context_capability finished_sigh)
+		: _finished_sigh(finished_sigh)
+		{
+			for (unsigned i = 0; i < max(count, 1U); ++i)
+				new (alloc) Worker(env, *this);
+		}
+
+		/**
+		 * Queue a dataspace to be hashed
+		 *
+		 * The dataspace must stay attached until the job is finished.
+		 */
+		void submit(Hash_job &job)
+		{
+			{
+				Genode::Lock::Guard guard(_lock);
+				_queue.enqueue(&job);
+			}
+			_pending.up();
+		}
+
+		/**
+		 * Take a finished job, to be called from the entrypoint
+		 */
+		Hash_job *finished()
+		{
+			Genode::Lock::Guard guard(_lock);
+			return _finished.dequeue();
+		}
+};
+
+#endif /* _ROM_VERIFY__WORKERS_H_ */
@@ -7,6 +7,12 @@
  * Incoming session requestes are rewritten with
  * the result of a Nix evaulation and forwarded
  * by the parent to a ROM or File_system service.
+ *
+ * Evaluations are done by a thread of their own
+ * so that a long evaluation does not hold back
+ * the upgrade and close requests of other
+ * sessions. The state of the evaluator is not
+ * shared, so there is only one such thread.
  */
 
 /*
@@ -23,6 +29,7 @@
 #include <eval.hh>
 #include <get-drvs.hh>
 #include <store.hh>
+#include <serialise.hh>
 #include <util.hh>
 
 /* Genode includes */
@@ -34,6 +41,10 @@
 #include <root/root.h>
 #include <base/attached_rom_dataspace.h>
 #include <util/reconstructible.h>
+#include <util/fifo.h>
+#include <base/thread.h>
+#include <base/semaphore.h>
+#include <base/lock.h>
 #include <base/heap.h>
 #include <base/component.h>
 #include <base/log.h>
@@ -64,7 +75,66 @@ struct Nix::Main
 			server_id(*this, server_space, server_id) { }
 	};
 
+	/**
+	 * Create request that waits for its evaluation
+	 */
+	struct Evaluation : Parent::Server, Fifo<Evaluation>::Element
+	{
+		Id_space<Parent::Server>::Element server_id;
+
+		Genode::Service::Name const service;
+		Session_state::Args   const args;
+		Session_label         const label;
+
+		/* copy of the policy, the config may change meanwhile */
+		Allocator    &alloc;
+		size_t const  policy_len;
+		char         *policy;
+
+		nix::Path out;
+
+		/* the client closed the session before it was evaluated */
+		bool close_pending = false;
+
+		Evaluation(Id_space<Parent::Server> &space, Parent::Server::Id id,
+		           Genode::Service::Name const &service,
+		           Session_state::Args const &args,
+		           Allocator &alloc, Xml_node policy_node)
+		:
+			server_id(*this, space, id),
+			service(service), args(args),
+			label(label_from_args(args.string())),
+			alloc(alloc), policy_len(policy_node.size()),
+			policy((char *)alloc.alloc(policy_len))
+		{
+			memcpy(policy, policy_node.addr(), policy_len);
+		}
+
+		~Evaluation() { alloc.free(policy, policy_len); }
+	};
+
+	/**
+	 * Thread that evaluates the queued requests
+	 */
+	struct Evaluator : Genode::Thread
+	{
+		/*
+		 * XXX: Nix uses this stack for the evaluation,
+		 * so the threat of a blown stack depends on
+		 * the complexity of the evaulation.
+		 */
+		enum { STACK_SIZE = 32*1024*sizeof(long) };
+
+		Main &main;
+
+		Evaluator(Genode::Env &env, Main &main)
+		: Thread(env, "evaluator", STACK_SIZE), main(main) { start(); }
+
+		void entry() override { for (;;) main.evaluate(); }
+	};
+
 	Id_space<Parent::Server> server_id_space;
+	Id_space<Parent::Server> evaluation_id_space;
 
 	Genode::Env &env;
 
@@ -89,6 +159,12 @@ struct Nix::Main
 
 		nix::EvalState  eval_state;
 
+		/*
+		 * Outputs of earlier evaluations, keyed by the digest of
+		 * the policy file and the arguments of the evaluation
+		 */
+		std::map<nix::string, nix::Path> memo;
+
 		Internal_state(Genode::Env &env,
 		               Genode::Allocator &allocator,
 		               Genode::Xml_node config)
@@ -101,10 +177,107 @@ struct Nix::Main
 	Genode::Constructible<Internal_state>
 		state { env, heap, config_rom.xml() };
 
+	/*
+	 * The evaluator uses the state and the config while 'evaluating'
+	 * is set. Handlers at the entrypoint do not wait for an evaluation
+	 * to finish, they defer their work and are signaled again when the
+	 * evaluator is done.
+	 */
+	Genode::Lock state_lock;
+	bool         evaluating        = false;
+	bool         deferred_requests = false;
+	bool         deferred_yield    = false;
+
+	Genode::Semaphore        evaluations_pending;
+	Genode::Lock             evaluations_lock;
+	Genode::Fifo<Evaluation> evaluations_queued;
+	Genode::Fifo<Evaluation> evaluations_done;
+
+	enum { MEMO_MAGIC = 0x6e786d31 };
+
+	/**
+	 * File that keeps the memo while the state is freed
+	 *
+	 * The file is expected at the VFS, such as on a RAM file
+	 * system. Without a 'memo_file' at the config the memo is
+	 * lost when the state is freed.
+	 */
+	nix::Path memo_file()
+	{
+		typedef Genode::String<256> Path;
+		return config_rom.xml().attribute_value("memo_file", Path()).string();
+	}
+
+	/**
+	 * Digest of the config the memo was made under
+	 *
+	 * The policies are part of the config, so a memo saved
+	 * under another config may resolve sessions to outputs
+	 * that the current policies would not choose.
+	 */
+	nix::string config_digest()
+	{
+		Xml_node const config = config_rom.xml();
+		return nix::printHash(nix::hashString(nix::htSHA256,
+			nix::string(config.addr(), config.size())));
+	}
+
+	void save_memo()
+	{
+		nix::Path const path = memo_file();
+		if (path == "" || !state.constructed())
+			return;
+
+		nix::handleExceptions("nix server", [&] {
+			nix::StringSink sink;
+			nix::writeInt(MEMO_MAGIC, sink);
+			nix::writeString(config_digest(), sink);
+			nix::writeInt(state->memo.size(), sink);
+			for (auto const &entry : state->memo) {
+				nix::writeString(entry.first, sink);
+				nix::writeString(entry.second, sink);
+			}
+			nix::writeFile(path, sink.s);
+		});
+	}
+
+	void load_memo()
+	{
+		nix::Path const path = memo_file();
+		if (path == "" || !state.constructed())
+			return;
+
+		nix::handleExceptions("nix server", [&] {
+			if (!nix::pathExists(path))
+				return;
+
+			nix::StringSource source(nix::readFile(path));
+			if (nix::readInt(source) != MEMO_MAGIC) {
+				Genode::warning("ignoring invalid memo at ", path.c_str());
+				return;
+			}
+
+			/* drop a memo left from another config */
+			if (nix::readString(source) != config_digest()) {
+				nix::deletePath(path);
+				return;
+			}
+
+			/* the outputs are checked as the entries are used */
+			for (unsigned n = nix::readInt(source); n; --n) {
+				nix::string const key = nix::readString(source);
+				state->memo[key] = nix::readString(source);
+			}
+		});
+	}
+
 	Internal_state &alloc_state()
 	{
-		if (!state.constructed()) nix::handleExceptions("nix server", [&] {
-			state.construct(env, heap, config_rom.xml()); });
+		if (!state.constructed()) {
+			nix::handleExceptions("nix server", [&] {
+				state.construct(env, heap, config_rom.xml()); });
+			load_memo();
+		}
 
 		if (!state.constructed())
 			throw Root::Unavailable();
@@ -126,11 +299,78 @@ struct Nix::Main
 
 	void handle_session_request(Xml_node request);
 
+	/**
+	 * Evaluate the next queued request, called by the evaluator
+	 */
+	void evaluate();
+
+	/**
+	 * Forward the evaluated request to the service it resolved to
+	 */
+	void forward(Evaluation &evaluation);
+
+	void handle_evaluated()
+	{
+		for (;;) {
+			Evaluation *evaluation = nullptr;
+			{
+				Genode::Lock::Guard guard(evaluations_lock);
+				evaluation = evaluations_done.dequeue();
+			}
+			if (!evaluation) return;
+
+			Parent::Server::Id const id = evaluation->server_id.id();
+			if (evaluation->close_pending)
+				env.parent().session_response(id, Parent::SESSION_CLOSED);
+			else
+				forward(*evaluation);
+			destroy(heap, evaluation);
+		}
+	}
+
+	/**
+	 * Return true if a request is being served
+	 *
+	 * A request is listed until it is answered, so the
+	 * create requests of pending evaluations are seen again.
+	 */
+	bool known(Parent::Server::Id id)
+	{
+		try {
+			evaluation_id_space.apply<Evaluation>(id, [&] (Evaluation &) { });
+			return true;
+		} catch (Id_space<Parent::Server>::Unknown_id) { }
+
+		try {
+			server_id_space.apply<Session>(id, [&] (Session &) { });
+			return true;
+		} catch (Id_space<Parent::Server>::Unknown_id) { }
+
+		return false;
+	}
+
 	void handle_session_requests()
 	{
 		if (config_stale) {
+			Genode::Lock::Guard guard(state_lock);
+
+			/* requests are handled under the new policies */
+			if (evaluating) {
+				deferred_requests = true;
+				return;
+			}
+
 			config_rom.update();
 			config_stale = false;
+
+			/* policies may now resolve differently */
+			if (state.constructed())
+				state->memo.clear();
+			nix::handleExceptions("nix server", [&] {
+				nix::Path const path = memo_file();
+				if (path != "" && nix::pathExists(path))
+					nix::deletePath(path);
+			});
 		}
 
 		session_requests.update();
@@ -143,10 +383,22 @@ struct Nix::Main
 	/**
 	 * This lazy kind of work can get expensive
 	 * so destroy the state when the parent asks
-	 * for resources.
+	 * for resources. The memo is saved first so
+	 * that known sessions are not evaluated again.
+	 * During an evaluation the parent is answered
+	 * once the evaluation is done.
 	 */
 	void yield()
 	{
+		Genode::Lock::Guard guard(state_lock);
+
+		if (evaluating) {
+			deferred_yield = true;
+			return;
+		}
+
+		save_memo();
+
 		Genode::size_t const before = env.ram().avail();
 		free();
 		Genode::size_t const after = env.ram().avail();
@@ -163,10 +415,16 @@ struct Nix::Main
 	Signal_handler<Main> yield_handler
 		{ env.ep(), *this, &Main::yield };
 
+	Signal_handler<Main> evaluated_handler
+		{ env.ep(), *this, &Main::handle_evaluated };
+
+	Evaluator evaluator { env, *this };
+
 	Main(Genode::Env &env) : env(env)
 	{
 		/* initialize the Nix libraries */
 		nix::handleExceptions("nix server", [&] { nix::initNix(vfs); });
+		load_memo();
 
 		config_rom.sigh(config_handler);
 		session_requests.sigh(session_request_handler);
@@ -206,18 +464,66 @@ nix::Path Nix::Main::realise(Genode::Xml_node const policy,
 	Internal_state &state = alloc_state();
 
 
-	/****************
-	 ** Parse file **
-	 ****************/
-
 	/* XXX: use the string methods from Xml_node */
+	nix::Path file = "/default.nix";
 	try {
 		policy.attribute("file").value(tmp_buf, sizeof(tmp_buf));
-		e = state.eval_state.parseExprFromFile(nix::Path(tmp_buf));
+		file = tmp_buf;
+	} catch (Xml_node::Nonexistent_attribute) { }
+
+	string attr_path;
+	try {
+		policy.attribute("attr").value(tmp_buf, sizeof(tmp_buf));
+		attr_path = tmp_buf;
+	} catch (Xml_node::Nonexistent_attribute) { }
+
+	/*
+	 * XXX: All session arguments should be passed
+	 * but Arg_string does not support iteration.
+	 */
+
+	enum { ARG_MAX_LEN = 128 };
+	char root_arg[ARG_MAX_LEN];
 
-	} catch (Xml_node::Nonexistent_attribute) {
-		e = state.eval_state.parseExprFromFile("/default.nix");
+	Arg_string::find_arg(session_args.string(), "root").string(
+		root_arg, sizeof(root_arg), "");
+
+
+	/**********
+	 ** Memo **
+	 **********/
+
+	/*
+	 * An evaluation is repeated for each session of the same
+	 * binary, so its output is remembered for as long as the
+	 * policy file does not change. Files imported by the policy
+	 * are not tracked, these change with the config or not at all.
+	 */
+	string const memo_key =
+		printHash(hashString(htSHA256, readFile(file))) + '\0' +
+		attr_path + '\0' + service.string() + '\0' +
+		label.string() + '\0' + root_arg;
+
+	auto const memo = state.memo.find(memo_key);
+	if (memo != state.memo.end()) {
+		try {
+			Nix_store::Name out_name =
+				state.eval_state.store().store_session().dereference(
+					memo->second.c_str());
+			if (out_name != "")
+				return out_name.string();
+		} catch (...) { }
+
+		/* the output is gone, evaluate again */
+		state.memo.erase(memo);
 	}
+
+
+	/****************
+	 ** Parse file **
+	 ****************/
+
+	e = state.eval_state.parseExprFromFile(file);
 	state.eval_state.eval(e, root_value);
 
 	/***********************
@@ -231,18 +537,8 @@ nix::Path Nix::Main::realise(Genode::Xml_node const policy,
 		label_str += label.string();
 		arg_map["label"] = label_str;
 
-		/*
-		 * XXX: All session arguments should be passed
-		 * but Arg_string does not support iteration.
-		 */
-
-		enum { ARG_MAX_LEN = 128 };
-		char arg[ARG_MAX_LEN];
-
-		Arg_string::find_arg(session_args.string(), "root").string(
-			arg, sizeof(arg), "");
-		if (arg[0])
-			arg_map["root"] = arg;
+		if (root_arg[0])
+			arg_map["root"] = root_arg;
 	}
 
 	Bindings &args(*evalAutoArgs(state.eval_state, arg_map));
@@ -252,15 +548,8 @@ nix::Path Nix::Main::realise(Genode::Xml_node const policy,
 	 ** Find attribute **
 	 ********************/
 
-	Value *entry;
-	try {
-		policy.attribute("attr").value(tmp_buf, sizeof(tmp_buf));
-		entry = findAlongAttrPath(
-			state.eval_state, tmp_buf, args, root_value);
-	} catch (Xml_node::Nonexistent_attribute) {
-		entry = findAlongAttrPath(
-			state.eval_state, "", args, root_value);
-	}
+	Value *entry = findAlongAttrPath(
+		state.eval_state, attr_path, args, root_value);
 
 
 	/*************
@@ -289,110 +578,175 @@ nix::Path Nix::Main::realise(Genode::Xml_node const policy,
 	/* XXX: and if out is not a top level store element? */
 	Nix_store::Name out_name =
 		state.eval_state.store().store_session().dereference(out.c_str());
+
+	state.memo[memo_key] = out;
 	return out_name.string();
 }
 
 
-void Nix::Main::handle_session_request(Genode::Xml_node request)
+void Nix::Main::evaluate()
+{
+	evaluations_pending.down();
+
+	Evaluation *evaluation = nullptr;
+	{
+		Genode::Lock::Guard guard(evaluations_lock);
+		evaluation = evaluations_queued.dequeue();
+	}
+	if (!evaluation) return;
+
+	Evaluation &e = *evaluation;
+
+	if (!e.close_pending) {
+		{
+			Genode::Lock::Guard guard(state_lock);
+			evaluating = true;
+		}
+
+		try {
+			Xml_node const policy(e.policy, e.policy_len);
+			nix::handleExceptions("nix", [&] {
+				e.out = realise(policy, e.service, e.label, e.args);
+			});
+		} catch (...) {
+			Genode::error("caught unhandled exception while evaluating '",e.service,":",e.label,"'");
+			e.out = "";
+		}
+
+		/* resume the work deferred by the entrypoint */
+		Genode::Lock::Guard guard(state_lock);
+		evaluating = false;
+		if (deferred_requests) {
+			deferred_requests = false;
+			Signal_transmitter(session_request_handler).submit();
+		}
+		if (deferred_yield) {
+			deferred_yield = false;
+			Signal_transmitter(yield_handler).submit();
+		}
+	}
+
+	{
+		Genode::Lock::Guard guard(evaluations_lock);
+		evaluations_done.enqueue(evaluation);
+	}
+	Signal_transmitter(evaluated_handler).submit();
+}
+
+
+void Nix::Main::forward(Evaluation &evaluation)
 {
 	using namespace Genode;
 
-	if (!request.has_attribute("id"))
+	Parent::Server::Id    const  server_id = evaluation.server_id.id();
+	Genode::Service::Name const &service   = evaluation.service;
+	Session_state::Args   const &args      = evaluation.args;
+	Session_label         const &label     = evaluation.label;
+	nix::Path                    out       = evaluation.out;
+
+	if (out == "") {
+		Genode::error("no evaluation for '",service,":",label,"'");
+		env.parent().session_response(server_id, Parent::INVALID_ARGS);
 		return;
+	}
 
-	Parent::Server::Id const server_id { request.attribute_value("id", 0UL) };
+	if (out.length() >= Vfs::MAX_PATH_LEN) {
+		Genode::error("'",service,":",label,"' did not resolve to a store object");
+		env.parent().session_response(server_id, Parent::INVALID_ARGS);
+		return;
+	}
 
-	if (request.has_type("create")) {
+	enum { ARGS_MAX_LEN = 256 };
+	char new_args[ARGS_MAX_LEN];
 
-		if (!request.has_sub_node("args"))
-			return;
+	strncpy(new_args, args.string(), ARGS_MAX_LEN);
 
-		Genode::Service::Name const service =
-			request.attribute_value("service", Service::Name());
+	// XXX: slash hack
+	while (out.front() == '/')
+		out.erase(0,1);
 
-		Session_state::Args const args =
-			request.sub_node("args").decoded_content<Session_state::Args>();
+	Session_label const new_label = prefixed_label(
+		Session_label("store"),
+		Session_label(out.c_str()));
 
-		Session_label const label = label_from_args(args.string());
-		nix::Path out;
+	Arg_string::set_arg_string(
+		new_args, ARGS_MAX_LEN, "label", new_label.string());
 
-		try {
-			try {
-				Session_policy policy(label, config_rom.xml());
-				nix::handleExceptions("nix", [&] {
-					out = realise(policy, service, label, args);
-				});
-			} catch (Session_policy::No_policy_defined) {
-				nix::handleExceptions("nix", [&] {
-					out = realise(Xml_node(
-						"<default-policy/>"), service, label, args);
-				});
-			}
-		} catch (...) {
-			Genode::error("caught unhandled exception while evaluating '",service,":",label,"'");
-			env.parent().session_response(server_id, Parent::INVALID_ARGS);
-			return;
-		}
+	/* allocate session meta-data */
+	Session *session = nullptr;
+	try {
+		session = new (heap)
+			Session(env.id_space(), server_id_space, server_id);
 
-		if (out == "") {
-			Genode::error("no evaluation for '",service,":",label,"'");
-			env.parent().session_response(server_id, Parent::INVALID_ARGS);
-			return;
-		}
+		Affinity aff;
+		Session_capability cap =
+			env.session(service.string(), session->client_id.id(),
+			            new_args, aff);
 
-		if (out.length() >= Vfs::MAX_PATH_LEN) {
-			Genode::error("'",service,":",label,"' did not resolve to a store object");
-			env.parent().session_response(server_id, Parent::INVALID_ARGS);
-			return;
-		}
+		env.parent().deliver_session_cap(server_id, cap);
+		return;
+	}
 
-		enum { ARGS_MAX_LEN = 256 };
-		char new_args[ARGS_MAX_LEN];
+	catch (Parent::Service_denied) {
+		warning("'", new_label, "' was denied"); }
 
-		strncpy(new_args, args.string(), ARGS_MAX_LEN);
+	catch (Service::Unavailable) {
+		warning("'", new_label, "' is unavailable"); }
 
-		// XXX: slash hack
-		while (out.front() == '/')
-			out.erase(0,1);
+	catch (Service::Invalid_args)   {
+		warning("'", new_label, "' received invalid args"); }
 
-		Session_label const new_label = prefixed_label(
-			Session_label("store"),
-			Session_label(out.c_str()));
+	catch (Service::Quota_exceeded) {
+		warning("'", new_label, "' quota donation was insufficient"); }
 
-		Arg_string::set_arg_string(
-			new_args, ARGS_MAX_LEN, "label", new_label.string());
+	if (session)
+		destroy(heap, session);
 
-		/* allocate session meta-data */
-		Session *session = nullptr;
-		try {
-			session = new (heap)
-				Session(env.id_space(), server_id_space, server_id);
+	env.parent().session_response(server_id, Parent::INVALID_ARGS);
+}
+
+
+void Nix::Main::handle_session_request(Genode::Xml_node request)
+{
+	using namespace Genode;
 
-			Affinity aff;
-			Session_capability cap =
-				env.session(service.string(), session->client_id.id(),
-				            new_args, aff);
+	if (!request.has_attribute("id"))
+		return;
+
+	Parent::Server::Id const server_id { request.attribute_value("id", 0UL) };
 
-			env.parent().deliver_session_cap(server_id, cap);
+	if (request.has_type("create")) {
+
+		if (!request.has_sub_node("args"))
 			return;
-		}
 
-		catch (Parent::Service_denied) {
-			warning("'", new_label, "' was denied"); }
+		if (known(server_id))
+			return;
 
-		catch (Service::Unavailable) {
-			warning("'", new_label, "' is unavailable"); }
+		Genode::Service::Name const service =
+			request.attribute_value("service", Service::Name());
 
-		catch (Service::Invalid_args)   {
-			warning("'", new_label, "' received invalid args"); }
+		Session_state::Args const args =
+			request.sub_node("args").decoded_content<Session_state::Args>();
 
-		catch (Service::Quota_exceeded) {
-			warning("'", new_label, "' quota donation was insufficient"); }
+		Session_label const label = label_from_args(args.string());
 
-		if (session)
-				destroy(heap, session);
+		Evaluation *evaluation = nullptr;
+		try {
+			Session_policy const policy(label, config_rom.xml());
+			evaluation = new (heap)
+				Evaluation(evaluation_id_space, server_id, service, args, heap, policy);
+		} catch (Session_policy::No_policy_defined) {
+			evaluation = new (heap)
+				Evaluation(evaluation_id_space, server_id, service, args, heap,
+				           Xml_node("<default-policy/>"));
+		}
 
-		env.parent().session_response(server_id, Parent::INVALID_ARGS);
+		{
+			Genode::Lock::Guard guard(evaluations_lock);
+			evaluations_queued.enqueue(evaluation);
+		}
+		evaluations_pending.up();
 	}
 
 	if (request.has_type("upgrade")) {
@@ -411,6 +765,14 @@ void Nix::Main::handle_session_request(Genode::Xml_node request)
 	}
 
 	if (request.has_type("close")) {
+
+		/* answered once the evaluation is done */
+		try {
+			evaluation_id_space.apply<Evaluation>(server_id, [&] (Evaluation &e) {
+				e.close_pending = true; });
+			return;
+		} catch (Id_space<Parent::Server>::Unknown_id) { }
+
 		server_id_space.apply<Session>(server_id, [&] (Session &session) {
 			env.close(session.client_id.id());
 			destroy(heap, &session);
@@ -426,13 +788,5 @@ void Nix::Main::handle_session_request(Genode::Xml_node request)
  ** Component **
  ***************/
 
-
-/*
- * XXX: Nix uses this stack for the evaluation,
- * so the threat of a blown stack depends on
- * the complexity of the evaulation.
- */
-Genode::size_t Component::stack_size() { return 32*1024*sizeof(long); }
-
 void Component::construct(Genode::Env &env) {
 	static Nix::Main inst(env); }
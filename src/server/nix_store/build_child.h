@@ -64,6 +64,7 @@ class Nix_store::Child : public Genode::Child_policy
 
 		Genode::Env           &_env;
 		File_system::Session  &_fs;
+		Ingest_registry       &_ingest_registry;
 		Nix_store::Derivation  _drv { _env, _name.string() };
 
 		enum { ENTRYPOINT_STACK_SIZE = 12*1024 };
@@ -94,14 +95,23 @@ class Nix_store::Child : public Genode::Child_policy
 		Inputs      const _inputs      { _env, _child.heap(), _fs, _drv };
 		Environment const _environment { _env, _child.heap(), _fs, _drv, _inputs };
 
+		/*
+		 * If the derivation sets 'romInputs', files within inputs may be
+		 * requested as ROM modules. Store objects are immutable, so the
+		 * builder may map headers and libraries directly rather than
+		 * copying them through the File_system packet stream.
+		 */
+		bool const _rom_inputs = _environment.lookup("romInputs") != nullptr;
+
 		Genode::Attached_ram_dataspace _config_dataspace
 			{ _env.ram(), _env.rm(), _drv.size() };
 
 		Init::Child_policy_provide_rom_file _config_policy
 			{ "config", _config_dataspace.cap(), &_entrypoint };
 
-		Ingest_service  _fs_ingest_service { _drv, _env, _child.heap() };
-		Filter_service  _fs_filter_service { _env, _inputs };
+		Ingest_service  _fs_ingest_service {
+			_drv, _fs, _env, _child.heap(), _ingest_registry };
+		Filter_service  _fs_filter_service { _env, _child.heap(), _inputs };
 		Parent_service  _fs_parent_service { _parent_services, "File_system" };
 
 	public:
@@ -112,15 +122,20 @@ class Nix_store::Child : public Genode::Child_policy
 		Child(char const                   *name,
 		      Genode::Env                  &env,
 		      File_system::Session         &fs,
+		      Ingest_registry              &ingest_registry,
 		      Signal_context_capability     exit_sigh,
 		      Genode::Dataspace_capability  ldso_ds)
 		:
 			_name(name), _env(env), _fs(fs),
+			_ingest_registry(ingest_registry),
 			_entrypoint(&_env.pd(), ENTRYPOINT_STACK_SIZE, _name.string(),
 			            false, Affinity::Location()),
 			_session_requester(_entrypoint, _env.ram(), _env.rm()),
 			_exit_sigh(exit_sigh)
 		{
+			/* a restarted build continues the ingest of its outputs */
+			_fs_ingest_service.journal(_name.string());
+
 			if (_drv.has_fixed_output()) {
 				char service_name[32];
 
@@ -170,6 +185,7 @@ class Nix_store::Child : public Genode::Child_policy
 
 				Session_label const label = label_from_args(args);
 				Session_label const request = label.last_element();
+				char rom_path[Session_label::capacity()];
 
 				if (request == "binary") {
 					Arg_string::set_arg_string(args, args_len, "label", _binary_label.string());
@@ -181,6 +197,11 @@ class Nix_store::Child : public Genode::Child_policy
 					Session_label const new_label = prefixed_label(
 						Session_label("store"), Session_label(dest));
 					Arg_string::set_arg_string(args, args_len, "label", new_label.string());
+				} else if (_rom_inputs && _inputs.resolve(
+				           rom_path, sizeof(rom_path), request.string())) {
+					Session_label const new_label = prefixed_label(
+						Session_label("store"), Session_label(rom_path));
+					Arg_string::set_arg_string(args, args_len, "label", new_label.string());
 				} else {
 					Genode::error("impure ROM request for '", request.string(), "'");
 					*args = '\0';
@@ -297,10 +318,13 @@ class Nix_store::Child : public Genode::Child_policy
 
 		void exit(int exit_value)
 		{
-			if (exit_value == 0 && _fs_ingest_service.finalize(_fs, _drv))
+			if (exit_value == 0 && _fs_ingest_service.finalize(_fs, _drv, _name.string()))
 				Genode::log("\033[32m" "success: ", _name.string(), "\033[0m");
-			else
+			else {
+				/* the outputs of a failed build are not worth resuming */
+				_fs_ingest_service.discard_journal();
 				Genode::log("\033[31m" "failure: ", _name.string(), "\033[0m");
+			}
 
 			/* TODO: write a store placeholder that marks a failure */
 
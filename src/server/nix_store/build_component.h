@@ -24,6 +24,10 @@
 
 /* Local includes */
 #include "build_job.h"
+#include "collector.h"
+#include "path_info_db.h"
+#include "substituter.h"
+#include "sweeper.h"
 
 namespace Nix_store {
 
@@ -34,15 +38,72 @@ namespace Nix_store {
 
 };
 
-class Nix_store::Build_component : public Genode::Rpc_object<Nix_store::Session>
+class Nix_store::Build_component : public Genode::Rpc_object<Nix_store::Session>,
+                                   private Ingest_registry::Observer
 {
 	private:
 
+		/* objects recently imported by the client */
+		enum { MAX_IMPORTED = 8 };
+
 		Genode::Env             &_env;
 		Genode::Allocator_guard  _session_alloc;
+		Genode::Session_label const _label;
+		Ingest_registry         &_ingest_registry;
 		File_system::Session    &_store_fs;
 		File_system::Dir_handle  _store_dir;
 		Jobs                    &_jobs;
+		Collector               &_collector;
+		Path_info_db            &_db;
+		Substituter             &_substituter;
+
+		Genode::Lock _imported_lock;
+		Name         _imported[MAX_IMPORTED];
+		unsigned     _imported_next = 0;
+
+		/**
+		 * Keep an object until the session is closed
+		 *
+		 * \throw Out_of_quota
+		 */
+		void _add_temp_root(char const *name)
+		{
+			try { _collector.add_temp_root(_session_alloc, this, name); }
+			catch (Genode::Allocator::Out_of_memory) {
+				Genode::error("out of quota adding temporary root ", name);
+				throw Out_of_quota();
+			}
+		}
+
+		bool _just_imported(char const *name)
+		{
+			while (*name == '/') ++name;
+
+			Genode::Lock::Guard guard(_imported_lock);
+			for (unsigned i = 0; i < MAX_IMPORTED; ++i)
+				if (_imported[i] == name)
+					return true;
+			return false;
+		}
+
+
+		/*****************************************
+		 ** Ingest_registry::Observer interface **
+		 *****************************************/
+
+		void created(char const *) override { }
+		void referenced(char const *, char const *) override { }
+
+		/* the ingest session of the client is labeled as such */
+		void imported(char const *name, Genode::Session_label const &label) override
+		{
+			if (label != Genode::prefixed_label(_label, Genode::Session_label("ingest")))
+				return;
+
+			Genode::Lock::Guard guard(_imported_lock);
+			_imported[_imported_next] = Name(name);
+			_imported_next = (_imported_next + 1) % MAX_IMPORTED;
+		}
 
 		/**
 		 * Read a derivation and check that its inputs are valid.
@@ -78,6 +139,9 @@ class Nix_store::Build_component : public Genode::Rpc_object<Nix_store::Session>
 								Genode::error("missing dependency ", output);
 								throw Missing_dependency();
 							}
+
+							/* keep the input until the session is closed */
+							_add_temp_root(output);
 						} else {
 							parser.string(); /* Path */
 						}
@@ -94,18 +158,39 @@ class Nix_store::Build_component : public Genode::Rpc_object<Nix_store::Session>
 		/**
 		 * Constructor
 		 */
-		Build_component(Genode::Env          &env,
-		                Allocator            *session_alloc,
-		                size_t                ram_quota,
-		                File_system::Session &fs,
-		                Jobs                 &jobs)
+		Build_component(Genode::Env                 &env,
+		                Allocator                   *session_alloc,
+		                size_t                       ram_quota,
+		                Genode::Session_label const &label,
+		                Ingest_registry             &ingest_registry,
+		                File_system::Session        &fs,
+		                Jobs                 &jobs,
+		                Collector            &collector,
+		                Path_info_db         &db,
+		                Substituter          &substituter)
 		:
 			_env(env),
 			_session_alloc(session_alloc, ram_quota),
+			_label(label), _ingest_registry(ingest_registry),
 			_store_fs(fs),
 			_store_dir(_store_fs.dir("/", false)),
-			_jobs(jobs)
-		{ }
+			_jobs(jobs), _collector(collector), _db(db),
+			_substituter(substituter)
+		{
+			_ingest_registry.add_observer(*this);
+		}
+
+		~Build_component()
+		{
+			_ingest_registry.remove_observer(*this);
+			_collector.release_temp_roots(this);
+		}
+
+		void upgrade(char const *args)
+		{
+			_session_alloc.upgrade(
+				Arg_string::find_arg(args, "ram_quota").ulong_value(0));
+		}
 
 
 		/*************************
@@ -154,12 +239,16 @@ class Nix_store::Build_component : public Genode::Rpc_object<Nix_store::Session>
 			/* Prevent packet mixups. */
 			collect_acknowledgements(*_store_fs.tx());
 
+			/* the derivation and its outputs are kept during the build */
+			_add_temp_root(name);
+
 			/*
 			 * Check that the derivation inputs are present,
 			 * we don't take care of dependencies or scheduling,
 			 * just keep a queue.
 			 */
 			try { check_inputs(name); }
+			catch (Out_of_quota) { throw; }
 			catch (Genode::Rom_connection::Rom_connection_failed) {
 				Genode::error("failed to load ", name, " by ROM");
 				throw Missing_dependency();
@@ -169,8 +258,68 @@ class Nix_store::Build_component : public Genode::Rpc_object<Nix_store::Session>
 				throw Invalid_derivation();
 			}
 
+			try {
+				Derivation(_env, name).outputs([&] (Aterm::Parser &parser) {
+					parser.string(); /* Id */
+					Name path;
+					parser.string(&path);
+					_add_temp_root(path.string());
+					parser.string(); /* Algo */
+					parser.string(); /* Hash */
+				});
+			} catch (Out_of_quota) { throw; }
+			catch (...) { }
+
 			_jobs.queue(name, sigh);
 		}
+
+		void add_temp_root(Name const &name) override {
+			_add_temp_root(name.string()); }
+
+		void add_root(Name const &link, Name const &target) override {
+			_collector.add_root(link.string(), target.string()); }
+
+		bool root(unsigned index, Name &link, Name &target) override {
+			return _collector.root(index, link, target); }
+
+		/*
+		 * References are only taken for the objects that this client
+		 * has just imported, anything else would let a client keep
+		 * arbitrary objects from collection.
+		 */
+		void add_reference(Name const &from, Name const &to) override
+		{
+			if (!_just_imported(from.string())) {
+				Genode::error("refusing reference from ", from,
+				              ", it was not imported by ", _label);
+				throw Invalid_reference();
+			}
+			_collector.add_reference(from.string(), to.string());
+		}
+
+		bool reference(Name const &from, unsigned index, Name &to) override {
+			return _db.reference(from.string(), index, to); }
+
+		bool referrer(Name const &to, unsigned index, Name &from) override {
+			return _db.referrer(to.string(), index, from); }
+
+		bool deriver(Name const &output, Name &drv) override {
+			return _db.deriver(output.string(), drv); }
+
+		bool output(Name const &drv, unsigned index, Name &output) override {
+			return _db.output(drv.string(), index, output); }
+
+		bool from_hash_part(Name const &hash_part, Name &name) override {
+			return _db.from_hash_part(hash_part.string(), name); }
+
+		bool substitutable(Name const &path) override {
+			return _substituter.lookup(path.string()) != ""; }
+
+		void collect_garbage(Genode::Signal_context_capability sigh,
+		                     Genode::uint64_t max_freed) override {
+			_collector.collect(sigh, max_freed); }
+
+		Gc_result gc_result() override { return _collector.last_result(); }
 };
 
 
@@ -179,9 +328,14 @@ class Nix_store::Build_root : public Genode::Root_component<Build_component>
 	private:
 
 		Genode::Env                 &_env;
+		Ingest_registry             &_ingest_registry;
 		Genode::Allocator_avl        _fs_block_alloc;
 		Nix::File_system_connection  _fs;
+		Substituter                  _substituter;
 		Jobs                         _jobs;
+		Sweeper                      _sweeper;
+		Path_info_db                 _db;
+		Collector                    _collector;
 
 	protected:
 
@@ -201,13 +355,21 @@ class Nix_store::Build_root : public Genode::Root_component<Build_component>
 				              ram_quota, ", need ", session_size);
 				throw Root::Quota_exceeded();
 			}
+			ram_quota -= session_size;
 
 			Build_component *session = new(md_alloc())
-				Build_component(_env, md_alloc(), ram_quota, _fs, _jobs);
+				Build_component(_env, md_alloc(), ram_quota, label,
+				                _ingest_registry, _fs,
+				                _jobs, _collector, _db, _substituter);
 			Genode::log("serving Nix_store to ", label.string());
 			return session;
 		}
 
+		void _upgrade_session(Build_component *session, const char *args) override
+		{
+			session->upgrade(args);
+		}
+
 	public:
 
 		/**
@@ -215,13 +377,18 @@ class Nix_store::Build_root : public Genode::Root_component<Build_component>
 		 */
 		Build_root(Genode::Env       &env,
 		           Genode::Allocator &md_alloc,
-		           Genode::Allocator &alloc)
+		           Genode::Allocator &alloc,
+		           Ingest_registry   &ingest_registry)
 		:
 			Genode::Root_component<Build_component>(&env.ep().rpc_ep(), &md_alloc),
-			_env(env),
+			_env(env), _ingest_registry(ingest_registry),
 			_fs_block_alloc(&alloc),
 			_fs(env, _fs_block_alloc, "/", true, 128*1024),
-			_jobs(env, alloc, _fs)
+			_substituter(env, alloc),
+			_jobs(env, alloc, _fs, ingest_registry, _substituter),
+			_sweeper(env, alloc, _fs, ingest_registry),
+			_db(alloc, _fs, ingest_registry),
+			_collector(env, alloc, _fs, ingest_registry, _db)
 		{
 			using namespace File_system;
 			static char const *placeholder = ".builder";
@@ -241,6 +408,9 @@ class Nix_store::Build_root : public Genode::Root_component<Build_component>
 				throw;
 			}
 
+			/* remove what was left by an earlier instance */
+			_sweeper.start();
+
 			env.parent().announce(env.ep().manage(*this));
 		}
 };
@@ -24,6 +24,7 @@
 
 /* Local includes */
 #include "build_child.h"
+#include "substituter.h"
 
 namespace Nix_store {
 
@@ -48,6 +49,7 @@ class Nix_store::Job : public Fifo<Job>::Element
 
 		Nix_store::Name const     _name;
 		Signal_context_capability _sigh;
+		bool                      _substitute = true;
 
 
 	public:
@@ -85,8 +87,11 @@ class Nix_store::Jobs : private Genode::Fifo<Job>
 
 		Lock                     _lock;
 		File_system::Session    &_fs;
+		Ingest_registry         &_ingest_registry;
+		Substituter             &_substituter;
 
 		Genode::Constructible<Nix_store::Child> _child;
+		Genode::Constructible<Substitution>     _substitution;
 
 		/**
 		 * Handle resource announcement from parent
@@ -163,11 +168,37 @@ class Nix_store::Jobs : private Genode::Fifo<Job>
 		Genode::Signal_handler<Jobs> _exit_handler
 			{ _env.ep(), *this, &Jobs::_handle_exit };
 
+		/**
+		 * Handle the end of a substitution
+		 */
+		void _handle_substituted()
+		{
+			{
+				Lock::Guard guard(_lock);
+				bool const success = _substitution->success();
+				_substitution.destruct();
+
+				/* otherwise the job is built */
+				if (success)
+					if (Job *job = dequeue())
+						destroy(_alloc, job);
+			}
+
+			process();
+		}
+
+		Genode::Signal_handler<Jobs> _substituted_handler
+			{ _env.ep(), *this, &Jobs::_handle_substituted };
+
 	public:
 
-		Jobs(Genode::Env &env, Genode::Allocator &alloc, File_system::Session &fs)
+		Jobs(Genode::Env &env, Genode::Allocator &alloc,
+		     File_system::Session &fs, Ingest_registry &ingest_registry,
+		     Substituter &substituter)
 		:
-			_env(env), _alloc(alloc), _fs(fs)
+			_env(env), _alloc(alloc), _fs(fs),
+			_ingest_registry(ingest_registry),
+			_substituter(substituter)
 		{
 			env.parent().resource_avail_sigh(_resource_handler);
 			env.parent().yield_sigh(_yield_handler);
@@ -180,7 +211,8 @@ class Nix_store::Jobs : private Genode::Fifo<Job>
 		{
 			Lock::Guard guard(_lock);
 
-			if (_child.constructed() || empty()) return;
+			if (_child.constructed() || _substitution.constructed() || empty())
+				return;
 
 			Job *job = head();
 			while (job->abandoned()) {
@@ -190,12 +222,26 @@ class Nix_store::Jobs : private Genode::Fifo<Job>
 				if (!job) return;
 			}
 
+			/* copy the outputs from the cache rather than build them */
+			if (job->_substitute && _substituter.substitutable(job->name())) {
+				job->_substitute = false;
+				try {
+					_substitution.construct(job->name(), _env, _alloc, _fs,
+					                        _substituter, _ingest_registry,
+					                        _substituted_handler);
+					return;
+				} catch (...) {
+					Genode::error("failed to substitute ", job->name());
+				}
+			}
+
 			/*
 			 * If RAM quota is sufficient then start a job,
 			 * otherwise make a non-blocking upgrade request.
 			 */
 			if (_env.ram().avail() > QUOTA_STEP+QUOTA_RESERVE) {
-				_child.construct(job->name(), _env, _fs, _exit_handler, _ldso_ds);
+				_child.construct(job->name(), _env, _fs, _ingest_registry,
+				                 _exit_handler, _ldso_ds);
 				return;
 			}
 
@@ -0,0 +1,651 @@
+/*
+ * \brief  Incremental garbage collector of the store
+ * \author Emery Hemingway
+ * \date   2017-02-18
+ *
+ * Objects are kept if they are reachable from the permanent roots
+ * under '/.gcroots' or from the temporary roots of a session. An
+ * object refers to the target of a symlink, to the references
+ * recorded in the path-info database, and a derivation to its inputs.
+ *
+ * Marking and sweeping are done in bounded steps, each step is a
+ * signal to the entrypoint. Objects and references created while
+ * a collection is in progress are marked as they are created, so
+ * builds and ingest continue during a collection.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _NIX_STORE__COLLECTOR_H_
+#define _NIX_STORE__COLLECTOR_H_
+
+/* Genode includes */
+#include <nix_store_session/nix_store_session.h>
+#include <file_system/util.h>
+#include <util/avl_tree.h>
+#include <util/construct_at.h>
+#include <util/list.h>
+#include <base/signal.h>
+#include <base/lock.h>
+#include <base/log.h>
+
+/* Nix includes */
+#include <nix_store/derivation.h>
+
+/* Local includes */
+#include "ingest_registry.h"
+#include "path_info_db.h"
+#include "tree_remover.h"
+
+namespace Nix_store { class Collector; }
+
+
+class Nix_store::Collector : private Ingest_registry::Observer
+{
+	private:
+
+		enum { STEP_BUDGET = 64, MAX_WAITERS = 8 };
+
+		enum Phase { IDLE, ROOTS, MARK, SWEEP, REMOVE };
+
+		/**
+		 * Marked object, keyed by a hash of its name
+		 *
+		 * A collision only keeps an object that could be removed.
+		 */
+		struct Marked : Genode::Avl_node<Marked>
+		{
+			Genode::uint64_t const key;
+
+			Marked(Genode::uint64_t key) : key(key) { }
+
+			bool higher(Marked *m) const { return m->key > key; }
+
+			Marked *find(Genode::uint64_t k)
+			{
+				if (k == key) return this;
+				Marked *m = Avl_node<Marked>::child(k > key);
+				return m ? m->find(k) : nullptr;
+			}
+		};
+
+		/* marked object whose references are not yet marked */
+		struct Pending : Genode::List<Pending>::Element
+		{
+			Name const name;
+			Pending(char const *name) : name(name) { }
+		};
+
+		/*
+		 * Temporary root, followed by its name in the same allocation
+		 * from the allocator of its owner
+		 */
+		struct Temp_root : Genode::List<Temp_root>::Element
+		{
+			Genode::Allocator   &alloc;
+			void const          *owner;
+			Genode::size_t const size;
+
+			Temp_root(Genode::Allocator &alloc, void const *owner,
+			          Genode::size_t size)
+			: alloc(alloc), owner(owner), size(size) { }
+
+			char const *name() const { return (char const *)(this + 1); }
+		};
+
+		Genode::Env          &_env;
+		Genode::Allocator    &_alloc;
+		File_system::Session &_fs;
+		Ingest_registry      &_registry;
+		Path_info_db         &_db;
+
+		Tree_remover _remover { _fs };
+
+		Genode::Lock _lock;
+
+		Phase    _phase  = IDLE;
+		bool     _failed = false; /* marks were lost, nothing may be removed */
+		unsigned _index  = 0;     /* position in the directory being read */
+		Name     _removing;       /* object removed by the tree remover */
+
+		Genode::Avl_tree<Marked> _marked;
+		Genode::List<Pending>    _pending;
+		Genode::List<Temp_root>  _temp_roots;
+
+		Genode::Signal_context_capability _waiters[MAX_WAITERS];
+
+		Genode::uint64_t _max_freed = 0;
+		Gc_result        _result      { 0, 0 };
+		Gc_result        _last_result { 0, 0 };
+
+		static char const *_strip(char const *name)
+		{
+			while (*name == '/') ++name;
+			return name;
+		}
+
+		/**
+		 * FNV-1a hash of an object name
+		 */
+		static Genode::uint64_t _key(char const *name)
+		{
+			Genode::uint64_t h = 14695981039346656037ULL;
+			for (; *name; ++name)
+				h = (h ^ (Genode::uint8_t)*name) * 1099511628211ULL;
+			return h;
+		}
+
+		static bool _is_derivation(char const *name)
+		{
+			Genode::size_t const len = Genode::strlen(name);
+			return len > 4 && !Genode::strcmp(name+len-4, ".drv");
+		}
+
+		bool _is_marked(char const *name)
+		{
+			Marked *m = _marked.first();
+			return m && m->find(_key(_strip(name)));
+		}
+
+		bool _collecting() const { return _phase != IDLE; }
+
+		/**
+		 * Mark an object and queue it for scanning
+		 */
+		void _mark(char const *name)
+		{
+			name = _strip(name);
+			if (!*name || _is_marked(name))
+				return;
+
+			try {
+				_marked.insert(new (_alloc) Marked(_key(name)));
+				_pending.insert(new (_alloc) Pending(name));
+			} catch (Genode::Allocator::Out_of_memory) {
+				if (!_failed)
+					Genode::error("out of memory marking the store, "
+					              "nothing will be collected");
+				_failed = true;
+			}
+		}
+
+		/**
+		 * Mark the objects that an object refers to
+		 */
+		void _scan(char const *name)
+		{
+			using namespace File_system;
+
+			/* follow links to the objects they name */
+			try {
+				Genode::Path<MAX_NAME_LEN+1> path(name, "/");
+				Node_handle node = _fs.node(path.base());
+				Handle_guard node_guard(_fs, node);
+
+				if (_fs.status(node).mode == Status::MODE_SYMLINK) {
+					Dir_handle root = _fs.dir("/", false);
+					Handle_guard root_guard(_fs, root);
+					Symlink_handle link = _fs.symlink(root, name, false);
+					Handle_guard link_guard(_fs, link);
+
+					char target[MAX_NAME_LEN];
+					Genode::size_t const n = read(_fs, link, target, sizeof(target)-1);
+					target[n] = '\0';
+					_mark(target);
+				}
+			} catch (...) { }
+
+			_db.for_each_reference(name, [&] (char const *ref) { _mark(ref); });
+
+			if (_is_derivation(name)) try {
+				Derivation drv(_env, name);
+
+				drv.sources([&] (Aterm::Parser &parser) {
+					Name source;
+					parser.string(&source);
+					_mark(source.string());
+				});
+
+				drv.inputs([&] (Aterm::Parser &parser) {
+					Name input;
+					parser.string(&input);
+					_mark(input.string());
+					parser.list([] (Aterm::Parser &parser) { parser.string(); });
+				});
+			} catch (...) {
+				Genode::warning("cannot read the inputs of ", name);
+			}
+		}
+
+		/**
+		 * Scan at most 'budget' pending objects
+		 *
+		 * \return the remaining budget
+		 */
+		unsigned _drain_pending(unsigned budget)
+		{
+			while (budget && _pending.first()) {
+				Pending *p = _pending.first();
+				_pending.remove(p);
+				_scan(p->name.string());
+				destroy(_alloc, p);
+				--budget;
+			}
+			return budget;
+		}
+
+		bool _read_dirent(char const *path, File_system::Directory_entry &dirent)
+		{
+			using namespace File_system;
+
+			try {
+				Dir_handle dir = _fs.dir(path, false);
+				Handle_guard guard(_fs, dir);
+				return read(_fs, dir, &dirent, sizeof(dirent),
+				            _index*sizeof(dirent)) == sizeof(dirent);
+			} catch (...) { }
+			return false;
+		}
+
+		void _step_roots(unsigned budget)
+		{
+			using namespace File_system;
+
+			while (budget--) {
+				Directory_entry dirent;
+				if (!_read_dirent(roots_directory(), dirent)) {
+					_phase = MARK;
+					return;
+				}
+				++_index;
+
+				try {
+					Dir_handle dir = _fs.dir(roots_directory(), false);
+					Handle_guard dir_guard(_fs, dir);
+					Symlink_handle link = _fs.symlink(dir, dirent.name, false);
+					Handle_guard link_guard(_fs, link);
+
+					char target[MAX_NAME_LEN];
+					Genode::size_t const n = read(_fs, link, target, sizeof(target)-1);
+					target[n] = '\0';
+					_mark(target);
+				} catch (...) { }
+			}
+		}
+
+		void _step_sweep(unsigned budget)
+		{
+			using namespace File_system;
+
+			while (budget--) {
+				if (_max_freed && _remover.freed() >= _max_freed) {
+					_finish();
+					return;
+				}
+
+				Directory_entry dirent;
+				if (!_read_dirent("/", dirent)) {
+					_finish();
+					return;
+				}
+
+				/* hidden files and ingest roots are not objects */
+				if (dirent.name[0] == '.'
+				 || !Genode::strcmp(dirent.name, "ingest-", 7)
+				 || _is_marked(dirent.name))
+				{
+					++_index;
+					continue;
+				}
+
+				try {
+					if (_remover.remove(dirent)) {
+						_db.invalidate(dirent.name);
+						++_result.objects;
+						continue;
+					}
+				} catch (...) {
+					Genode::error("failed to collect ", (char const *)dirent.name);
+					++_index;
+					continue;
+				}
+
+				_removing = Name(dirent.name);
+				_phase = REMOVE;
+				return;
+			}
+		}
+
+		void _step_remove(unsigned budget)
+		{
+			if (_remover.step(budget))
+				return;
+
+			if (_remover.failed())
+				++_index;
+			else {
+				_db.invalidate(_removing.string());
+				++_result.objects;
+			}
+			_phase = SWEEP;
+		}
+
+		void _start()
+		{
+			_failed = false;
+			_index  = 0;
+			_result = Gc_result { 0, 0 };
+			_remover.reset_freed();
+			_phase  = ROOTS;
+
+			for (Temp_root *r = _temp_roots.first(); r; r = r->next())
+				_mark(r->name());
+
+			Genode::Signal_transmitter(_step_handler).submit();
+		}
+
+		void _finish()
+		{
+			_phase = IDLE;
+			_result.bytes = _remover.freed();
+			_last_result  = _result;
+
+			while (Marked *m = _marked.first()) {
+				_marked.remove(m);
+				destroy(_alloc, m);
+			}
+			while (Pending *p = _pending.first()) {
+				_pending.remove(p);
+				destroy(_alloc, p);
+			}
+
+			/* forget the removed objects that nothing refers to */
+			_db.prune();
+
+			Genode::log("garbage collection removed ", _result.objects,
+			            " objects, freeing ", _result.bytes>>10, " KiB");
+
+			for (unsigned i = 0; i < MAX_WAITERS; ++i)
+				if (_waiters[i].valid()) {
+					Genode::Signal_transmitter(_waiters[i]).submit();
+					_waiters[i] = Genode::Signal_context_capability();
+				}
+		}
+
+		void _step()
+		{
+			Genode::Lock::Guard guard(_lock);
+
+			/* references found since the last step are marked first */
+			unsigned budget = _drain_pending(STEP_BUDGET);
+
+			switch (_phase) {
+			case ROOTS: _step_roots(budget); break;
+
+			case MARK:
+				if (!_pending.first()) {
+					if (_failed) {
+						_finish();
+						break;
+					}
+					_phase = SWEEP;
+					_index = 0;
+				}
+				break;
+
+			case SWEEP:  _step_sweep(budget);  break;
+			case REMOVE: _step_remove(budget); break;
+			case IDLE:   return;
+			}
+
+			/* yield to other signals and RPCs before continuing */
+			if (_phase != IDLE)
+				Genode::Signal_transmitter(_step_handler).submit();
+		}
+
+		Genode::Signal_handler<Collector> _step_handler;
+
+		void _remove_temp_root(Temp_root *r)
+		{
+			_temp_roots.remove(r);
+			r->~Temp_root();
+			r->alloc.free(r, r->size);
+		}
+
+
+		/*****************************************
+		 ** Ingest_registry::Observer interface **
+		 *****************************************/
+
+		void created(char const *name) override
+		{
+			Genode::Lock::Guard guard(_lock);
+			if (_collecting())
+				_mark(name);
+		}
+
+		void referenced(char const *from, char const *to) override
+		{
+			Genode::Lock::Guard guard(_lock);
+			if (_collecting() && _is_marked(from))
+				_mark(to);
+		}
+
+	public:
+
+		static char const *roots_directory() { return "/.gcroots"; }
+
+		Collector(Genode::Env &env, Genode::Allocator &alloc,
+		          File_system::Session &fs, Ingest_registry &registry,
+		          Path_info_db &db)
+		:
+			_env(env), _alloc(alloc), _fs(fs), _registry(registry), _db(db),
+			_step_handler(env.ep(), *this, &Collector::_step)
+		{
+			_registry.add_observer(*this);
+		}
+
+		~Collector()
+		{
+			_registry.remove_observer(*this);
+
+			while (Temp_root *r = _temp_roots.first())
+				_remove_temp_root(r);
+		}
+
+		/**
+		 * Start a collection unless one is in progress
+		 *
+		 * \param sigh  signaled when the collection is complete
+		 */
+		void collect(Genode::Signal_context_capability sigh,
+		             Genode::uint64_t max_freed)
+		{
+			Genode::Lock::Guard guard(_lock);
+
+			if (sigh.valid()) {
+				unsigned i = 0;
+				for (; i < MAX_WAITERS && _waiters[i].valid(); ++i);
+				if (i == MAX_WAITERS)
+					Genode::error("too many clients waiting for collection");
+				else
+					_waiters[i] = sigh;
+			}
+
+			if (_collecting())
+				return;
+
+			_max_freed = max_freed;
+			_start();
+		}
+
+		Gc_result last_result()
+		{
+			Genode::Lock::Guard guard(_lock);
+			return _last_result;
+		}
+
+		/**
+		 * Keep an object until the roots of 'owner' are released
+		 *
+		 * \param alloc  allocator of the owner, charged for the root
+		 *
+		 * \throw Allocator::Out_of_memory
+		 */
+		void add_temp_root(Genode::Allocator &alloc, void const *owner,
+		                   char const *name)
+		{
+			Genode::Lock::Guard guard(_lock);
+
+			name = _strip(name);
+			if (!*name)
+				return;
+
+			for (Temp_root *r = _temp_roots.first(); r; r = r->next())
+				if (r->owner == owner && !Genode::strcmp(r->name(), name))
+					return;
+
+			Genode::size_t const len  = Genode::strlen(name);
+			Genode::size_t const size = sizeof(Temp_root) + len + 1;
+
+			Temp_root *r = Genode::construct_at<Temp_root>(
+				alloc.alloc(size), alloc, owner, size);
+			Genode::memcpy((char *)r->name(), name, len + 1);
+			_temp_roots.insert(r);
+
+			if (_collecting())
+				_mark(name);
+		}
+
+		/**
+		 * Drop the temporary roots of a session
+		 */
+		void release_temp_roots(void const *owner)
+		{
+			Genode::Lock::Guard guard(_lock);
+
+			for (Temp_root *r = _temp_roots.first(); r; ) {
+				Temp_root *next = r->next();
+				if (r->owner == owner)
+					_remove_temp_root(r);
+				r = next;
+			}
+		}
+
+		/**
+		 * Create a permanent root
+		 *
+		 * A root that already refers to 'target' is left as is,
+		 * roots are never redirected to another object.
+		 *
+		 * \throw Invalid_root
+		 * \throw Root_exists
+		 * \throw Root_failed
+		 */
+		void add_root(char const *link_name, char const *target)
+		{
+			using namespace File_system;
+
+			Genode::Lock::Guard guard(_lock);
+
+			target = _strip(target);
+
+			if (!*link_name || *link_name == '.' || !*target
+			 || string_contains(link_name, '/')) {
+				Genode::error("invalid root '", link_name, "' -> '", target, "'");
+				throw Invalid_root();
+			}
+
+			try {
+				Dir_handle dir;
+				try { dir = _fs.dir(roots_directory(), false); }
+				catch (Lookup_failed) { dir = _fs.dir(roots_directory(), true); }
+				Handle_guard dir_guard(_fs, dir);
+
+				bool exists = true;
+				try {
+					Symlink_handle link = _fs.symlink(dir, link_name, false);
+					Handle_guard link_guard(_fs, link);
+
+					char buf[MAX_NAME_LEN];
+					Genode::size_t const n = read(_fs, link, buf, sizeof(buf)-1);
+					buf[n] = '\0';
+
+					if (Genode::strcmp(_strip(buf), target)) {
+						Genode::error("root '", link_name, "' already refers to '", buf, "'");
+						throw Root_exists();
+					}
+				} catch (Lookup_failed) { exists = false; }
+
+				if (!exists) {
+					Symlink_handle link = _fs.symlink(dir, link_name, true);
+					Handle_guard link_guard(_fs, link);
+					write(_fs, link, target, Genode::strlen(target));
+				}
+			}
+			catch (Invalid_name)  { throw Invalid_root(); }
+			catch (Name_too_long) { throw Invalid_root(); }
+			catch (Node_already_exists) { throw Root_exists(); }
+			catch (Lookup_failed) {
+				Genode::error("cannot open root directory"); throw Root_failed(); }
+			catch (No_space) {
+				Genode::error("no space for root '", link_name, "'"); throw Root_failed(); }
+			catch (Out_of_metadata) {
+				Genode::error("out of metadata for root '", link_name, "'"); throw Root_failed(); }
+			catch (Permission_denied) {
+				Genode::error("permission denied for root '", link_name, "'"); throw Root_failed(); }
+			catch (Invalid_handle) {
+				Genode::error("invalid handle for root '", link_name, "'"); throw Root_failed(); }
+
+			if (_collecting())
+				_mark(target);
+		}
+
+		/**
+		 * Read the permanent root at 'index'
+		 */
+		bool root(unsigned index, Name &link_name, Name &target)
+		{
+			using namespace File_system;
+
+			Genode::Lock::Guard guard(_lock);
+
+			try {
+				Dir_handle dir = _fs.dir(roots_directory(), false);
+				Handle_guard dir_guard(_fs, dir);
+
+				Directory_entry dirent;
+				if (read(_fs, dir, &dirent, sizeof(dirent), index*sizeof(dirent))
+				    != sizeof(dirent))
+					return false;
+
+				Symlink_handle link = _fs.symlink(dir, dirent.name, false);
+				Handle_guard link_guard(_fs, link);
+
+				char buf[MAX_NAME_LEN];
+				Genode::size_t const n = read(_fs, link, buf, sizeof(buf)-1);
+				buf[n] = '\0';
+
+				link_name = Name(dirent.name);
+				target    = Name(buf);
+				return true;
+			} catch (...) { }
+			return false;
+		}
+
+		/**
+		 * Record that object 'from' refers to object 'to'
+		 *
+		 * The caller is responsible for 'from' being an object
+		 * that its client has just imported.
+		 */
+		void add_reference(char const *from, char const *to) {
+			_registry.referenced(from, to); }
+};
+
+#endif /* _NIX_STORE__COLLECTOR_H_ */
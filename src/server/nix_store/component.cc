@@ -66,6 +66,11 @@ void Component::construct(Genode::Env &env)
 
 	static Sliced_heap sliced_heap { &env.ram(), &env.rm() };
 
-	static Nix_store::Ingest_root ingest_root { env, sliced_heap, heap };
-	static Nix_store::Build_root   build_root { env, sliced_heap, heap };
+	/* live ingest sessions, consulted before stale roots are removed */
+	static Nix_store::Ingest_registry ingest_registry { fs };
+
+	static Nix_store::Ingest_root ingest_root {
+		env, sliced_heap, heap, ingest_registry };
+	static Nix_store::Build_root   build_root {
+		env, sliced_heap, heap, ingest_registry };
 }
\ No newline at end of file
@@ -18,6 +18,8 @@
 /* Genode includes */
 #include <util/avl_string.h>
 #include <util/list.h>
+#include <base/snprintf.h>
+#include <os/path.h>
 
 /* Nix includes */
 #include <nix_store_session/nix_store_session.h>
@@ -49,6 +51,16 @@ struct Nix_store::Input : Genode::Avl_node<Input>
 		len(Genode::strlen(link.string()))
 	{ };
 
+	/**
+	 * Return the name of the final object without a leading slash
+	 */
+	char const *object() const
+	{
+		char const *p = final.string();
+		while (*p == '/') ++p;
+		return p;
+	}
+
 	/************************
 	 ** Avl node interface **
 	 ************************/
@@ -155,6 +167,75 @@ struct Nix_store::Inputs : Genode::Avl_tree<Input>
 		return input ? input->lookup(name) : nullptr;
 	}
 
+	/**
+	 * Return false if a path contains empty, '.', or '..' elements
+	 */
+	static bool canonical(char const *path)
+	{
+		if (*path == '/') ++path;
+
+		for (char const *e = path; ; ) {
+			Genode::size_t n = 0;
+			while (e[n] && e[n] != '/') ++n;
+
+			if (!n || (e[0] == '.' && (n == 1 || (n == 2 && e[1] == '.'))))
+				return false;
+			if (!e[n])
+				return true;
+			e += n+1;
+		}
+	}
+
+	/**
+	 * Find the input named by the leading element of a path
+	 *
+	 * A path that is not canonical is made canonical first.
+	 * 'fn' is called with the input and the remainder of the
+	 * path, which is empty or starts with a '/'.
+	 *
+	 * \return false if the path does not reside within an input
+	 */
+	template <typename FUNC>
+	bool resolve(char const *path, FUNC const &fn) const
+	{
+		if (!canonical(path)) {
+			Genode::Path<File_system::MAX_PATH_LEN> const canonical_path(path);
+			if (!canonical(canonical_path.base()))
+				return false;
+			return resolve(canonical_path.base(), fn);
+		}
+
+		if (*path == '/') ++path;
+
+		Genode::size_t len = 0;
+		while (path[len] && path[len] != '/') ++len;
+		if (!len || len >= Nix_store::Name::capacity())
+			return false;
+
+		Input const *input = lookup(Nix_store::Name(Genode::Cstring(path, len)).string());
+		if (!input)
+			return false;
+
+		fn(*input, path+len);
+		return true;
+	}
+
+	/**
+	 * Rewrite a path with a leading input element to the input target
+	 *
+	 * \return false if the path does not reside within an input
+	 */
+	bool resolve(char *dst, Genode::size_t dst_len, char const *path) const
+	{
+		bool fits = false;
+		bool const found = resolve(path, [&] (Input const &input, char const *subpath) {
+			Genode::size_t const n =
+				Genode::snprintf(dst, dst_len, "/%s%s", input.object(), subpath);
+			fits = n + 1 < dst_len;
+		});
+		return found && fits;
+	}
+
 };
 
 
@@ -118,33 +118,171 @@ class Nix_store::Filter_component : public Genode::Rpc_object<File_system::Sessi
 
 		Dir_handle _root_handle = _backend.dir("/", false);
 
-	public:
+		/**
+		 * Backend handle on the root directory of an input,
+		 * kept open for the session lifetime
+		 */
+		struct Cached_dir : Genode::Avl_node<Cached_dir>
+		{
+			Dir_handle handle;
+
+			/************************
+			 ** Avl node interface **
+			 ************************/
+
+			bool higher(Cached_dir *c) const {
+				return c->handle.value > handle.value; }
+
+			Cached_dir *lookup(Node_handle h)
+			{
+				if (h.value == handle.value) return this;
+
+				Cached_dir *c = Avl_node<Cached_dir>::child(h.value > handle.value);
+				return c ? c->lookup(h) : nullptr;
+			}
+		};
+
+		/**
+		 * An input that has been resolved by this session
+		 *
+		 * Builders such as compilers probe thousands of paths
+		 * below the same few inputs, so the rewritten prefix is
+		 * kept ready for copying and a backend handle to the
+		 * input directory is kept open for the session lifetime.
+		 */
+		struct Resolved : Genode::Avl_node<Resolved>
+		{
+			Input const &input;
+
+			char   prefix[MAX_PATH_LEN];
+			size_t prefix_len;
+
+			Cached_dir dir;
+			bool       dir_valid = false;
+
+			Resolved(Input const &input)
+			:
+				input(input),
+				prefix_len(Genode::snprintf(prefix, sizeof(prefix),
+				                            "/%s", input.object()))
+			{ }
+
+			/************************
+			 ** Avl node interface **
+			 ************************/
+
+			bool higher(Resolved *r) const {
+				return (strcmp(r->input.link.string(), input.link.string()) > 0); }
+
+			Resolved *lookup(char const *name)
+			{
+				int const n = strcmp(name, input.link.string());
+				if (n == 0) return this;
+
+				Resolved *r = Avl_node<Resolved>::child(n > 0);
+				return r ? r->lookup(name) : nullptr;
+			}
+		};
+
+		Genode::Allocator            &_alloc;
+		Genode::Avl_tree<Resolved>    _resolved;
+		Genode::Avl_tree<Cached_dir>  _cached_dirs;
+
+		/* most recent resolution, consecutive requests tend to share an input */
+		Resolved *_last = nullptr;
+
+		Resolved &_lookup_input(Input const &input)
+		{
+			if (_last && &_last->input == &input)
+				return *_last;
+
+			Resolved *r = _resolved.first();
+			r = r ? r->lookup(input.link.string()) : nullptr;
+
+			if (!r) {
+				try { r = new (_alloc) Resolved(input); }
+				catch (Genode::Allocator::Out_of_memory) {
+					throw Out_of_metadata(); }
+				_resolved.insert(r);
+			}
 
-		Filter_component(Genode::Env &env, Inputs const &inputs)
-		: _inputs(inputs), _backend(env) { }
+			_last = r;
+			return *r;
+		}
 
-		Input const &_lookup_input(char const *name)
+		Resolved &_lookup_input(char const *name)
 		{
+			if (_last && _last->input.link == name)
+				return *_last;
+
 			Input const *input = _inputs.lookup(name);
 			if (!input)
 				throw Lookup_failed();
-			return *input;
+			return _lookup_input(*input);
+		}
+
+		/**
+		 * Return a backend handle on the root directory of an input
+		 */
+		Dir_handle _input_dir(Resolved &resolved)
+		{
+			if (!resolved.dir_valid) {
+				resolved.dir.handle = _backend.dir(resolved.prefix, false);
+				resolved.dir_valid = true;
+				_cached_dirs.insert(&resolved.dir);
+			}
+			return resolved.dir.handle;
+		}
+
+		bool _cached_handle(Node_handle handle)
+		{
+			Cached_dir *c = _cached_dirs.first();
+			return c && c->lookup(handle);
 		}
 
-		void _resolve(Nix_store::Path &new_path, char const *orig)
+		/**
+		 * Rewrite the leading element of a path to the input target
+		 *
+		 * \return input matching the leading element
+		 */
+		Resolved &_resolve(char *new_path, char const *orig)
 		{
-			Nix_store::Path old_path(orig);
-			while(!old_path.has_single_element())
-				old_path.strip_last_element();
+			Resolved *resolved = nullptr;
+
+			bool const found = _inputs.resolve(orig,
+				[&] (Input const &input, char const *subpath)
+			{
+				resolved = &_lookup_input(input);
 
-			Input const &input = _lookup_input(old_path.base()+1);
+				size_t const sub_len = strlen(subpath);
+				if (resolved->prefix_len + sub_len >= MAX_PATH_LEN)
+					throw Name_too_long();
 
-			char const *subpath = orig+1;
-			while (*subpath && *subpath != '/')
-				++subpath;
+				memcpy(new_path, resolved->prefix, resolved->prefix_len);
+				memcpy(new_path+resolved->prefix_len, subpath, sub_len+1);
+			});
 
-			new_path.import(input.final.string(), "/");
-			new_path.append(subpath);
+			if (!found)
+				throw Lookup_failed();
+			return *resolved;
+		}
+
+	public:
+
+		Filter_component(Genode::Env &env, Genode::Allocator &alloc,
+		                 Inputs const &inputs)
+		: _inputs(inputs), _backend(env), _alloc(alloc) { }
+
+		~Filter_component()
+		{
+			while (Resolved *r = _resolved.first()) {
+				if (r->dir_valid) {
+					_cached_dirs.remove(&r->dir);
+					_backend.close(r->dir.handle);
+				}
+				_resolved.remove(r);
+				destroy(_alloc, r);
+			}
 		}
 
 		/***************************
@@ -160,11 +298,14 @@ class Nix_store::Filter_component : public Genode::Rpc_object<File_system::Sessi
 			if (create) throw Permission_denied();
 			if (!strcmp("/", path_str))
 				return _root_handle;
-			{
-				Nix_store::Path new_path;
-				_resolve(new_path, path.string());
-				return _backend.dir(new_path.base(), false);
-			}
+
+			char new_path[MAX_PATH_LEN];
+			Resolved &resolved = _resolve(new_path, path_str);
+
+			/* the input root itself is served from the cache */
+			if (!new_path[resolved.prefix_len])
+				return _input_dir(resolved);
+			return _backend.dir(new_path, false);
 		}
 
 		File_handle file(Dir_handle dir_handle, File_system::Name const &name,
@@ -172,8 +313,8 @@ class Nix_store::Filter_component : public Genode::Rpc_object<File_system::Sessi
 		{
 			if (create) throw Permission_denied();
 			if (dir_handle == _root_handle) {
-				Input const &input = _lookup_input(name.string());
-				return _backend.file(dir_handle, input.final.string(), mode, false);
+				Resolved &resolved = _lookup_input(name.string());
+				return _backend.file(dir_handle, resolved.prefix+1, mode, false);
 			}
 			return _backend.file(dir_handle, name, mode, false);
 		}
@@ -195,15 +336,17 @@ class Nix_store::Filter_component : public Genode::Rpc_object<File_system::Sessi
 			if (!strcmp("/", path_str))
 				return _root_handle;
 
-			{
-				Nix_store::Path new_path;
-				_resolve(new_path, path.string());
-				return _backend.node(new_path.base());
-			}
+			char new_path[MAX_PATH_LEN];
+			_resolve(new_path, path_str);
+			return _backend.node(new_path);
 		}
 
-		void close(Node_handle handle) override {
-			return _backend.close(handle);
+		void close(Node_handle handle) override
+		{
+			/* cached input handles are closed with the session */
+			if (_cached_handle(handle))
+				return;
+			_backend.close(handle);
 		}
 
 		Status status(Node_handle handle) {
@@ -251,10 +394,11 @@ class Nix_store::Filter_service : public Genode::Service
 		/**
 		 * Constructor
 		 */
-		Filter_service(Genode::Env &env, Inputs const &inputs)
+		Filter_service(Genode::Env &env, Genode::Allocator &alloc,
+		               Inputs const &inputs)
 		:	Genode::Service(Genode::Service::Name("File_system"),
 			                env.ram_session_cap()),
-			_env(env), _component(env, inputs)
+			_env(env), _component(env, alloc, inputs)
 		{ }
 
 		~Filter_service() { revoke_cap(); }
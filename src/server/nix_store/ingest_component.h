@@ -27,13 +27,26 @@
 #include <base/signal.h>
 #include <base/log.h>
 #include <base/snprintf.h>
+#include <util/reconstructible.h>
 
 /* Local includes */
+#include "ingest_journal.h"
 #include "ingest_node.h"
+#include "ingest_registry.h"
+#include "stream_parser.h"
 
 namespace Nix_store {
 	class Ingest_component;
 	class Ingest_root;
+
+	/*
+	 * Virtual handle of a bulk ingest stream, clear of both
+	 * backend handles and the virtual root handles
+	 */
+	enum { BULK_HANDLE = 0x20000000 };
+
+	inline bool is_bulk_handle(Node_handle handle) {
+		return handle.value == BULK_HANDLE; }
 }
 
 
@@ -44,6 +57,12 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 		Genode::Env             &_env;
 		Genode::Allocator_guard  _alloc;
 
+		/* store-wide registry of ingest sessions */
+		Ingest_registry         &_ingest_registry;
+
+		/* label of the client, empty for a builder */
+		Genode::Session_label const _label;
+
 		/* a queue of packets from the client awaiting backend processing */
 		File_system::Packet_descriptor _packet_queue[TX_QUEUE_SIZE];
 
@@ -51,14 +70,358 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 		File_system::Connection_base   _fs;
 		Dir_handle                     _root_handle;
 
+		/* names that ingested content is scanned for */
+		Genode::Constructible<Reference_set> _references;
+
+		/**
+		 * Prepare a node for content written through this session
+		 */
+		void _track(Hash_node &node)
+		{
+			if (_references.constructed())
+				node.scan(*_references);
+		}
+
 		/* top level hash nodes */
-		Hash_root_registry _root_registry { _alloc, _fs, _root_handle };
+		Hash_root_registry _root_registry { _alloc, _fs, _root_handle, _ingest_registry };
+
+		/* keep the roots of this session from the sweeper */
+		Ingest_registry::Member _registration { _ingest_registry, _root_registry };
 
 		/**
 		 * This registry maps node handles from the backend
 		 * store to the local tree of hashing nodes.
 		 */
-		Hash_node_registry _node_registry;
+		Hash_node_registry _node_registry { _alloc };
+
+		/* journal file roots after this much was written */
+		enum { CHECKPOINT_INTERVAL = 64U << 20 };
+
+		Genode::Constructible<Ingest_journal> _journal;
+		file_size_t                           _unjournaled = 0;
+
+		/**
+		 * Journal the hash state of the file roots in progress
+		 */
+		void _checkpoint()
+		{
+			_unjournaled = 0;
+
+			_root_registry.for_each([&] (Hash_root &root) {
+				File *file = File::cast(root.node);
+				if (root.done || !file)
+					return;
+
+				/* a bulk stream cannot be resumed */
+				if (_bulk.constructed() && _bulk->root == &root)
+					return;
+
+				Journal_entry entry;
+				memset(&entry, 0, sizeof(entry));
+
+				seek_off_t offset = 0;
+				entry.state_len = file->checkpoint(
+					entry.state, sizeof(entry.state), offset);
+				entry.offset = offset;
+
+				if (!entry.state_len) {
+					/* an older entry no longer matches the content */
+					if (root.journaled)
+						_journal->remove(root.name);
+					root.journaled = false;
+					return;
+				}
+
+				entry.magic = Journal_entry::MAGIC;
+				strncpy(entry.filename, root.filename, sizeof(entry.filename));
+				root.journaled = _journal->write(root.name, entry);
+			});
+		}
+
+		/**
+		 * Continue the ingest of a file root from its journal entry
+		 *
+		 * \return true if the backend file of an earlier session was adopted
+		 */
+		bool _resume(Hash_root &root)
+		{
+			Journal_entry entry;
+			if (!_journal->read(root.name, entry))
+				return false;
+
+			try {
+				File_handle handle = _fs.file(
+					_root_handle, entry.filename, READ_WRITE, false);
+				Handle_guard guard(_fs, handle);
+
+				if (_fs.status(handle).size < entry.offset)
+					throw Lookup_failed();
+
+				/* drop what was written after the checkpoint */
+				_fs.truncate(handle, entry.offset);
+
+				if (!File::cast(root.node)->resume(
+					entry.offset, entry.state, entry.state_len))
+					throw Lookup_failed();
+			} catch (...) {
+				Genode::warning("cannot resume ingest of ", (char const *)root.name);
+				_journal->remove(root.name);
+				return false;
+			}
+
+			root.adopt(entry.filename);
+			root.journaled = true;
+
+			/* content from before the checkpoint was not scanned */
+			if (_references.constructed())
+				_references->match_all();
+			Genode::log("resuming ingest of ", (char const *)root.name,
+			            " at ", entry.offset);
+			return true;
+		}
+
+		/**
+		 * Tree created from a bulk ingest stream
+		 *
+		 * Nodes are created at the backend directly, content is
+		 * written synchronously and hashed as it is copied into
+		 * backend packets.
+		 */
+		struct Bulk : Stream_parser::Handler
+		{
+			Ingest_component &component;
+			File_system::Name const name;
+
+			Stream_parser parser { *this };
+			Hash_root    *root = nullptr;
+
+			File        *file_node = nullptr;
+			File_handle  file_handle;
+			seek_off_t   file_offset = 0;
+
+			Bulk(Ingest_component &component, char const *name)
+			: component(component), name(name) { }
+
+			~Bulk() { _close_file(); }
+
+			void _close_file()
+			{
+				if (file_node)
+					component._fs.close(file_handle);
+				file_node = nullptr;
+			}
+
+			/**
+			 * Write the backend path of a node
+			 */
+			void _backend_path(char *dst, size_t len, char const *path)
+			{
+				if (*path)
+					snprintf(dst, len, "/%s/%s", root->filename, path);
+				else
+					snprintf(dst, len, "/%s", root->filename);
+			}
+
+			/**
+			 * Find the parent of a node and split off its name
+			 */
+			Directory &_parent(char const *path, char *parent_path,
+			                   char const **name)
+			{
+				Directory *dir = Directory::cast(root ? root->node : nullptr);
+				if (!dir) throw Lookup_failed();
+
+				char const *slash = nullptr;
+				for (char const *p = path; *p; ++p)
+					if (*p == '/') slash = p;
+
+				if (!slash) {
+					_backend_path(parent_path, MAX_PATH_LEN, "");
+					*name = path;
+					return *dir;
+				}
+
+				char sub_path[MAX_PATH_LEN];
+				strncpy(sub_path, path, min(size_t(slash - path) + 1, sizeof(sub_path)));
+				_backend_path(parent_path, MAX_PATH_LEN, sub_path);
+				*name = slash + 1;
+				return dir->dir(sub_path, false);
+			}
+
+			/**
+			 * Write to the backend and hash what was written
+			 */
+			void _write(File_system::Node_handle handle, Hash_node &node,
+			            uint8_t const *buf, size_t len, seek_off_t offset)
+			{
+				File_system::Session::Tx::Source &source = *component._fs.tx();
+				File_system::Packet_descriptor
+					packet(source.alloc_packet(len), handle,
+					       File_system::Packet_descriptor::WRITE, len, offset);
+				Packet_guard guard(source, packet);
+
+				uint8_t *dst = (uint8_t *)source.packet_content(packet);
+				if (File *file = File::cast(&node))
+					file->copy(dst, buf, len, offset);
+				else
+					memcpy(dst, buf, len);
+
+				source.submit_packet(packet);
+				packet = source.get_acked_packet();
+
+				node.write(dst, packet.length(), offset);
+				if (packet.length() != len)
+					throw No_space();
+			}
+
+
+			/**************************************
+			 ** Stream_parser::Handler interface **
+			 **************************************/
+
+			void directory(char const *path) override
+			{
+				char new_path[MAX_PATH_LEN];
+
+				if (!*path) {
+					root = &component._root_registry.alloc_dir(name.string());
+					_backend_path(new_path, sizeof(new_path), "");
+					component._fs.close(component._fs.dir(new_path, true));
+					return;
+				}
+
+				char const *dir_name;
+				Directory &parent = _parent(path, new_path, &dir_name);
+				_backend_path(new_path, sizeof(new_path), path);
+				component._fs.close(component._fs.dir(new_path, true));
+				parent.dir(dir_name, true);
+			}
+
+			void file(char const *path) override
+			{
+				if (!*path) {
+					root = &component._root_registry.alloc_file(name.string());
+					if (!File::cast(root->node))
+						throw Node_already_exists();
+					file_handle = component._fs.file(
+						component._root_handle, root->filename, WRITE_ONLY, true);
+					file_node   = File::cast(root->node);
+					file_offset = 0;
+					component._track(*file_node);
+					return;
+				}
+
+				char parent_path[MAX_PATH_LEN];
+				char const *file_name;
+				Directory &parent = _parent(path, parent_path, &file_name);
+
+				Dir_handle dir = component._fs.dir(parent_path, false);
+				Handle_guard dir_guard(component._fs, dir);
+
+				file_handle = component._fs.file(dir, file_name, WRITE_ONLY, true);
+				try { file_node = &parent.file(file_name, true); }
+				catch (...) {
+					component._fs.close(file_handle);
+					throw;
+				}
+				file_offset = 0;
+				component._track(*file_node);
+			}
+
+			void file_content(uint8_t const *buf, size_t len) override
+			{
+				size_t const max_len = component._fs.tx()->bulk_buffer_size() / 2;
+				while (len) {
+					size_t const n = min(len, max_len);
+					_write(file_handle, *file_node, buf, n, file_offset);
+					file_offset += n;
+					buf += n;
+					len -= n;
+				}
+			}
+
+			void file_end() override { _close_file(); }
+
+			void symlink(char const *path, char const *target, size_t len) override
+			{
+				char parent_path[MAX_PATH_LEN];
+				char const *link_name;
+				Directory &parent = _parent(path, parent_path, &link_name);
+
+				Dir_handle dir = component._fs.dir(parent_path, false);
+				Handle_guard dir_guard(component._fs, dir);
+
+				Symlink_handle link = component._fs.symlink(dir, link_name, true);
+				Handle_guard link_guard(component._fs, link);
+
+				Symlink &link_node = parent.symlink(link_name, true);
+				component._track(link_node);
+				if (len)
+					_write(link, link_node, (uint8_t const *)target, len, 0);
+			}
+
+			void end(char const *object_name) override
+			{
+				if (*object_name) {
+					if (strlen(object_name) + Store_hash::HASH_PREFIX_LEN + 2 > MAX_NAME_LEN)
+						throw Name_too_long();
+
+					/* the name is hashed when the root is flushed */
+					root->node->name(object_name);
+				}
+				component.finish(*root);
+			}
+		};
+
+		Genode::Constructible<Bulk> _bulk;
+
+		void _close_bulk()
+		{
+			if (!_bulk.constructed())
+				return;
+
+			Hash_root *root = _bulk->root;
+			bool const done = _bulk->parser.done() || (root && root->done);
+			_bulk.destruct();
+
+			/* discard a partial tree */
+			if (root && !done) {
+				if (root->node)
+					_node_registry.remove_tree(*root->node);
+				_root_registry.remove(*root);
+			}
+		}
+
+		/**
+		 * Feed a client packet to the bulk stream
+		 */
+		void _process_bulk_packet(File_system::Packet_descriptor &packet)
+		{
+			uint8_t const *content = (uint8_t const *)tx_sink()->packet_content(packet);
+			size_t const length = packet.length();
+
+			if (!_bulk.constructed() || !content || length > packet.size()
+			 || packet.operation() != File_system::Packet_descriptor::WRITE) {
+				packet.length(0);
+				return;
+			}
+
+			try {
+				_bulk->parser.feed(content, length, packet.position());
+				return;
+			}
+			catch (Stream_parser::Malformed) { Genode::error("malformed ingest stream"); }
+			catch (Node_already_exists)      { Genode::error("Node_already_exists"); }
+			catch (Lookup_failed)            { Genode::error("Lookup_failed"); }
+			catch (Name_too_long)            { Genode::error("Name_too_long"); }
+			catch (Out_of_metadata)          { Genode::error("Out_of_metadata"); }
+			catch (No_space)                 { Genode::error("No_space"); }
+			catch (...)                      { Genode::error("bulk ingest failed"); }
+
+			/* the stream cannot continue after an error */
+			_close_bulk();
+			packet.length(0);
+		}
 
 		/******************************
 		 ** Packet-stream processing **
@@ -82,7 +445,7 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 
 			try {
 				/* Emulate the read of a symlink */
-				if (theirs.handle().value & ROOT_HANDLE_PREFIX) {
+				if (is_root_handle(theirs.handle())) {
 					Hash_root &root = _root_registry.lookup(theirs.handle());
 					if (root.done && theirs.operation() == File_system::Packet_descriptor::READ) {
 						size_t name_len = strlen(root.filename);
@@ -115,7 +478,11 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 						Genode::error("no hash node found for handle on client packet");
 						return false;
 					}
-					memcpy(source.packet_content(ours), content, length);
+					uint8_t *dst = (uint8_t *)source.packet_content(ours);
+					if (File *file = File::cast(hash_node))
+						file->copy(dst, (uint8_t const *)content, length, ours.position());
+					else
+						memcpy(dst, content, length);
 				}
 				source.submit_packet(ours);
 				return true;
@@ -131,6 +498,8 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 		 * We only hash packet conent after is acknowledged by the backend.
 		 * We do not trust our client not to change the content of its shared
 		 * packet buffer, but we have no choice but to trust the storage backend.
+		 * Sequential file writes are hashed from our copy as they are
+		 * submitted and only settled here.
 		 */
 		bool _process_outgoing_packet(int const queue_size)
 		{
@@ -161,6 +530,10 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 
 			uint8_t const *content = (uint8_t const *)source.packet_content(ours);
 			if (!content) {
+				/* settle any write that was hashed at submission */
+				if (ours.operation() == File_system::Packet_descriptor::WRITE)
+					if (File *file = File::cast(_node_registry.lookup(ours.handle())))
+						file->write(nullptr, 0, ours.position());
 				tx_sink()->acknowledge_packet(theirs);
 				source.release_packet(ours);
 				/* invalidate the packet in the queue */
@@ -178,6 +551,7 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 						}
 
 						hash_node->write(content, length, ours.position());
+						_unjournaled += length;
 						break;
 					} catch (Invalid_handle) {
 						Genode::error("Invalid_handle");
@@ -219,16 +593,35 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 			    && tx_sink()->packet_avail()
 			    && n < TX_QUEUE_SIZE)
 			{
-				_packet_queue[n] = tx_sink()->get_packet();
+				File_system::Packet_descriptor packet = tx_sink()->get_packet();
+
+				if (is_bulk_handle(packet.handle())) {
+					/* the stream uses the backend, settle our packets first */
+					_drain(n);
+					n = 0;
+					_process_bulk_packet(packet);
+					tx_sink()->acknowledge_packet(packet);
+					continue;
+				}
+
+				_packet_queue[n] = packet;
 				if (_process_incoming_packet(_packet_queue[n]))
 					++n;
 				else /* no action required at backend */
 					tx_sink()->acknowledge_packet(_packet_queue[n]);
 			}
 
-			/*
-			 * Block while waiting on the server.
-			 */
+			_drain(n);
+
+			if (_journal.constructed() && _unjournaled >= CHECKPOINT_INTERVAL)
+				_checkpoint();
+		}
+
+		/**
+		 * Block until the backend has answered 'n' queued packets
+		 */
+		void _drain(int n)
+		{
 			int outstanding = n;
 			while (n)
 				if (_process_outgoing_packet(n--))
@@ -252,7 +645,7 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 			/* create the local node */
 			if (dir_handle == _root_handle) {
 				Hash_root &root = _root_registry.alloc_file(name);
-				return *dynamic_cast<File *>(root.node);
+				return *File::cast(root.node);
 			}
 
 			Directory &dir_node = _node_registry.lookup_dir(dir_handle);
@@ -262,25 +655,6 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 		static bool is_root(File_system::Path const &path) {
 			return Genode::strcmp(path.string(), "/", 2) == 0; }
 
-		static void empty_dir(File_system::Session &fs, char const *path)
-		{
-			using namespace File_system;
-			Directory_entry dirent;
-
-			Dir_handle dir_handle = fs.dir(path, false);
-			Handle_guard guard(fs, dir_handle);
-
-			while (read(fs, dir_handle, &dirent, sizeof(dirent)) == sizeof(dirent)) {
-				try {
-					fs.unlink(dir_handle, dirent.name);
-				} catch (Not_empty) {
-					Genode::Path<MAX_PATH_LEN> subdir(dirent.name, path);
-					empty_dir(fs, subdir.base());
-					fs.unlink(dir_handle, dirent.name);
-				}
-			}
-		}
-
 		Genode::Signal_handler<Ingest_component> _process_packet_handler
 			{ _env.ep(), *this, &Ingest_component::_process_packets };
 
@@ -293,11 +667,14 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 		 * stream buffer and the backend buffer.
 		 */
 		Ingest_component(Genode::Env &env, Genode::Allocator &alloc,
+		                 Ingest_registry &ingest_registry,
+		                 Genode::Session_label const &label = Genode::Session_label(),
 		                 size_t ram_quota = 16*4096,
 		                 size_t tx_buf_size = File_system::DEFAULT_TX_BUF_SIZE*2)
 		:
 			Session_rpc_object(env.ram().alloc(tx_buf_size/2), env.ep().rpc_ep()),
 			_env(env), _alloc(&alloc, ram_quota),
+			_ingest_registry(ingest_registry), _label(label),
 			_fs(env, _fs_tx_alloc,  "store -> ingest", "/", true, tx_buf_size/2)
 		{
 			_root_handle = _fs.dir("/", false);
@@ -318,6 +695,13 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 		 */
 		~Ingest_component()
 		{
+			/* keep the journaled roots for a later session */
+			if (_journal.constructed()) {
+				_checkpoint();
+				_root_registry.for_each([&] (Hash_root &root) {
+					root.keep = root.journaled; });
+			}
+
 			Dataspace_capability ds = tx_sink()->dataspace();
 			_env.ram().free(static_cap_cast<Ram_dataspace>(ds));
 		}
@@ -345,6 +729,78 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 		void expect(char const *id) {
 			_root_registry.prealloc_root(id); }
 
+		/**
+		 * Hash the root 'name' by the algorithm of a fixed output
+		 */
+		void expect_hash(char const *name, Output_hash::Algo algo) {
+			_root_registry.expect_hash(name, algo); }
+
+		/**
+		 * Write the output digest of a finished file root
+		 *
+		 * \return false if the root has no complete output digest
+		 */
+		bool output_digest(char const *name, uint8_t *buf, size_t len)
+		{
+			try {
+				Hash_root &root = _root_registry.lookup(name);
+				File *file = File::cast(root.node);
+				return root.done && file && file->output_digest(buf, len);
+			} catch (Lookup_failed) { }
+			return false;
+		}
+
+		/**
+		 * Names to scan content written from now on for
+		 */
+		Reference_set &references()
+		{
+			if (!_references.constructed())
+				_references.construct(_alloc);
+			return *_references;
+		}
+
+		/**
+		 * Journal the file roots of this session under a key
+		 *
+		 * A later session with the same key continues the
+		 * ingest of these roots from their last checkpoint.
+		 */
+		void journal(char const *key)
+		{
+			if (!_journal.constructed())
+				_journal.construct(_fs, key);
+		}
+
+		/**
+		 * Remove the journal entries of this session and stop journaling
+		 */
+		void discard_journal()
+		{
+			if (!_journal.constructed())
+				return;
+
+			_root_registry.for_each([&] (Hash_root &root) {
+				if (root.journaled)
+					_journal->remove(root.name);
+				root.journaled = false;
+			});
+			_journal.destruct();
+		}
+
+		/**
+		 * Begin a bulk ingest that is fed by the store itself
+		 *
+		 * The records of the tree are passed to the handler rather
+		 * than parsed from packets, a stream in progress is closed.
+		 */
+		Stream_parser::Handler &stream(char const *name)
+		{
+			_close_bulk();
+			_bulk.construct(*this, name);
+			return *_bulk;
+		}
+
 		void finish(Hash_root &root)
 		{
 			if (root.done)
@@ -353,12 +809,16 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 			_node_registry.close_all(_fs);
 
 			/* Flush the root. */
-			if (File *file_node = dynamic_cast<File *>(root.node)) {
-				File_handle final_handle = _fs.file(_root_handle, root.filename, READ_ONLY, false);
-				Handle_guard guard(_fs, final_handle);
-				file_node->flush(_fs, final_handle);
+			if (File *file_node = File::cast(root.node)) {
+				if (file_node->hashed()) {
+					file_node->flush();
+				} else {
+					File_handle final_handle = _fs.file(_root_handle, root.filename, READ_ONLY, false);
+					Handle_guard guard(_fs, final_handle);
+					file_node->flush(_fs, final_handle);
+				}
 
-			} else if (Directory *dir_node = dynamic_cast<Directory *>(root.node)) {
+			} else if (Directory *dir_node = Directory::cast(root.node)) {
 				char path[MAX_NAME_LEN+1];
 				*path = '/';
 				strncpy(path+1, root.filename, sizeof(path)-1);
@@ -372,7 +832,7 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 
 			uint8_t final_name[MAX_NAME_LEN];
 			root.node->digest(&final_name[1], sizeof(final_name)-1);
-			Store_hash::encode(&final_name[1], root.name, sizeof(final_name)-1);
+			Store_hash::encode(&final_name[1], root.node->name(), sizeof(final_name)-1);
 			final_name[0] = '/';
 
 			try {
@@ -386,15 +846,29 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 				try {
 					_fs.unlink(_root_handle, root.filename);
 				} catch (Not_empty) {
-					Genode::error("not empty, trying a recursive unlink");
-					Genode::Path<MAX_PATH_LEN> path(root.filename);
-					empty_dir(_fs, path.base());
-					_fs.unlink(_root_handle, root.filename);
-					_fs.move(_root_handle, root.filename,
-					         _root_handle, (char *)final_name+1);
+					/*
+					 * The tree is stale once the root is finalized but
+					 * younger than any sweep, so move it out of this
+					 * generation to have the next pass remove it
+					 */
+					char stale[MAX_NAME_LEN];
+					snprintf(stale, sizeof(stale), "ingest-%llu",
+					         _ingest_registry.stale_nonce());
+					try { _fs.move(_root_handle, root.filename, _root_handle, stale); }
+					catch (...) { Genode::error("failed to retire ", (char const *)root.filename); }
+					_ingest_registry.request_sweep();
 				}
 			}
 			root.finalize((char *)final_name+1);
+
+			/* keep the object from a collection in progress */
+			_ingest_registry.created(root.filename);
+			if (_label.valid())
+				_ingest_registry.imported(root.filename, _label);
+
+			if (root.journaled)
+				_journal->remove(root.name);
+			root.journaled = false;
 		}
 
 		/**
@@ -473,7 +947,7 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 				? _root_registry.alloc_dir(root_name)
 				: _root_registry.lookup(root_name);
 
-			Directory *parent_dir = dynamic_cast<Directory *>(root.node);
+			Directory *parent_dir = Directory::cast(root.node);
 			if (!parent_dir) {
 				Genode::error(root_name, " is not a directory");
 				throw Lookup_failed();
@@ -505,20 +979,40 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 		{
 			File_handle handle;
 
+			/* a prefixed name at the top opens a bulk ingest stream */
+			if (dir_handle == _root_handle &&
+			    name.string()[0] == Ingest_stream::PREFIX)
+			{
+				if (!create || mode < WRITE_ONLY || !name.string()[1])
+					throw Permission_denied();
+				if (_bulk.constructed())
+					throw Out_of_metadata();
+
+				try { _bulk.construct(*this, name.string()+1); }
+				catch (Genode::Allocator::Out_of_memory) { throw Out_of_metadata(); }
+				return File_handle(BULK_HANDLE);
+			}
+
 			/* get a local node */
 			Hash_root *root = nullptr;
 			File *file_node;
+			bool resumed = false;
 
 			if (dir_handle == _root_handle) {
 				if (create) {
+					bool const fresh = !_root_registry.contains(name.string())
+						|| !_root_registry.lookup(name.string()).node;
+
 					root = &_root_registry.alloc_file(name.string());
+					if (fresh && _journal.constructed())
+						resumed = _resume(*root);
 				} else {
 					root = &_root_registry.lookup(name.string());
 				}
 				if (!root)
 					throw Lookup_failed();
 
-				file_node = dynamic_cast<File *>(root->node);
+				file_node = File::cast(root->node);
 				if (!file_node) {
 					if (create) {
 						Genode::error("root node ", name.string(), " already exists");
@@ -535,7 +1029,7 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 			/* get a handle for the remote file */
 			try {
 				handle = root
-					? _fs.file(dir_handle, root->filename, mode, create)
+					? _fs.file(dir_handle, root->filename, mode, create && !resumed)
 					: _fs.file(dir_handle, name, mode, create);
 			} catch (Permission_denied) {
 				Genode::error("permission denied at backend"); throw; }
@@ -544,8 +1038,10 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 			 * If this node can't be used to modify data,
 			 * then it is not a node we are concerned with.
 			 */
-			if (mode >= WRITE_ONLY)
+			if (mode >= WRITE_ONLY) {
 				_node_registry.insert(handle, *file_node);
+				_track(*file_node);
+			}
 			return handle;
 		}
 
@@ -557,6 +1053,7 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 
 				Directory &dir_node = _node_registry.lookup_dir(dir_handle);
 				Symlink &link_node = dir_node.symlink(name.string(), create);
+				_track(link_node);
 
 				Symlink_handle handle;
 				try {
@@ -626,14 +1123,22 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 
 		void close(Node_handle handle) override
 		{
-			if (handle == _root_handle || handle.value & ROOT_HANDLE_PREFIX)
+			if (handle == _root_handle || is_root_handle(handle))
+				return;
+			if (is_bulk_handle(handle)) {
+				_close_bulk();
 				return;
+			}
 			_fs.close(handle);
+			_node_registry.remove(handle);
 		}
 
 		Status status(Node_handle node_handle) override
 		{
-			if (node_handle.value & ROOT_HANDLE_PREFIX) {
+			if (is_bulk_handle(node_handle))
+				return Status { 0, Status::MODE_FILE, 0 };
+
+			if (is_root_handle(node_handle)) {
 				Hash_root &root = _root_registry.lookup(node_handle);
 
 				return Status {
@@ -670,12 +1175,19 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 			if (dir_handle == _root_handle) {
 				Hash_root &root = _root_registry.lookup(name_str);
 
+				if (root.journaled)
+					_journal->remove(root.name);
+				if (root.node)
+					_node_registry.remove_tree(*root.node);
 				_root_registry.remove(root);
 				return;
 			}
 
 			Hash_node *node = _node_registry.lookup_dir(dir_handle).remove(name_str);
-			if (node) destroy(_alloc, node);
+			if (node) {
+				_node_registry.remove_tree(*node);
+				destroy(_alloc, node);
+			}
 		}
 
 		void truncate(File_handle file_handle, file_size_t len) override
@@ -695,12 +1207,17 @@ class Nix_store::Ingest_component : public File_system::Session_rpc_object
 			Directory &from_dir_node = _node_registry.lookup_dir(from_dir_handle);
 			Directory   &to_dir_node = _node_registry.lookup_dir(  to_dir_handle);
 
+			/* the local move must not fail after the backend move */
+			to_dir_node.reserve();
+
 			/* make the move now and propagate any exceptions */
 			_fs.move(from_dir_handle, from_name, to_dir_handle, to_name);
 
 			Hash_node *node = to_dir_node.remove(to_name.string());
-			if (node)
+			if (node) {
+				_node_registry.remove_tree(*node);
 				destroy(_alloc, node);
+			}
 
 			node = from_dir_node.remove(from_name.string());
 			if (!node) {
@@ -728,6 +1245,7 @@ class Nix_store::Ingest_root :
 
 		Genode::Env       &_env;
 		Genode::Allocator &_alloc;
+		Ingest_registry   &_ingest_registry;
 
 	protected:
 
@@ -760,7 +1278,8 @@ class Nix_store::Ingest_root :
 
 			try {
 				Ingest_component *session = new (md_alloc())
-					Ingest_component(_env, _alloc, ram_quota, tx_buf_size);
+					Ingest_component(_env, _alloc, _ingest_registry,
+					                 label, ram_quota, tx_buf_size);
 				Genode::log("serving ingest to ", label.string());
 				return session;
 			} catch (...) { Genode::error("cannot issue ingest session"); }
@@ -774,10 +1293,11 @@ class Nix_store::Ingest_root :
 
 	public:
 
-		Ingest_root(Genode::Env &env, Allocator &md_alloc, Allocator &alloc)
+		Ingest_root(Genode::Env &env, Allocator &md_alloc, Allocator &alloc,
+		            Ingest_registry &ingest_registry)
 		:
 			Genode::Root_component<Ingest_component>(&env.ep().rpc_ep(), &md_alloc),
-			_env(env), _alloc(alloc)
+			_env(env), _alloc(alloc), _ingest_registry(ingest_registry)
 		{
 			env.parent().announce(env.ep().manage(*this));
 		}
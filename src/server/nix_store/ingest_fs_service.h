@@ -22,9 +22,11 @@
 #include <nix_store/derivation.h>
 #include <hash/sha256.h>
 #include <hash/blake2s.h>
+#include <store_hash/encode.h>
 
 /* Local includes */
 #include "ingest_component.h"
+#include "util.h"
 
 namespace Nix_store { class Ingest_service; }
 
@@ -33,76 +35,85 @@ class Nix_store::Ingest_service : public Genode::Service
 	private:
 
 		Genode::Env                    &_env;
+		Ingest_registry                &_ingest_registry;
 		Ingest_component                _component;
 		File_system::Session_capability _cap = _env.ep().manage(_component);
 
-		static void hash_file(File_system::Session &fs, File_system::File_handle handle, Hash::Function &hash)
+		/**
+		 * Compare a digest with the base16 or base32 encoding of a fixed output
+		 */
+		static bool _matches(char const *text, uint8_t const *digest, size_t len)
 		{
-			using namespace File_system;
+			size_t const text_len = strlen(text);
+
+			uint8_t expected[len];
+			bool const decoded = (text_len == len*2)
+				? Store_hash::decode_base16(expected, len, text, text_len)
+				: Store_hash::decode_nix_base32(expected, len, text, text_len);
+
+			if (!decoded) {
+				Genode::error("invalid digest ", text);
+				return false;
+			}
+
+			if (Store_hash::equal(expected, digest, len))
+				return true;
 
-			File_system::Session::Tx::Source &source = *fs.tx();
-			/* try to round to the nearest multiple of the hash block size */
-			size_t packet_size =
-			((source.bulk_buffer_size() / hash.block_size()) * hash.block_size()) / 2;
-			File_system::Packet_descriptor raw_packet = source.alloc_packet(packet_size);
-			Packet_guard guard(source, raw_packet);
-
-			while (packet_size > raw_packet.size())
-				packet_size /= 2;
-
-			/* Do a short read to align the packet stream with the block size */
-			size_t n = packet_size;
-			seek_off_t offset = 0;
-
-			collect_acknowledgements(source);
-			do {
-				File_system::Packet_descriptor
-					packet(raw_packet, handle, File_system::Packet_descriptor::READ, n, offset);
-
-				source.submit_packet(packet);
-				packet = source.get_acked_packet();
-				n = packet.length();
-				hash.update((uint8_t *)source.packet_content(packet), n);
-				offset += n;
-			} while (n);
+			char buf[len*2+1];
+			buf[Store_hash::encode_base16(buf, digest, len)] = 0;
+			Genode::error("wanted ", text, ", got ", (char const *)buf);
+			return false;
 		}
 
 		/**
+		 * Verify a fixed output by reading it back
+		 *
+		 * Only needed if the output was not all hashed as it was
+		 * written, such as after resuming from a checkpoint.
+		 *
 		 * TODO: recursive hashing
 		 */
-		static bool _verify(File_system::Session &fs, Hash::Function &hash, char const *hex, char const *filename)
+		static bool _verify(File_system::Session &fs, Hash::Function &hash, char const *text, char const *filename)
 		{
-			/* I'm too lazy to write a decoder, so encode to hex and compare the strings */
-			uint8_t buf[hash.size()*2+1];
-			buf[hash.size()*2] = 0;
-
-			static uint8_t const base16[] = {
-				'0','1','2','3','4','5','6','7',
-				'8','9','a','b','c','d','e','f'
-			};
+			uint8_t buf[hash.size()];
 
 			File_system::Dir_handle root = fs.dir("/", false);
+			File_system::Handle_guard root_guard(fs, root);
 			File_system::File_handle handle;
 			try { handle = fs.file(root, filename, File_system::READ_ONLY, false); }
 			catch (...) {
-				Genode::error("failed to open fixed output ", filename, " for verification", filename);
+				Genode::error("failed to open fixed output ", filename, " for verification");
 				throw ~0;
 			}
 			File_system::Handle_guard guard(fs, handle);
 
 			hash_file(fs, handle, hash);
 			hash.digest(buf, sizeof(buf));
+			return _matches(text, buf, sizeof(buf));
+		}
+
+		/**
+		 * Verify a fixed output, preferably by the digest taken
+		 * while it was written
+		 */
+		bool _verify_output(File_system::Session &fs, char const *id,
+		                    char const *algo, char const *text,
+		                    char const *filename)
+		{
+			Output_hash output;
+			output.algo = Output_hash::algo_from_name(algo);
 
-			for (int i = hash.size()-1, j = hash.size()*2-1; i >= 0; --i) {
-				buf[j--] = base16[buf[i] & 0x0F];
-				buf[j--] = base16[buf[i] >> 4];
+			Hash::Function *hash = output.function();
+			if (!hash) {
+				Genode::error("unknown hash algorithm ", algo);
+				return false;
 			}
 
-			if (strcmp(hex, (char*)buf, strlen(hex)) == 0)
-				return true;
+			uint8_t buf[hash->size()];
+			if (_component.output_digest(id, buf, sizeof(buf)))
+				return _matches(text, buf, sizeof(buf));
 
-			Genode::error("fixed output ", filename, " is invalid, wanted ", hex, ", got ", (char const*)buf);
-			return false;
+			return _verify(fs, *hash, text, filename);
 		}
 
 		/**
@@ -130,13 +141,97 @@ class Nix_store::Ingest_service : public Genode::Service
 			/* add a terminating byte for rump_fs */
 			File_system::write(fs, link, final_str, Genode::strlen(final_str)+1);
 			fs.close(link);
+
+			_ingest_registry.created(path);
+		}
+
+		/**
+		 * Collect the names that the outputs may refer to
+		 *
+		 * Outputs may refer to the sources, to the requested
+		 * outputs of the inputs, and to each other. The builder
+		 * sees an input only by the name of the object that holds
+		 * its content, so that is the name searched for, and a
+		 * reference found is recorded under the input path too.
+		 */
+		void _add_candidates(File_system::Session &fs, Nix_store::Derivation &drv)
+		{
+			Reference_set &set = _component.references();
+
+			drv.sources([&] (Aterm::Parser &parser) {
+				Nix_store::Name source;
+				parser.string(&source);
+				set.add(source.string());
+			});
+
+			drv.inputs([&] (Aterm::Parser &parser) {
+				Nix_store::Name input;
+				parser.string(&input);
+
+				Nix_store::Derivation depend(_env, input.string());
+
+				parser.list([&] (Aterm::Parser &parser) {
+					Nix_store::Name want_id;
+					parser.string(&want_id);
+
+					depend.outputs([&] (Aterm::Parser &parser) {
+						Nix_store::Name id;
+						Nix_store::Name path;
+						parser.string(&id);
+						parser.string(&path);
+						if (id == want_id) {
+							char const *name = path.string();
+							while (*name == '/') ++name;
+
+							Object_path object;
+							try { object = dereference(fs, name); }
+							catch (...) { }
+
+							if (object == "")
+								set.add(name);
+							else
+								set.add(object.string(), name);
+						}
+						parser.string(); /* Algo */
+						parser.string(); /* Hash */
+					});
+				});
+			});
+
+			drv.outputs([&] (Aterm::Parser &parser) {
+				Nix_store::Name path;
+				parser.string(); /* Id */
+				parser.string(&path);
+				set.add(path.string());
+				parser.string(); /* Algo */
+				parser.string(); /* Hash */
+			});
+		}
+
+		/**
+		 * Record the references found in the content of an output
+		 */
+		void _add_references(char const *output, char const *path)
+		{
+			while (*path == '/') ++path;
+
+			_component.references().for_each_found([&] (char const *to) {
+				/* a reference to itself does not keep an output */
+				if (!Genode::strcmp(to, path) || !Genode::strcmp(to, output))
+					return;
+
+				/* the references are queried by either name */
+				_ingest_registry.referenced(output, to);
+				_ingest_registry.referenced(path, to);
+			});
 		}
 
 		/**
 		 * Finalize the derivation outputs at the ingest session and
 		 * create symlinks from the derivation outputs to hashed outputs.
 		 */
-		bool _finalize(File_system::Session &fs, Nix_store::Derivation &drv)
+		bool _finalize(File_system::Session &fs, Nix_store::Derivation &drv,
+		               char const *drv_name)
 		{
 			using namespace File_system;
 
@@ -164,15 +259,8 @@ class Nix_store::Ingest_service : public Genode::Service
 
 				try {
 				if ((algo != "") || (digest != "")) {
-					bool valid = false;
-					if (algo == "sha256") {
-						Hash::Sha256 hash;
-						valid = _verify(fs, hash, digest.string(), output);
-					} else if (algo == "blake2s") {
-						Hash::Blake2s hash;
-						valid = _verify(fs, hash, digest.string(), output);
-					} else
-						Genode::error("unknown hash algorithm ", algo.string());
+					bool const valid = _verify_output(
+						fs, id.string(), algo.string(), digest.string(), output);
 					if (!valid) {
 						Genode::error("fixed output ", id.string(), ":", path.string(), " is invalid");
 						throw ~0;
@@ -198,8 +286,15 @@ class Nix_store::Ingest_service : public Genode::Service
 				parser.string(&path);
 
 				_link_from_inputs(fs, id.string(), path.string());
+				_ingest_registry.derived(path.string(), drv_name);
 				--outstanding;
 
+				if (char const *output = _component.ingest(id.string())) {
+					try { _add_references(output, path.string()); }
+					catch (...) {
+						Genode::error("failed to record the references of ", path.string()); }
+				}
+
 				parser.string(/* Algo */); 
 				parser.string(/* Hash */);
 			});
@@ -222,18 +317,56 @@ class Nix_store::Ingest_service : public Genode::Service
 		 * Constructor
 		 */
 		Ingest_service(Nix_store::Derivation &drv,
-		               Genode::Env &env, Genode::Allocator &alloc)
+		               File_system::Session &fs,
+		               Genode::Env &env, Genode::Allocator &alloc,
+		               Ingest_registry &ingest_registry)
 		:	Genode::Service(Genode::Service::Name("File_system"),
 			                env.ram_session_cap()),
-			_env(env), _component(env, alloc)
-		{ }
+			_env(env), _ingest_registry(ingest_registry),
+			_component(env, alloc, ingest_registry)
+		{
+			/* the references of the outputs are unknown without candidates */
+			_add_candidates(fs, drv);
+
+			/* fixed outputs are hashed as they are written */
+			drv.outputs([&] (Aterm::Parser &parser) {
+				Nix_store::Name id;
+				Nix_store::Name algo;
+				parser.string(&id);
+				parser.string(); /* Path */
+				parser.string(&algo);
+				parser.string(); /* Hash */
+
+				Output_hash::Algo const output_algo =
+					Output_hash::algo_from_name(algo.string());
+				if (output_algo != Output_hash::NONE)
+					_component.expect_hash(id.string(), output_algo);
+			});
+		}
 
 		~Ingest_service() { revoke_cap(); }
 
-		bool finalize(File_system::Session &fs, Nix_store::Derivation &drv)
+		void journal(char const *key) { _component.journal(key); }
+
+		void discard_journal() { _component.discard_journal(); }
+
+		/**
+		 * Ingest an output as a stream of records from the store
+		 */
+		Stream_parser::Handler &stream(char const *id) {
+			return _component.stream(id); }
+
+		/**
+		 * Return the final name of an output, or null if it failed
+		 */
+		char const *ingested(char const *id) {
+			return _component.ingest(id); }
+
+		bool finalize(File_system::Session &fs, Nix_store::Derivation &drv,
+		              char const *drv_name)
 		{
 			revoke_cap();
-			try { return _finalize(fs, drv); } catch (...) { }
+			try { return _finalize(fs, drv, drv_name); } catch (...) { }
 			return false;
 		}
 
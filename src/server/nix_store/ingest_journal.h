@@ -0,0 +1,171 @@
+/*
+ * \brief  Journal of partially ingested files
+ * \author Emery Hemingway
+ * \date   2017-02-16
+ *
+ * The hash state of a file root is written to the journal
+ * at intervals, so that a build killed to yield resources
+ * or lost to a restart of the store may continue its ingest
+ * from the last checkpoint rather than from the beginning.
+ *
+ * Entries are kept at the backend in a hidden directory and
+ * are named by a digest of the journal key, the name of the
+ * derivation, and the name of the root within the session.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _NIX_STORE__INGEST_JOURNAL_H_
+#define _NIX_STORE__INGEST_JOURNAL_H_
+
+/* Genode includes */
+#include <store_hash/encode.h>
+#include <file_system/util.h>
+#include <hash/blake2s.h>
+#include <base/log.h>
+
+/* Nix includes */
+#include <nix_store/types.h>
+
+namespace Nix_store {
+	struct Journal_entry;
+	class  Ingest_journal;
+}
+
+
+struct Nix_store::Journal_entry
+{
+	enum {
+		MAGIC         = 0x6e696a31, /* "nij1" */
+		MAX_STATE_LEN = 256
+	};
+
+	Genode::uint32_t magic;
+	Genode::uint32_t state_len;
+	Genode::uint64_t offset;
+	char             filename[File_system::MAX_NAME_LEN];
+	Genode::uint8_t  state[MAX_STATE_LEN];
+
+	/**
+	 * Check an entry read back from the backend
+	 *
+	 * Only uncommitted ingest files may be adopted.
+	 */
+	bool valid() const
+	{
+		return magic == MAGIC && state_len && state_len <= MAX_STATE_LEN
+		    && offset
+		    && filename[sizeof(filename)-1] == '\0'
+		    && !Genode::strcmp(filename, "ingest-", 7);
+	}
+};
+
+
+class Nix_store::Ingest_journal
+{
+	public:
+
+		typedef Genode::String<65> Entry_name;
+
+	private:
+
+		File_system::Session &_fs;
+		Nix_store::Name const _key;
+
+		Entry_name _entry_name(char const *root_name)
+		{
+			Hash::Blake2s hash;
+			hash.update((Genode::uint8_t const *)_key.string(), _key.length());
+			hash.update((Genode::uint8_t const *)root_name,
+			            Genode::strlen(root_name));
+
+			Genode::uint8_t digest[32];
+			hash.digest(digest, sizeof(digest));
+
+			char buf[sizeof(digest)*2+1];
+			buf[Store_hash::encode_base16(buf, digest, sizeof(digest))] = '\0';
+			return Entry_name((char const *)buf);
+		}
+
+		File_system::Dir_handle _dir(bool create)
+		{
+			try { return _fs.dir(directory(), false); }
+			catch (File_system::Lookup_failed) {
+				if (!create) throw; }
+			return _fs.dir(directory(), true);
+		}
+
+	public:
+
+		static char const *directory() { return "/.ingest-journal"; }
+
+		Ingest_journal(File_system::Session &fs, char const *key)
+		: _fs(fs), _key(key) { }
+
+		/**
+		 * Record the state of a root, replacing any previous entry
+		 *
+		 * \return false if the entry could not be written
+		 */
+		bool write(char const *root_name, Journal_entry const &entry)
+		{
+			using namespace File_system;
+
+			try {
+				Dir_handle dir = _dir(true);
+				Handle_guard dir_guard(_fs, dir);
+
+				File_handle file = _fs.file(
+					dir, _entry_name(root_name).string(), WRITE_ONLY, true);
+				Handle_guard file_guard(_fs, file);
+
+				if (File_system::write(_fs, file, &entry, sizeof(entry))
+				    != sizeof(entry))
+					throw No_space();
+				_fs.truncate(file, sizeof(entry));
+				return true;
+			} catch (...) {
+				Genode::error("failed to journal ingest of ", root_name);
+			}
+			return false;
+		}
+
+		/**
+		 * Read the entry of a root
+		 *
+		 * \return false if there is no valid entry
+		 */
+		bool read(char const *root_name, Journal_entry &entry)
+		{
+			using namespace File_system;
+
+			try {
+				Dir_handle dir = _dir(false);
+				Handle_guard dir_guard(_fs, dir);
+
+				File_handle file = _fs.file(
+					dir, _entry_name(root_name).string(), READ_ONLY, false);
+				Handle_guard file_guard(_fs, file);
+
+				return File_system::read(_fs, file, &entry, sizeof(entry))
+				       == sizeof(entry) && entry.valid();
+			} catch (...) { }
+			return false;
+		}
+
+		void remove(char const *root_name)
+		{
+			try {
+				File_system::Dir_handle dir = _dir(false);
+				File_system::Handle_guard dir_guard(_fs, dir);
+				_fs.unlink(dir, _entry_name(root_name).string());
+			} catch (...) { }
+		}
+};
+
+#endif /* _NIX_STORE__INGEST_JOURNAL_H_ */
@@ -17,35 +17,44 @@
 /* Genode includes. */
 #include <file_system/util.h>
 #include <hash/blake2s.h>
-#include <util/list.h>
-#include <trace/timestamp.h>
+#include <hash/sha256.h>
+#include <base/log.h>
+
+/* Local includes */
+#include "reference_scanner.h"
 
 namespace Nix_store {
 
 	using namespace Genode;
 	using namespace File_system;
 
+	struct Output_hash;
+
 	class Hash_node;
 	class File;
 	class Symlink;
 	class Directory;
 
-	struct Hash_node_registry;
+	class  Hash_node_registry;
 	struct Hash_root_registry;
+	struct Nonce_source;
 
 	struct Hash_root;
 
 	enum {
 		/*
-		 * Maximum number of ingest roots.
 		 * The prefix and mask is used to return handles for virtual
-		 * symlink nodes that do not exist on the backend.
+		 * symlink nodes that do not exist on the backend. The prefix
+		 * is a high bit so it does not collide with backend handles,
+		 * the bits below it hold the index of the root.
 		 */
-		MAX_ROOT_NODES     = 64,
-		ROOT_HANDLE_PREFIX = 0x80,
-		ROOT_HANDLE_MASK   = 0X3F
+		ROOT_HANDLE_PREFIX = 0x40000000,
+		ROOT_HANDLE_MASK   = ROOT_HANDLE_PREFIX - 1
 	};
 
+	inline bool is_root_handle(Node_handle handle) {
+		return handle.value >= 0 && (handle.value & ROOT_HANDLE_PREFIX); }
+
 	/**
 	 * Write the first element to name and return the start of the second path.
 	 */
@@ -64,22 +73,37 @@ namespace Nix_store {
 
 }
 
-class Nix_store::Hash_node : public List<Hash_node>::Element {
+class Nix_store::Hash_node
+{
+	public:
+
+		/**
+		 * Node type, checked instead of using RTTI
+		 */
+		enum Type { TYPE_FILE, TYPE_SYMLINK, TYPE_DIRECTORY };
 
 	private:
 
-		char _name[MAX_NAME_LEN];
+		char       _name[MAX_NAME_LEN];
+		Type const _type;
 
 	protected:
 
 		Hash::Blake2s _hash;
 
+		Reference_scanner _scanner;
+
 	public:
 
 		/**
 		 * Constructor
 		 */
-		Hash_node(char const *node_name) { name(node_name); }
+		Hash_node(Type type, char const *node_name)
+		: _type(type) { name(node_name); }
+
+		virtual ~Hash_node() { }
+
+		Type type() const { return _type; }
 
 		char const *name() const { return _name; }
 
@@ -89,17 +113,227 @@ class Nix_store::Hash_node : public List<Hash_node>::Element {
 		virtual void write(uint8_t const *dst, size_t len, seek_off_t offset) {
 			throw Invalid_handle(); }
 
+		/**
+		 * Scan content for references to the names of a set
+		 */
+		void scan(Reference_set &set) { _scanner.set(&set); }
+
 		void digest(uint8_t *buf, size_t len) {
 			return _hash.digest(buf, len); }
 
 };
 
 
+/**
+ * Hash of the content of a fixed output, as named by its derivation
+ *
+ * Kept alongside the store hash so that a fixed output is
+ * verified as it is written rather than read back afterwards.
+ */
+struct Nix_store::Output_hash
+{
+	enum Algo { NONE, SHA256, BLAKE2S };
+
+	Algo          algo   = NONE;
+	bool          synced = true; /* all content hashed so far was seen */
+	Hash::Sha256  sha256;
+	Hash::Blake2s blake2s;
+
+	static Algo algo_from_name(char const *name)
+	{
+		if (!strcmp(name, "sha256"))  return SHA256;
+		if (!strcmp(name, "blake2s")) return BLAKE2S;
+		return NONE;
+	}
+
+	Hash::Function *function()
+	{
+		switch (algo) {
+		case SHA256:  return &sha256;
+		case BLAKE2S: return &blake2s;
+		case NONE:    break;
+		}
+		return nullptr;
+	}
+
+	void update(uint8_t const *buf, size_t len)
+	{
+		if (Hash::Function *fn = function())
+			fn->update(buf, len);
+	}
+
+	void reset()
+	{
+		if (Hash::Function *fn = function())
+			fn->reset();
+		synced = true;
+	}
+};
+
+
 class Nix_store::File : public Hash_node
 {
 	private:
 
-		seek_off_t _offset; /* Last content position hashed. */
+		/* number of reads kept in flight when reading back content */
+		enum { READ_WINDOW = 4 };
+
+		/* size of the steps in which a write is copied and hashed */
+		enum { COPY_CHUNK = 4096 };
+
+		seek_off_t  _offset = 0; /* Last content position hashed. */
+		file_size_t _size   = 0; /* Extent written or truncated to. */
+
+		/**
+		 * A write hashed when it was submitted to the backend
+		 *
+		 * The hash state from before the write is kept until the
+		 * backend acknowledges it, and restored if fewer bytes
+		 * were written than were hashed.
+		 */
+		struct Speculation
+		{
+			Hash::Blake2s     hash;
+			Output_hash       output;
+			Reference_scanner scanner;
+			seek_off_t        offset;
+			size_t            length;
+			bool              dirty; /* other content was hashed since */
+		};
+
+		Speculation _spec;
+		bool        _speculating = false;
+
+		Output_hash _output;
+
+		void _update(uint8_t const *buf, size_t len)
+		{
+			_hash.update(buf, len);
+			_output.update(buf, len);
+			_scanner.update(buf, len);
+		}
+
+		void _reset()
+		{
+			_offset = 0;
+			_speculating = false;
+			_hash.reset();
+			_output.reset();
+			_scanner.reset();
+		}
+
+		/**
+		 * Settle a speculative write acknowledged by the backend
+		 */
+		void _acknowledge(uint8_t const *buf, size_t len)
+		{
+			_speculating = false;
+			if (len == _spec.length)
+				return;
+
+			/* roll back unless later content depends on this write */
+			if (_spec.dirty) {
+				_reset();
+				return;
+			}
+			_hash    = _spec.hash;
+			_output  = _spec.output;
+			_scanner = _spec.scanner;
+			_offset  = _spec.offset;
+			_update(buf, len);
+			_offset += len;
+		}
+
+		/**
+		 * Hash content from the backend that was not seen by 'write'
+		 *
+		 * Reads are submitted in windows of consecutive packets
+		 * and hashed in order of position once all are acknowledged.
+		 */
+		void _read_back(File_system::Session &fs, File_handle handle)
+		{
+			using namespace File_system;
+
+			Session::Tx::Source &source = *fs.tx();
+
+			/* round the packet size to a multiple of the hash block size */
+			size_t const block = _hash.block_size();
+			size_t const packet_size = max(block,
+				((source.bulk_buffer_size() / (2*READ_WINDOW)) / block) * block);
+
+			struct Window
+			{
+				Session::Tx::Source &source;
+				Packet_descriptor    raw[READ_WINDOW];
+				unsigned             count = 0;
+
+				Window(Session::Tx::Source &source, size_t packet_size)
+				: source(source)
+				{
+					try {
+						for (; count < READ_WINDOW; ++count)
+							raw[count] = source.alloc_packet(packet_size);
+					} catch (Session::Tx::Source::Packet_alloc_failed) {
+						if (!count) throw;
+					}
+				}
+
+				~Window()
+				{
+					for (unsigned i = 0; i < count; ++i)
+						source.release_packet(raw[i]);
+				}
+			} window(source, packet_size);
+
+			while (_offset < _size) {
+				Packet_descriptor acked[READ_WINDOW];
+				size_t            requested[READ_WINDOW];
+				seek_off_t const  base = _offset;
+
+				unsigned n = 0;
+				for (seek_off_t pos = base; n < window.count && pos < _size; ++n) {
+					requested[n] = min(_size - pos, (file_size_t)packet_size);
+					source.submit_packet(Packet_descriptor(
+						window.raw[n], handle, Packet_descriptor::READ,
+						requested[n], pos));
+					pos += requested[n];
+				}
+
+				/* acknowledgements are not necessarily in order */
+				for (unsigned i = 0; i < n; ++i) {
+					Packet_descriptor packet = source.get_acked_packet();
+					unsigned const j = (packet.position() - base) / packet_size;
+					if (packet.position() >= base && j < n)
+						acked[j] = packet;
+					else
+						Genode::error("unexpected packet during read back");
+				}
+
+				for (unsigned i = 0; i < n; ++i) {
+					size_t const length = acked[i].length();
+					_update((uint8_t *)source.packet_content(acked[i]), length);
+					_offset += length;
+
+					/* a short read leaves a gap before the next packet */
+					if (length < requested[i]) break;
+				}
+
+				if (_offset == base) {
+					Genode::error(name(), " is shorter than expected");
+					_size = _offset;
+				}
+			}
+		}
+
+		/**
+		 * Append the type and name
+		 */
+		void _finish()
+		{
+			_hash.update((uint8_t *)"\0f\0", 3);
+			_hash.update((uint8_t *)name(), strlen(name()));
+			_offset = 0;
+		}
 
 	public:
 
@@ -107,72 +341,160 @@ class Nix_store::File : public Hash_node
 		 * Constructor
 		 */
 		File(char const *filename)
-		: Hash_node(filename) { }
+		: Hash_node(TYPE_FILE, filename) { }
+
+		static File *cast(Hash_node *node) {
+			return (node && node->type() == TYPE_FILE)
+				? static_cast<File *>(node) : nullptr; }
+
+		/**
+		 * Copy a write into a backend packet, hashing it on the way
+		 *
+		 * Hashing each chunk right after it is copied reads the
+		 * data while it is still in cache, rather than reading the
+		 * backend packet again when it is acknowledged. Only
+		 * sequential writes are hashed this way, the copy in the
+		 * backend buffer is hashed so the client cannot change
+		 * the content after the fact.
+		 */
+		void copy(uint8_t *dst, uint8_t const *src, size_t len, seek_off_t offset)
+		{
+			if (_speculating || offset != _offset) {
+				memcpy(dst, src, len);
+				return;
+			}
+
+			_spec = Speculation { _hash, _output, _scanner, offset, len, false };
+			_speculating = true;
+
+			for (size_t i = 0; i < len; i += COPY_CHUNK) {
+				size_t const n = min(len - i, (size_t)COPY_CHUNK);
+				memcpy(dst+i, src+i, n);
+				_hash.update(dst+i, n);
+				_output.update(dst+i, n);
+				_scanner.update(dst+i, n);
+			}
+			_offset += len;
+		}
 
 		/**
 		 * Update hash with new data if it is sequential with previous data.
 		 */
 		void write(uint8_t const *dst, size_t len, seek_off_t offset)
 		{
+			_size = max(_size, (file_size_t)(offset + len));
+
+			if (_speculating) {
+				if (offset == _spec.offset) {
+					_acknowledge(dst, len);
+					return;
+				}
+				_spec.dirty = true;
+			}
+
 			if (offset > _offset)
 				return;
-			if (offset < _offset) {
-				_offset = 0;
-				_hash.reset();
-			}
+			if (offset < _offset)
+				_reset();
 
-			_hash.update(dst, len);
+			_update(dst, len);
 			_offset += len;
 		}
 
 		void truncate(file_size_t size)
 		{
+			_size = size;
+
 			if (size >= _offset)
 				return;
 
-			_offset = 0;
-			_hash.reset();
+			_reset();
+		}
+
+		/**
+		 * Return true if all content was hashed as it was written
+		 *
+		 * Every write and truncate passes through the ingest
+		 * session, so the local extent matches the backend.
+		 */
+		bool hashed() const { return _offset == _size; }
+
+		/**
+		 * Export the state of the content hashed so far
+		 *
+		 * \return length of the state, zero if there is no
+		 *         state that could be resumed from
+		 */
+		size_t checkpoint(uint8_t *buf, size_t len, seek_off_t &offset)
+		{
+			if (_speculating || !_offset)
+				return 0;
+
+			offset = _offset;
+			return _hash.export_state(buf, len);
+		}
+
+		/**
+		 * Continue hashing from a checkpoint
+		 *
+		 * The backend file must be truncated to 'offset' by the caller.
+		 */
+		bool resume(seek_off_t offset, uint8_t const *state, size_t len)
+		{
+			if (_offset || !_hash.import_state(state, len))
+				return false;
+
+			_offset = offset;
+			_size   = offset;
+
+			/* the output hash is not part of the checkpoint */
+			_output.synced = false;
+			return true;
+		}
+
+		/**
+		 * Hash the content with the algorithm of a fixed output
+		 *
+		 * Must be set before any content is written.
+		 */
+		void output_hash(Output_hash::Algo algo)
+		{
+			if (!_offset) _output.algo = algo;
 		}
 
+		/**
+		 * Write the digest of the content by the output hash
+		 *
+		 * \return false if the content was not all seen by the
+		 *         output hash and must be read back to verify
+		 */
+		bool output_digest(uint8_t *buf, size_t len)
+		{
+			Hash::Function *fn = _output.function();
+			if (!fn || !_output.synced)
+				return false;
+			fn->digest(buf, len);
+			return true;
+		}
+
+		/**
+		 * Finish a file that was hashed as it was written
+		 */
+		void flush() { _finish(); }
+
+		/**
+		 * Hash any content not seen by 'write' and append the name
+		 */
 		void flush(File_system::Session &fs, File_handle handle)
 		{
-			file_size_t size = fs.status(handle).size;
-
-			if (size != _offset) {
-				File_system::Session::Tx::Source &source = *fs.tx();
-				/* try to round to the nearest multiple of the hash block size */
-				size_t packet_size =
-					((source.bulk_buffer_size() / _hash.block_size()) * _hash.block_size()) / 2;
-				File_system::Packet_descriptor raw_packet =
-					source.alloc_packet(packet_size);
-				Packet_guard guard(source, raw_packet);
-
-				while (packet_size > raw_packet.size())
-					packet_size /= 2;
-
-				/* Do a short read to align the packet stream with the block size */
-				size_t n = _offset % packet_size;
-				if (!n) n = packet_size;
-
-				while (_offset < size) {
-					File_system::Packet_descriptor
-						packet(raw_packet, handle,
-						       File_system::Packet_descriptor::READ,
-						       n, _offset);
-
-					source.submit_packet(packet);
-					packet = source.get_acked_packet();
-					size_t length = packet.length();
-					_hash.update((uint8_t *)source.packet_content(packet), length);
-					_offset += length;
-					n = min(size - _offset, packet_size);
-				}
-			}
+			_size = fs.status(handle).size;
+			if (_offset > _size)
+				_reset();
 
-			/* Append the type and name. */
-			_hash.update((uint8_t *)"\0f\0", 3);
-			_hash.update((uint8_t *)name(), strlen(name()));
-			_offset = 0;
+			if (_offset < _size)
+				_read_back(fs, handle);
+
+			_finish();
 		}
 };
 
@@ -185,7 +507,11 @@ class Nix_store::Symlink : public Hash_node
 		 * Constructor
 		 */
 		Symlink(char const *filename)
-		: Hash_node(filename) { }
+		: Hash_node(TYPE_SYMLINK, filename) { }
+
+		static Symlink *cast(Hash_node *node) {
+			return (node && node->type() == TYPE_SYMLINK)
+				? static_cast<Symlink *>(node) : nullptr; }
 
 		/**
 		 * Update hash with symlink target.
@@ -197,10 +523,15 @@ class Nix_store::Symlink : public Hash_node
 
 			_hash.reset();
 			_hash.update(dst, len);
+			_scanner.reset();
+			_scanner.update(dst, len);
 		}
 
 
-		void flush(File_system::Session &fs, Symlink_handle handle)
+		/**
+		 * The target is hashed when written, so the backend is not needed
+		 */
+		void flush()
 		{
 			/* Append the type and name. */
 			_hash.update((uint8_t *)"\0s\0", 3);
@@ -209,32 +540,95 @@ class Nix_store::Symlink : public Hash_node
 };
 
 
+/**
+ * Directory of hashing nodes
+ *
+ * Children are kept in an array of pointers sorted by name,
+ * which is the order in which they are hashed. Lookup is a
+ * binary search and insertion moves pointers only.
+ */
 class Nix_store::Directory : public Hash_node
 {
 	private:
 
+		enum { INITIAL_CAPACITY = 8U };
+
 		Genode::Allocator &_alloc;
-		List<Hash_node>    _children;
 
-		File *lookup_file(char const *file_name)
+		Hash_node **_children = nullptr;
+		unsigned    _count    = 0;
+		unsigned    _capacity = 0;
+
+		/**
+		 * Binary search for a child
+		 *
+		 * \return true if found, 'pos' is set to the position
+		 *         of the child or where it would be inserted
+		 */
+		bool _find(char const *name, unsigned &pos) const
 		{
-			for (Hash_node *node = _children.first(); node; node = node->next()) {
-				File *file = dynamic_cast<File *>(node);
-				if (file)
-					if (strcmp(file->name(), file_name, MAX_NAME_LEN) == 0)
-						return file;
+			unsigned lo = 0, hi = _count;
+			while (lo < hi) {
+				unsigned const mid = lo + (hi - lo) / 2;
+				int const n = strcmp(name, _children[mid]->name(), MAX_NAME_LEN);
+				if (n == 0) {
+					pos = mid;
+					return true;
+				}
+				if (n < 0) hi = mid; else lo = mid + 1;
 			}
+			pos = lo;
+			return false;
+		}
+
+		Hash_node *_lookup(char const *name) const
+		{
+			unsigned pos;
+			return _find(name, pos) ? _children[pos] : nullptr;
+		}
+
+		void _insert_at(unsigned pos, Hash_node *node)
+		{
+			reserve();
+			memmove(&_children[pos+1], &_children[pos],
+			        (_count - pos)*sizeof(Hash_node *));
+			_children[pos] = node;
+			++_count;
+		}
+
+		/**
+		 * Create a child node unless the name is taken
+		 */
+		template <typename T, typename... ARGS>
+		T &_create(char const *name, ARGS &&... args)
+		{
+			unsigned pos;
+			if (_find(name, pos))
+				throw Node_already_exists();
+
+			/* grow first so that a node is not leaked */
+			reserve();
+
+			T *node;
+			try { node = new (_alloc) T(name, args...); }
+			catch (Genode::Allocator::Out_of_memory) {
+				throw Out_of_metadata(); }
+
+			_insert_at(pos, node);
+			return *node;
+		}
+
+		File *lookup_file(char const *file_name)
+		{
+			if (File *file = File::cast(_lookup(file_name)))
+				return file;
 			throw Lookup_failed();
 		}
 
 		Directory &lookup_dir(char const *dir_name)
 		{
-			for (Hash_node *node = _children.first(); node; node = node->next()) {
-				Directory *dir = dynamic_cast<Directory *>(node);
-				if (dir)
-					if (strcmp(dir->name(), dir_name, MAX_NAME_LEN) == 0)
-						return *dir;
-			}
+			if (Directory *dir = cast(_lookup(dir_name)))
+				return *dir;
 			throw Lookup_failed();
 		}
 
@@ -244,61 +638,125 @@ class Nix_store::Directory : public Hash_node
 		 * Constructor
 		 */
 		Directory(char const *name, Genode::Allocator &alloc)
-		: Hash_node(name), _alloc(alloc) { }
+		: Hash_node(TYPE_DIRECTORY, name), _alloc(alloc) { }
 
 		~Directory()
 		{
-			for (Hash_node *node = _children.first(); node; node = node->next())
-				destroy(_alloc, node);
+			for (unsigned i = 0; i < _count; ++i)
+				destroy(_alloc, _children[i]);
+			if (_capacity)
+				_alloc.free(_children, _capacity*sizeof(Hash_node *));
+		}
+
+		static Directory *cast(Hash_node *node) {
+			return (node && node->type() == TYPE_DIRECTORY)
+				? static_cast<Directory *>(node) : nullptr; }
+
+		static Directory const *cast(Hash_node const *node) {
+			return (node && node->type() == TYPE_DIRECTORY)
+				? static_cast<Directory const *>(node) : nullptr; }
+
+		/**
+		 * Call 'fn' with each child in name order
+		 */
+		template <typename FUNC>
+		void for_each_child(FUNC const &fn) const
+		{
+			for (unsigned i = 0; i < _count; ++i)
+				fn(*(Hash_node const *)_children[i]);
 		}
 
 		/**
-		 * Insert a node into the ordered list of children.
+		 * Ensure that one more child may be inserted without allocation
 		 */
-		void insert(Hash_node *node)
+		void reserve()
 		{
-			char const *new_name = node->name();
+			if (_count < _capacity)
+				return;
 
-			Hash_node *prev = 0;
-			Hash_node *cur = _children.first();
+			unsigned const capacity =
+				_capacity ? _capacity*2 : (unsigned)INITIAL_CAPACITY;
 
-			while (cur) {
-				if (strcmp(new_name, cur->name()) < 0)
-					break;
-				prev = cur; cur = cur->next();
-			}
+			Hash_node **children;
+			try {
+				children = (Hash_node **)
+					_alloc.alloc(capacity*sizeof(Hash_node *));
+			} catch (Genode::Allocator::Out_of_memory) {
+				throw Out_of_metadata(); }
 
-			_children.insert(node, prev);
+			if (_capacity) {
+				memcpy(children, _children, _count*sizeof(Hash_node *));
+				_alloc.free(_children, _capacity*sizeof(Hash_node *));
+			}
+			_children = children;
+			_capacity = capacity;
 		}
 
 		/**
-		 * Remove a node from the list of children
+		 * Insert a node into the ordered children
+		 *
+		 * A child of the same name is replaced and returned.
 		 */
-		Hash_node *remove(char const *name)
+		Hash_node *insert(Hash_node *node)
 		{
-			for (Hash_node *node = _children.first();
-			     node; node = node->next())
-			{
-				int n = strcmp(name, node->name());
-				if (n < 0)
-					continue;
-
-				if (n > 0) /* not in the list */
-					return 0;
-
-				_children.remove(node);
-				return node;
+			unsigned pos;
+			if (_find(node->name(), pos)) {
+				Hash_node *old = _children[pos];
+				_children[pos] = node;
+				return old;
 			}
+			_insert_at(pos, node);
+			return nullptr;
+		}
 
-			return 0;
+		/**
+		 * Remove a node from the children
+		 */
+		Hash_node *remove(char const *name)
+		{
+			unsigned pos;
+			if (!_find(name, pos))
+				return nullptr;
+
+			Hash_node *node = _children[pos];
+			--_count;
+			memmove(&_children[pos], &_children[pos+1],
+			        (_count - pos)*sizeof(Hash_node *));
+			return node;
 		}
 
+		/**
+		 * Finish the children and fold their digests in name order
+		 *
+		 * Files and symlinks hashed as they were written are
+		 * finished without a round trip to the backend.
+		 */
 		void flush(File_system::Session &fs, char const *path)
 		{
 			uint8_t buf[_hash.size()];
 
-			Dir_handle handle = fs.dir(path, false);
-			Handle_guard guard(fs, handle);
+			/* the backend directory is only opened to read back files */
+			struct Lazy_dir
+			{
+				File_system::Session &fs;
+				char const           *path;
+				Dir_handle            handle;
+				bool                  open = false;
+
+				Lazy_dir(File_system::Session &fs, char const *path)
+				: fs(fs), path(path) { }
+
+				~Lazy_dir() { if (open) fs.close(handle); }
+
+				Dir_handle operator () ()
+				{
+					if (!open) {
+						handle = fs.dir(path, false);
+						open = true;
+					}
+					return handle;
+				}
+			} dir_handle(fs, path);
 
 			char sub_path[MAX_PATH_LEN];
 			strncpy(sub_path, path, sizeof(sub_path));
@@ -311,39 +769,36 @@ class Nix_store::Directory : public Hash_node
 			++sub_path_insert;
 			--sub_name_len;
 
-			for (Hash_node *node = _children.first(); node; node = node->next()) {
-				File *file_node = dynamic_cast<File *>(node);
-				if (file_node) {
+			for (unsigned i = 0; i < _count; ++i) {
+				Hash_node *node = _children[i];
+
+				switch (node->type()) {
+				case TYPE_FILE: {
+					File &file_node = *static_cast<File *>(node);
+					if (file_node.hashed()) {
+						file_node.flush();
+						break;
+					}
 					File_handle file_handle =
-						fs.file(handle, file_node->name(), READ_ONLY, false);
+						fs.file(dir_handle(), file_node.name(), READ_ONLY, false);
 					Handle_guard file_guard(fs, file_handle);
-					file_node->flush(fs, file_handle);
-					file_node->digest(buf, sizeof(buf));
-					_hash.update(buf, sizeof(buf));
-					continue;
+					file_node.flush(fs, file_handle);
+					break;
 				}
 
-				Symlink *link_node = dynamic_cast<Symlink *>(node);
-				if (link_node) {
-					Symlink_handle link_handle =
-						fs.symlink(handle, link_node->name(), false);
-					Handle_guard link_guard(fs, link_handle);
-					link_node->flush(fs, link_handle);
-					link_node->digest(buf, sizeof(buf));
-					_hash.update(buf, sizeof(buf));
-					continue;
-				}
+				case TYPE_SYMLINK:
+					static_cast<Symlink *>(node)->flush();
+					break;
 
-				Directory *dir_node = dynamic_cast<Directory *>(node);
-				if (dir_node) {
-					strncpy(sub_path_insert, dir_node->name(), sub_name_len);
-					dir_node->flush(fs, sub_path);
-					dir_node->digest(buf, sizeof(buf));
-					_hash.update(buf, sizeof(buf));
-					continue;
-				}
+				case TYPE_DIRECTORY: {
+					Directory &dir_node = *static_cast<Directory *>(node);
+					strncpy(sub_path_insert, dir_node.name(), sub_name_len);
+					dir_node.flush(fs, sub_path);
+					break;
+				}}
 
-				throw Invalid_handle();
+				node->digest(buf, sizeof(buf));
+				_hash.update(buf, sizeof(buf));
 			}
 
 			/* Append the type and name. */
@@ -356,13 +811,8 @@ class Nix_store::Directory : public Hash_node
 			char name[MAX_NAME_LEN];
 			char const *sub_path = split_path(name, path);
 
-			if (create && !*sub_path) try {
-				Directory *dir = new (_alloc) Directory(name, _alloc);
-				insert(dir);
-				return *dir;
-			} catch (Genode::Allocator::Out_of_memory) {
-				throw Out_of_metadata();
-			}
+			if (create && !*sub_path)
+				return _create<Directory>(name, _alloc);
 
 			Directory &dir = lookup_dir(name);
 			if (*sub_path)
@@ -372,103 +822,189 @@ class Nix_store::Directory : public Hash_node
 
 		File &file(char const *name, bool create)
 		{
-			File *file;
-			if (create) try {
-				file = new (_alloc) File(name);
-				insert(file);
-				return *file;
-			} catch (Genode::Allocator::Out_of_memory) {
-				 throw Out_of_metadata();
-			}
+			if (create)
+				return _create<File>(name);
 
-			for (Hash_node *node = _children.first();
-				node; node = node->next()) {
-				File *file = dynamic_cast<File *>(node);
-				if (file)
-					if (strcmp(file->name(), name, MAX_NAME_LEN) == 0)
-						return *file;
-			}
-			throw Lookup_failed();
+			return *lookup_file(name);
 		}
 
 		Symlink &symlink(char const *name, bool create)
 		{
-			Symlink *link;
-			if (create) try {
-				link = new (_alloc) Symlink(name);
-				insert(link);
-				return *link;
-			} catch (Genode::Allocator::Out_of_memory) {
-				 throw Out_of_metadata();
-			}
+			if (create)
+				return _create<Symlink>(name);
 
-			for (Hash_node *node = _children.first();
-				node; node = node->next()) {
-				Symlink *link = dynamic_cast<Symlink *>(node);
-				if (link)
-					if (strcmp(link->name(), name, MAX_NAME_LEN) == 0)
-						return *link;
-			}
+			if (Symlink *link = Symlink::cast(_lookup(name)))
+				return *link;
 			throw Lookup_failed();
 		}
 };
 
 
-struct Nix_store::Hash_node_registry
+/**
+ * Map of open backend handles to hashing nodes
+ *
+ * Backend handle values are small and dense, so the map is a
+ * table indexed by value that doubles when a handle beyond its
+ * end is opened. Open handles are also kept in a dense array
+ * so that closing all of them does not scan the whole table.
+ */
+class Nix_store::Hash_node_registry
 {
+	private:
 
-	/* maximum number of open nodes per session */
-	enum { MAX_NODE_HANDLES = 128U };
+		enum { INITIAL_CAPACITY = 64U };
 
-			/*
-			 * A mapping of open client handle from
-			 * the backend to our hashing nodes.
-			 */
-			Hash_node *_nodes[MAX_NODE_HANDLES];
+		struct Entry
+		{
+			Hash_node *node;
+			unsigned   live; /* position in '_live' */
+		};
 
-			Hash_node_registry()
-			{
-				for (unsigned i = 0; i < MAX_NODE_HANDLES; ++i)
-					_nodes[i] = 0;
-			}
+		Genode::Allocator &_alloc;
 
-			void close_all(File_system::Session &fs)
-			{
-				for (unsigned i = 0; i < MAX_NODE_HANDLES; ++i)
-					if (_nodes[i])
-						fs.close(Node_handle(i));
+		Entry    *_entries  = nullptr;
+		int      *_live     = nullptr;
+		unsigned  _capacity = 0;
+		unsigned  _count    = 0;
+
+		void _grow(unsigned min_capacity)
+		{
+			unsigned capacity = _capacity ? _capacity : INITIAL_CAPACITY;
+			while (capacity <= min_capacity)
+				capacity *= 2;
+
+			Entry *entries = nullptr;
+			int   *live    = nullptr;
+			try {
+				entries = (Entry *)_alloc.alloc(capacity*sizeof(Entry));
+				live    = (int   *)_alloc.alloc(capacity*sizeof(int));
+			} catch (Genode::Allocator::Out_of_memory) {
+				if (entries) _alloc.free(entries, capacity*sizeof(Entry));
+				throw Out_of_metadata();
 			}
 
-			void insert(Node_handle handle, Hash_node &node)
-			{
-				if (handle.value >= 0 && handle.value > MAX_NODE_HANDLES)
-					throw Out_of_metadata();
+			for (unsigned i = 0; i < capacity; ++i)
+				entries[i] = Entry { nullptr, 0 };
+			for (unsigned i = 0; i < _capacity; ++i)
+				entries[i] = _entries[i];
+			for (unsigned i = 0; i < _count; ++i)
+				live[i] = _live[i];
+
+			_free();
+			_entries  = entries;
+			_live     = live;
+			_capacity = capacity;
+		}
 
-				_nodes[handle.value] = &node;
-			}
+		void _free()
+		{
+			if (!_capacity) return;
+			_alloc.free(_entries, _capacity*sizeof(Entry));
+			_alloc.free(_live,    _capacity*sizeof(int));
+		}
 
-			Hash_node *lookup(Node_handle handle)
-			{
-				int i = handle.value;
-				return (i >= 0 && i < MAX_NODE_HANDLES) ?
-					_nodes[i] : nullptr;
-			}
+		void _remove(int value)
+		{
+			Entry &e = _entries[value];
+			int const last = _live[--_count];
+			_live[e.live] = last;
+			_entries[last].live = e.live;
+			e = Entry { nullptr, 0 };
+		}
 
-			File &lookup_file(Node_handle handle)
-			{
-				Hash_node *node = lookup(handle);
-				File *file = dynamic_cast<File *>(node);
-				if (file) return *file;
-				throw Invalid_handle();
+	public:
+
+		Hash_node_registry(Genode::Allocator &alloc) : _alloc(alloc) { }
+
+		~Hash_node_registry() { _free(); }
+
+		/**
+		 * Close every open handle at the backend
+		 */
+		void close_all(File_system::Session &fs)
+		{
+			while (_count) {
+				int const value = _live[_count-1];
+				fs.close(Node_handle(value));
+				_remove(value);
 			}
+		}
 
-			Directory &lookup_dir(Node_handle handle)
-			{
-				Hash_node *node = lookup(handle);
-				Directory *dir = dynamic_cast<Directory *>(node);
-				if (dir) return *dir;
+		void insert(Node_handle handle, Hash_node &node)
+		{
+			if (handle.value < 0)
 				throw Invalid_handle();
+
+			unsigned const i = handle.value;
+			if (i >= _capacity)
+				_grow(i);
+
+			if (!_entries[i].node) {
+				_entries[i].live = _count;
+				_live[_count++] = i;
 			}
+			_entries[i].node = &node;
+		}
+
+		/**
+		 * Forget a handle closed by the client
+		 */
+		void remove(Node_handle handle)
+		{
+			unsigned const i = handle.value;
+			if (handle.value >= 0 && i < _capacity && _entries[i].node)
+				_remove(i);
+		}
+
+		/**
+		 * Forget the handles of a node that is about to be destroyed
+		 */
+		void remove(Hash_node const &node)
+		{
+			for (unsigned i = 0; i < _count; )
+				if (_entries[_live[i]].node == &node)
+					_remove(_live[i]);
+				else
+					++i;
+		}
+
+		/**
+		 * Forget the handles of a node and of every node below it
+		 *
+		 * Destroying a directory destroys its children, so a handle
+		 * on any of them must not outlive the directory.
+		 */
+		void remove_tree(Hash_node const &node)
+		{
+			if (!_count)
+				return;
+
+			remove(node);
+			if (Directory const *dir = Directory::cast(&node))
+				dir->for_each_child([&] (Hash_node const &child) {
+					remove_tree(child); });
+		}
+
+		Hash_node *lookup(Node_handle handle)
+		{
+			unsigned const i = handle.value;
+			return (handle.value >= 0 && i < _capacity) ?
+				_entries[i].node : nullptr;
+		}
+
+		File &lookup_file(Node_handle handle)
+		{
+			if (File *file = File::cast(lookup(handle)))
+				return *file;
+			throw Invalid_handle();
+		}
+
+		Directory &lookup_dir(Node_handle handle)
+		{
+			if (Directory *dir = Directory::cast(lookup(handle)))
+				return *dir;
+			throw Invalid_handle();
+		}
 };
 
 
@@ -489,17 +1025,34 @@ struct Nix_store::Hash_root
 		char           filename[MAX_NAME_LEN];
 		Hash_node     *node = nullptr;
 		unsigned const index;
+		unsigned const name_hash;
 		bool           done = false;
+		bool           journaled = false;
+		bool           keep = false; /* leave the backend node on removal */
+
+		/* hash of a fixed output, applied when the file is created */
+		Output_hash::Algo output_algo = Output_hash::NONE;
 
-		Hash_root(char const *root_name, int index, uint64_t nonce) : index(index)
+		/* next root in the same bucket of the registry */
+		Hash_root *bucket_next = nullptr;
+
+		Hash_root(char const *root_name, unsigned index, unsigned name_hash,
+		          uint64_t nonce)
+		: index(index), name_hash(name_hash)
 		{
 			strncpy(name, root_name, sizeof(name));
-			snprintf(filename, sizeof(filename), "ingest-%llu", ++nonce);
+			snprintf(filename, sizeof(filename), "ingest-%llu", nonce);
 		}
 
 		Symlink_handle handle() {
 			return index | ROOT_HANDLE_PREFIX; }
 
+		/**
+		 * Take over the backend node of an earlier session
+		 */
+		void adopt(char const *backend_name) {
+			strncpy(filename, backend_name, sizeof(filename)); }
+
 		void finalize(char const *name)
 		{
 			strncpy(filename, name, sizeof(filename));
@@ -508,9 +1061,23 @@ struct Nix_store::Hash_root
 };
 
 
+/**
+ * Source of the nonces that name ingest roots at the backend
+ */
+struct Nix_store::Nonce_source
+{
+	virtual uint64_t next_nonce() = 0;
+};
+
+
 /**
  * Allocates and manages Hash_roots
  *
+ * Roots are found by name through a hash table and by handle
+ * through a table of slots indexed by the handle. Both tables
+ * double as roots are added, so a session may ingest any number
+ * of roots within its quota.
+ *
  * Allocation is implemented in such a way that it may be
  * interupted by an out of memory exception and later resumed.
  */
@@ -518,57 +1085,162 @@ class Nix_store::Hash_root_registry
 {
 	private:
 
-		Hash_root         *_roots[MAX_ROOT_NODES];
+		enum { INITIAL_CAPACITY = 16U };
+
 		Genode::Allocator &_alloc;
 
 		File_system::Session &_fs;
 		File_system::Dir_handle  _root_handle;
 
-		/* use a random initial nonce */
-		Genode::uint64_t _nonce = Genode::Trace::timestamp();
-		bool             _strict = false;
+		Hash_root **_slots         = nullptr;
+		unsigned   *_free_slots    = nullptr;
+		unsigned    _slot_capacity = 0;
+		unsigned    _slot_count    = 0; /* slots ever used */
+		unsigned    _free_count    = 0;
 
-		Hash_root *_lookup(char const *name)
+		Hash_root **_buckets      = nullptr;
+		unsigned    _bucket_count = 0;
+		unsigned    _count        = 0;
+
+		Nonce_source &_nonces;
+		bool          _strict = false;
+
+		/**
+		 * FNV-1a hash of a root name
+		 */
+		static unsigned _hash(char const *name)
 		{
-			/* check if the root exists*/
-			for (size_t i = 0; i < MAX_ROOT_NODES; ++i)
-				if (_roots[i] && (strcmp(_roots[i]->name, name, MAX_NAME_LEN) == 0))
-					return _roots[i];
-			return nullptr;
+			unsigned h = 2166136261U;
+			for (unsigned i = 0; i < MAX_NAME_LEN && name[i]; ++i)
+				h = (h ^ (uint8_t)name[i]) * 16777619U;
+			return h;
 		}
 
-		Hash_root &_alloc_root(char const *name)
+		template <typename T>
+		T *_alloc_array(unsigned count)
+		{
+			try { return (T *)_alloc.alloc(count*sizeof(T)); }
+			catch (Genode::Allocator::Out_of_memory) {
+				throw Out_of_metadata(); }
+		}
+
+		template <typename T>
+		void _free_array(T *array, unsigned count)
 		{
-			for (int i = 0; i < MAX_ROOT_NODES; ++i) {
-				if (_roots[i])
-					continue;
+			if (array) _alloc.free(array, count*sizeof(T));
+		}
 
-				try {
-					_roots[i] = new (_alloc) Hash_root(name, i, ++_nonce);
-					return *(_roots[i]);
-				} catch (Genode::Allocator::Out_of_memory) {
+		/**
+		 * Make room for one more root in both tables
+		 */
+		void _reserve()
+		{
+			if (!_free_count && _slot_count == _slot_capacity) {
+				unsigned const capacity = _slot_capacity
+					? _slot_capacity*2 : (unsigned)INITIAL_CAPACITY;
+				if (capacity > ROOT_HANDLE_MASK)
 					throw Out_of_metadata();
+
+				Hash_root **slots = _alloc_array<Hash_root *>(capacity);
+				unsigned   *free_slots;
+				try { free_slots = _alloc_array<unsigned>(capacity); }
+				catch (...) {
+					_free_array(slots, capacity);
+					throw;
+				}
+
+				for (unsigned i = 0; i < _slot_count; ++i)
+					slots[i] = _slots[i];
+
+				_free_array(_slots, _slot_capacity);
+				_free_array(_free_slots, _slot_capacity);
+				_slots         = slots;
+				_free_slots    = free_slots;
+				_slot_capacity = capacity;
+			}
+
+			if (_count < _bucket_count)
+				return;
+
+			/* keep the load factor of the name table below one */
+			unsigned const bucket_count = _bucket_count
+				? _bucket_count*2 : (unsigned)INITIAL_CAPACITY;
+			Hash_root **buckets = _alloc_array<Hash_root *>(bucket_count);
+			for (unsigned i = 0; i < bucket_count; ++i)
+				buckets[i] = nullptr;
+
+			for (unsigned i = 0; i < _bucket_count; ++i) {
+				while (Hash_root *root = _buckets[i]) {
+					_buckets[i] = root->bucket_next;
+					Hash_root *&head = buckets[root->name_hash & (bucket_count-1)];
+					root->bucket_next = head;
+					head = root;
 				}
 			}
-			throw Out_of_metadata();
+
+			_free_array(_buckets, _bucket_count);
+			_buckets      = buckets;
+			_bucket_count = bucket_count;
+		}
+
+		Hash_root *_lookup(char const *name)
+		{
+			if (!_bucket_count)
+				return nullptr;
+
+			unsigned const h = _hash(name);
+			for (Hash_root *root = _buckets[h & (_bucket_count-1)];
+			     root; root = root->bucket_next)
+				if (root->name_hash == h &&
+				    strcmp(root->name, name, MAX_NAME_LEN) == 0)
+					return root;
+			return nullptr;
+		}
+
+		Hash_root &_alloc_root(char const *name)
+		{
+			_reserve();
+
+			unsigned const index = _free_count
+				? _free_slots[_free_count-1] : _slot_count;
+			unsigned const h = _hash(name);
+
+			Hash_root *root;
+			try { root = new (_alloc) Hash_root(name, index, h, _nonces.next_nonce()); }
+			catch (Genode::Allocator::Out_of_memory) {
+				throw Out_of_metadata(); }
+
+			if (_free_count)
+				--_free_count;
+			else
+				++_slot_count;
+			_slots[index] = root;
+
+			Hash_root *&head = _buckets[h & (_bucket_count-1)];
+			root->bucket_next = head;
+			head = root;
+			++_count;
+
+			return *root;
 		}
 
 	public:
 
 		Hash_root_registry(Genode::Allocator &alloc,
 		                   File_system::Session &fs,
-		                   File_system::Dir_handle root)
-		: _alloc(alloc), _fs(fs), _root_handle(root)
-		{
-			for (unsigned i = 0; i < MAX_ROOT_NODES; ++i)
-				_roots[i] = nullptr;
-		}
+		                   File_system::Dir_handle root,
+		                   Nonce_source &nonces)
+		: _alloc(alloc), _fs(fs), _root_handle(root), _nonces(nonces) { }
 
 		~Hash_root_registry()
 		{
-			for (unsigned i = 0; i < MAX_ROOT_NODES; ++i)
-				if (_roots[i])
-					remove(*_roots[i]);
+			for (unsigned i = 0; i < _slot_count; ++i)
+				if (_slots[i])
+					remove(*_slots[i]);
+
+			_free_array(_slots, _slot_capacity);
+			_free_array(_free_slots, _slot_capacity);
+			_free_array(_buckets, _bucket_count);
 		}
 
 		void prealloc_root(char const *name)
@@ -607,13 +1279,48 @@ class Nix_store::Hash_root_registry
 		{
 			Hash_root &root = alloc_root(name);
 			if (!root.node) try {
-				root.node = new (_alloc) File(name);
+				File *file = new (_alloc) File(name);
+				file->output_hash(root.output_algo);
+				root.node = file;
 			} catch (Genode::Allocator::Out_of_memory) {
 				throw Out_of_metadata();
 			}
 			return root;
 		}
 
+		/**
+		 * Hash a root that is a fixed output by its algorithm
+		 */
+		void expect_hash(char const *name, Output_hash::Algo algo)
+		{
+			Hash_root *root = _lookup(name);
+			if (!root)
+				root = &_alloc_root(name);
+			root->output_algo = algo;
+		}
+
+		bool contains(char const *name) { return _lookup(name) != nullptr; }
+
+		/**
+		 * Return true if a root in progress uses a backend node
+		 */
+		bool owns(char const *filename)
+		{
+			for (unsigned i = 0; i < _slot_count; ++i)
+				if (_slots[i] && !_slots[i]->done &&
+				    !strcmp(_slots[i]->filename, filename, MAX_NAME_LEN))
+					return true;
+			return false;
+		}
+
+		template <typename FUNC>
+		void for_each(FUNC const &fn)
+		{
+			for (unsigned i = 0; i < _slot_count; ++i)
+				if (_slots[i])
+					fn(*_slots[i]);
+		}
+
 		/**
 		 * Find the root for a given name
 		 *
@@ -627,24 +1334,36 @@ class Nix_store::Hash_root_registry
 		}
 
 		/**
-		 * Find the root by index
+		 * Find the root by handle
 		 *
 		 * \throw Lookup_failed
 		 */
 		Hash_root &lookup(Node_handle handle)
 		{
-			if (Hash_root *root = _roots[handle.value&ROOT_HANDLE_MASK])
-				return *root;
+			unsigned const index = handle.value & ROOT_HANDLE_MASK;
+			if (is_root_handle(handle) && index < _slot_count)
+				if (Hash_root *root = _slots[index])
+					return *root;
 			throw Lookup_failed();
 		}
 
 		void remove(Hash_root &root)
 		{
-			_roots[root.index] = nullptr;
+			for (Hash_root **p = &_buckets[root.name_hash & (_bucket_count-1)];
+			     *p; p = &(*p)->bucket_next)
+				if (*p == &root) {
+					*p = root.bucket_next;
+					break;
+				}
+			--_count;
+
+			_slots[root.index] = nullptr;
+			_free_slots[_free_count++] = root.index;
+
 			if (root.node)
 				destroy(_alloc, root.node);
 
-			if (!root.done) try {
+			if (!root.done && !root.keep) try {
 				_fs.unlink(_root_handle, root.filename);
 			} catch (...) { }
 
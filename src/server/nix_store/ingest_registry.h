@@ -0,0 +1,231 @@
+/*
+ * \brief  Registry of the ingest sessions of the store
+ * \author Emery Hemingway
+ * \date   2017-02-17
+ *
+ * Ingest roots are created at the backend as 'ingest-<nonce>'.
+ * The upper half of a nonce is a generation number that is
+ * incremented and stored at the backend each time the store
+ * starts, the lower half counts the roots of this instance.
+ * Any root outside the range of this instance is left over from
+ * an earlier instance of the store, roots within it are only stale
+ * if no session holds them.
+ *
+ * Objects finalised by ingest are reported through the registry
+ * so that they are recorded in the path-info database and are not
+ * removed by a collection in progress.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _NIX_STORE__INGEST_REGISTRY_H_
+#define _NIX_STORE__INGEST_REGISTRY_H_
+
+/* Genode includes */
+#include <file_system/util.h>
+#include <base/session_label.h>
+#include <base/snprintf.h>
+#include <base/signal.h>
+#include <base/lock.h>
+#include <base/log.h>
+#include <util/list.h>
+
+/* Local includes */
+#include "ingest_node.h"
+
+namespace Nix_store { class Ingest_registry; }
+
+
+class Nix_store::Ingest_registry : public Nonce_source
+{
+	public:
+
+		/**
+		 * Registration of a session, lives as long as the session
+		 */
+		class Member : public Genode::List<Member>::Element
+		{
+			private:
+
+				Ingest_registry    &_registry;
+				Hash_root_registry &_roots;
+
+				friend class Ingest_registry;
+
+			public:
+
+				Member(Ingest_registry &registry, Hash_root_registry &roots)
+				: _registry(registry), _roots(roots) {
+					_registry._members.insert(this); }
+
+				~Member() { _registry._members.remove(this); }
+		};
+
+		/**
+		 * Receiver of the objects and references created by ingest
+		 */
+		struct Observer : Genode::List<Observer>::Element
+		{
+			virtual void created(char const *name) = 0;
+			virtual void referenced(char const *from, char const *to) = 0;
+			virtual void derived(char const *output, char const *deriver) { }
+
+			/**
+			 * Object finalised by the client session labeled 'label'
+			 */
+			virtual void imported(char const *name,
+			                      Genode::Session_label const &label) { }
+		};
+
+	private:
+
+		Genode::List<Member>              _members;
+		Genode::uint64_t const            _epoch;
+		Genode::uint64_t                  _last_nonce = _epoch;
+		Genode::Lock                      _nonce_lock;
+		Genode::Signal_context_capability _sweep_sigh;
+		Genode::List<Observer>            _observers;
+
+		/**
+		 * Increment the generation stored at the backend
+		 */
+		static Genode::uint64_t _next_generation(File_system::Session &fs)
+		{
+			using namespace File_system;
+
+			Dir_handle root = fs.dir("/", false);
+			Handle_guard root_guard(fs, root);
+
+			char const *name = generation_file()+1;
+			File_handle file;
+			try { file = fs.file(root, name, READ_WRITE, false); }
+			catch (Lookup_failed) { file = fs.file(root, name, READ_WRITE, true); }
+			Handle_guard file_guard(fs, file);
+
+			char buf[24];
+			Genode::size_t n = read(fs, file, buf, sizeof(buf)-1);
+			buf[n] = '\0';
+
+			Genode::uint64_t generation = 0;
+			Genode::ascii_to_unsigned(buf, generation, 10);
+			++generation;
+
+			n = Genode::snprintf(buf, sizeof(buf), "%llu", generation);
+			fs.truncate(file, 0);
+			if (write(fs, file, buf, n) != n) {
+				Genode::error("failed to store the ingest generation");
+				throw No_space();
+			}
+			return generation;
+		}
+
+	public:
+
+		static char const *generation_file() { return "/.ingest-generation"; }
+
+		/**
+		 * Constructor
+		 *
+		 * \throw File_system exceptions if the generation
+		 *        cannot be stored at the backend
+		 */
+		Ingest_registry(File_system::Session &fs)
+		: _epoch(_next_generation(fs) << 32) { }
+
+		/**
+		 * First nonce of this instance
+		 */
+		Genode::uint64_t epoch() const { return _epoch; }
+
+		/**
+		 * Last nonce issued by this instance
+		 */
+		Genode::uint64_t last_nonce()
+		{
+			Genode::Lock::Guard guard(_nonce_lock);
+			return _last_nonce;
+		}
+
+		/**
+		 * Return true if a nonce was issued by this instance
+		 */
+		bool current(Genode::uint64_t nonce) {
+			return nonce > _epoch && nonce <= last_nonce(); }
+
+		Genode::uint64_t next_nonce() override
+		{
+			Genode::Lock::Guard guard(_nonce_lock);
+			return ++_last_nonce;
+		}
+
+		/**
+		 * Return a nonce below the epoch of any generation
+		 *
+		 * A backend node named by it is stale to the next sweep,
+		 * regardless of its age.
+		 */
+		Genode::uint64_t stale_nonce() { return next_nonce() & 0xffffffffULL; }
+
+		/**
+		 * Return true if a session is ingesting to a backend node
+		 */
+		bool live(char const *filename)
+		{
+			for (Member *m = _members.first(); m; m = m->next())
+				if (m->_roots.owns(filename))
+					return true;
+			return false;
+		}
+
+		void add_observer(Observer &o)    { _observers.insert(&o); }
+		void remove_observer(Observer &o) { _observers.remove(&o); }
+
+		void created(char const *name)
+		{
+			for (Observer *o = _observers.first(); o; o = o->next())
+				o->created(name);
+		}
+
+		void referenced(char const *from, char const *to)
+		{
+			for (Observer *o = _observers.first(); o; o = o->next())
+				o->referenced(from, to);
+		}
+
+		/**
+		 * Report that a derivation produced an output
+		 */
+		void derived(char const *output, char const *deriver)
+		{
+			for (Observer *o = _observers.first(); o; o = o->next())
+				o->derived(output, deriver);
+		}
+
+		/**
+		 * Report that a client session finalised an object
+		 */
+		void imported(char const *name, Genode::Session_label const &label)
+		{
+			for (Observer *o = _observers.first(); o; o = o->next())
+				o->imported(name, label);
+		}
+
+		void sweep_sigh(Genode::Signal_context_capability sigh) {
+			_sweep_sigh = sigh; }
+
+		/**
+		 * Ask for stale roots to be removed
+		 */
+		void request_sweep()
+		{
+			if (_sweep_sigh.valid())
+				Genode::Signal_transmitter(_sweep_sigh).submit();
+		}
+};
+
+#endif /* _NIX_STORE__INGEST_REGISTRY_H_ */
@@ -0,0 +1,637 @@
+/*
+ * \brief  Database of store path metadata
+ * \author Emery Hemingway
+ * \date   2017-02-20
+ *
+ * Validity, derivers and references of store objects are kept
+ * at the backend in a log of fixed-size records that is only
+ * appended to. The log is read into indexes when the store is
+ * started, and queries are answered from the indexes without
+ * touching the backend.
+ *
+ * The database observes the ingest registry, so objects and
+ * references are recorded as ingest finalises them. Objects that
+ * were present before the log was started are recorded when the
+ * store is started with an empty log.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _NIX_STORE__PATH_INFO_DB_H_
+#define _NIX_STORE__PATH_INFO_DB_H_
+
+/* Genode includes */
+#include <store_hash/encode.h>
+#include <file_system/util.h>
+#include <util/avl_tree.h>
+#include <base/allocator.h>
+#include <base/lock.h>
+#include <base/log.h>
+
+/* Nix includes */
+#include <nix_store/types.h>
+
+/* Local includes */
+#include "ingest_registry.h"
+
+namespace Nix_store {
+	struct Db_record;
+	class  Path_info_db;
+}
+
+
+struct Nix_store::Db_record
+{
+	enum { MAGIC = 0x6e696462 /* "nidb" */ };
+
+	enum Kind {
+		VALID     = 1, /* 'name' is present */
+		INVALID   = 2, /* 'name' was removed */
+		DERIVER   = 3, /* 'name' is an output of 'other' */
+		REFERENCE = 4, /* 'name' refers to 'other' */
+	};
+
+	Genode::uint32_t magic;
+	Genode::uint32_t kind;
+	char             name[MAX_NAME_LEN];
+	char             other[MAX_NAME_LEN];
+
+	bool valid() const
+	{
+		return magic == MAGIC && kind >= VALID && kind <= REFERENCE
+		    && name[sizeof(name)-1] == '\0'
+		    && other[sizeof(other)-1] == '\0';
+	}
+};
+
+
+class Nix_store::Path_info_db : private Ingest_registry::Observer
+{
+	private:
+
+		struct Entry;
+
+		/**
+		 * Set of entries, kept in an array
+		 */
+		struct Entries
+		{
+			Entry    **array    = nullptr;
+			unsigned   count    = 0;
+			unsigned   capacity = 0;
+
+			bool contains(Entry *e) const
+			{
+				for (unsigned i = 0; i < count; ++i)
+					if (array[i] == e) return true;
+				return false;
+			}
+
+			void add(Genode::Allocator &alloc, Entry *e)
+			{
+				if (contains(e)) return;
+
+				if (count == capacity) {
+					unsigned const n = capacity ? capacity*2 : 4;
+					Entry **a = (Entry **)alloc.alloc(n*sizeof(Entry *));
+					for (unsigned i = 0; i < count; ++i)
+						a[i] = array[i];
+					free(alloc);
+					array    = a;
+					capacity = n;
+				}
+				array[count++] = e;
+			}
+
+			void remove(Entry *e)
+			{
+				for (unsigned i = 0; i < count; ++i)
+					if (array[i] == e) {
+						array[i] = array[--count];
+						return;
+					}
+			}
+
+			void free(Genode::Allocator &alloc)
+			{
+				if (array)
+					alloc.free(array, capacity*sizeof(Entry *));
+				array    = nullptr;
+				count    = 0;
+				capacity = 0;
+			}
+		};
+
+		struct Entry : Genode::Avl_node<Entry>
+		{
+			Name const name;
+
+			bool     valid   = false;
+			Entry   *deriver = nullptr;
+			Entries  references;
+			Entries  referrers;
+			Entries  outputs;
+			Entry   *stale   = nullptr; /* link while pruning */
+
+			Entry(char const *name) : name(name) { }
+
+			bool higher(Entry *e) const {
+				return Genode::strcmp(e->name.string(), name.string()) > 0; }
+
+			Entry *find(char const *n)
+			{
+				int const c = Genode::strcmp(n, name.string());
+				if (c == 0) return this;
+				Entry *e = Avl_node<Entry>::child(c > 0);
+				return e ? e->find(n) : nullptr;
+			}
+
+			/**
+			 * Find a valid entry by the hash part of its name
+			 */
+			Entry *find_hash_part(char const *part)
+			{
+				int const c = Genode::strcmp(part, name.string(),
+				                             Store_hash::HASH_PREFIX_LEN);
+				if (c == 0 && valid) return this;
+
+				/* entries of the same hash part may be on either side */
+				if (c == 0) {
+					for (unsigned side = 0; side < 2; ++side)
+						if (Entry *e = Avl_node<Entry>::child(side))
+							if (Entry *found = e->find_hash_part(part))
+								return found;
+					return nullptr;
+				}
+
+				Entry *e = Avl_node<Entry>::child(c > 0);
+				return e ? e->find_hash_part(part) : nullptr;
+			}
+		};
+
+		Genode::Allocator    &_alloc;
+		File_system::Session &_fs;
+		Ingest_registry      &_registry;
+
+		Genode::Lock _lock;
+
+		Genode::Avl_tree<Entry> _entries;
+
+		enum { BATCH = 16 };
+
+		File_system::seek_off_t  _end = 0; /* end of the log */
+		File_system::File_handle _file;
+		bool                     _file_open = false;
+
+		static char const *_strip(char const *name)
+		{
+			while (*name == '/') ++name;
+			return name;
+		}
+
+		Entry *_lookup(char const *name)
+		{
+			Entry *e = _entries.first();
+			return e ? e->find(_strip(name)) : nullptr;
+		}
+
+		template <typename FUNC>
+		static void _for_each(Entry *e, FUNC const &fn)
+		{
+			if (!e) return;
+			_for_each(e->child(Entry::LEFT),  fn);
+			_for_each(e->child(Entry::RIGHT), fn);
+			fn(*e);
+		}
+
+		Entry &_entry(char const *name)
+		{
+			name = _strip(name);
+			if (Entry *e = _lookup(name))
+				return *e;
+
+			Entry *e = new (_alloc) Entry(name);
+			_entries.insert(e);
+			return *e;
+		}
+
+		/**
+		 * Apply a record to the indexes
+		 *
+		 * \return false if the record changes nothing
+		 */
+		bool _apply(Db_record const &r)
+		{
+			/* an unknown object is not made known by its removal */
+			if (r.kind == Db_record::INVALID && !_lookup(r.name))
+				return false;
+
+			Entry &entry = _entry(r.name);
+
+			switch (r.kind) {
+			case Db_record::VALID:
+				if (entry.valid) return false;
+				entry.valid = true;
+				return true;
+
+			case Db_record::INVALID:
+				if (!entry.valid) return false;
+				entry.valid = false;
+				for (unsigned i = 0; i < entry.references.count; ++i)
+					entry.references.array[i]->referrers.remove(&entry);
+				entry.references.free(_alloc);
+				return true;
+
+			case Db_record::DERIVER: {
+				Entry &deriver = _entry(r.other);
+				if (entry.deriver == &deriver) return false;
+				if (entry.deriver)
+					entry.deriver->outputs.remove(&entry);
+				entry.deriver = &deriver;
+				deriver.outputs.add(_alloc, &entry);
+				return true; }
+
+			case Db_record::REFERENCE: {
+				Entry &to = _entry(r.other);
+				if (entry.references.contains(&to)) return false;
+				entry.references.add(_alloc, &to);
+				to.referrers.add(_alloc, &entry);
+				return true; }
+			}
+			return false;
+		}
+
+		/**
+		 * Open the log for appending, the handle is kept open
+		 */
+		void _open()
+		{
+			using namespace File_system;
+
+			if (_file_open) return;
+
+			Dir_handle root = _fs.dir("/", false);
+			Handle_guard root_guard(_fs, root);
+
+			try { _file = _fs.file(root, _strip(path()), READ_WRITE, false); }
+			catch (Lookup_failed) {
+				_file = _fs.file(root, _strip(path()), READ_WRITE, true); }
+			_file_open = true;
+		}
+
+		void _append(Db_record const *r, unsigned count)
+		{
+			using namespace File_system;
+
+			size_t const len = count*sizeof(Db_record);
+			try {
+				_open();
+				if (write(_fs, _file, r, len, _end) == len)
+					_end += len;
+				else
+					Genode::error("short write to ", path());
+			} catch (...) {
+				Genode::error("failed to append to ", path());
+			}
+		}
+
+		static bool _init(Db_record &r, Db_record::Kind kind,
+		                  char const *name, char const *other)
+		{
+			name  = _strip(name);
+			other = _strip(other);
+			if (!*name || (kind >= Db_record::DERIVER && !*other))
+				return false;
+
+			Genode::memset(&r, 0, sizeof(r));
+			r.magic = Db_record::MAGIC;
+			r.kind  = kind;
+			Genode::strncpy(r.name,  name,  sizeof(r.name));
+			Genode::strncpy(r.other, other, sizeof(r.other));
+			return true;
+		}
+
+		/**
+		 * Record a change unless it is already known
+		 */
+		void _record(Db_record::Kind kind, char const *name,
+		             char const *other = "")
+		{
+			Db_record r;
+			if (!_init(r, kind, name, other))
+				return;
+
+			try {
+				if (_apply(r))
+					_append(&r, 1);
+			} catch (Genode::Allocator::Out_of_memory) {
+				Genode::error("out of memory recording ", name);
+			}
+		}
+
+		Db_record *_alloc_batch() {
+			return (Db_record *)_alloc.alloc(BATCH*sizeof(Db_record)); }
+
+		void _free_batch(Db_record *batch) {
+			_alloc.free(batch, BATCH*sizeof(Db_record)); }
+
+		/**
+		 * Record the objects present at the backend
+		 */
+		void _import()
+		{
+			using namespace File_system;
+
+			unsigned objects = 0;
+			unsigned count   = 0;
+			Db_record *batch = nullptr;
+
+			try {
+				batch = _alloc_batch();
+
+				/* create the log first, so the directory does not change */
+				_open();
+
+				Dir_handle root = _fs.dir("/", false);
+				Handle_guard root_guard(_fs, root);
+
+				Directory_entry dirent;
+				for (unsigned i = 0;
+				     read(_fs, root, &dirent, sizeof(dirent), i*sizeof(dirent))
+				     == sizeof(dirent); ++i)
+				{
+					/* hidden files and ingest roots are not objects */
+					if (dirent.name[0] == '.'
+					 || !Genode::strcmp(dirent.name, "ingest-", 7))
+						continue;
+
+					if (!_init(batch[count], Db_record::VALID, dirent.name, "")
+					 || !_apply(batch[count]))
+						continue;
+
+					++objects;
+					if (++count == BATCH) {
+						_append(batch, count);
+						count = 0;
+					}
+				}
+			}
+			catch (Genode::Allocator::Out_of_memory) {
+				Genode::error("out of memory recording present objects"); }
+			catch (...) {
+				Genode::error("failed to read the objects of the store"); }
+
+			if (count)
+				_append(batch, count);
+			if (batch)
+				_free_batch(batch);
+
+			if (objects)
+				Genode::log("recorded ", objects, " present objects in ", path());
+		}
+
+		void _load()
+		{
+			using namespace File_system;
+
+			unsigned records = 0;
+			Db_record *batch = nullptr;
+
+			try {
+				batch = _alloc_batch();
+				size_t const batch_size = BATCH*sizeof(Db_record);
+
+				Dir_handle root = _fs.dir("/", false);
+				Handle_guard root_guard(_fs, root);
+				File_handle file = _fs.file(root, _strip(path()), READ_ONLY, false);
+				Handle_guard file_guard(_fs, file);
+
+				for (bool more = true; more; ) {
+					size_t const n = read(_fs, file, batch, batch_size, _end);
+					size_t const count = n / sizeof(Db_record);
+
+					/* a torn record at the end is overwritten */
+					more = n == batch_size;
+
+					for (size_t i = 0; i < count; ++i) {
+						if (!batch[i].valid()) {
+							Genode::error("invalid record in ", path(),
+							              " at ", _end);
+							more = false;
+							break;
+						}
+						_apply(batch[i]);
+						_end += sizeof(Db_record);
+						++records;
+					}
+				}
+			}
+			catch (Lookup_failed) { }
+			catch (Genode::Allocator::Out_of_memory) {
+				Genode::error("out of memory loading ", path()); }
+
+			if (batch)
+				_free_batch(batch);
+
+			if (records)
+				Genode::log("loaded ", records, " records from ", path());
+		}
+
+
+		/*****************************************
+		 ** Ingest_registry::Observer interface **
+		 *****************************************/
+
+		void created(char const *name) override
+		{
+			Genode::Lock::Guard guard(_lock);
+			_record(Db_record::VALID, name);
+		}
+
+		void referenced(char const *from, char const *to) override
+		{
+			/* a reference to itself does not keep an object */
+			if (!Genode::strcmp(_strip(from), _strip(to)))
+				return;
+
+			Genode::Lock::Guard guard(_lock);
+			_record(Db_record::REFERENCE, from, to);
+		}
+
+		void derived(char const *output, char const *deriver) override
+		{
+			Genode::Lock::Guard guard(_lock);
+			_record(Db_record::DERIVER, output, deriver);
+		}
+
+	public:
+
+		static char const *path() { return "/.nix_store.db"; }
+
+		Path_info_db(Genode::Allocator &alloc, File_system::Session &fs,
+		             Ingest_registry &registry)
+		:
+			_alloc(alloc), _fs(fs), _registry(registry)
+		{
+			_load();
+
+			/* objects from before the log are recorded once */
+			if (!_end)
+				_import();
+
+			_registry.add_observer(*this);
+		}
+
+		~Path_info_db()
+		{
+			_registry.remove_observer(*this);
+
+			if (_file_open)
+				_fs.close(_file);
+
+			while (Entry *e = _entries.first()) {
+				_entries.remove(e);
+				e->references.free(_alloc);
+				e->referrers.free(_alloc);
+				e->outputs.free(_alloc);
+				destroy(_alloc, e);
+			}
+		}
+
+		/**
+		 * Record that an object was removed
+		 */
+		void invalidate(char const *name)
+		{
+			Genode::Lock::Guard guard(_lock);
+			_record(Db_record::INVALID, name);
+		}
+
+		/**
+		 * Free the entries of removed objects that nothing refers to
+		 *
+		 * Freeing an output may leave its derivation without
+		 * referrers, so the entries are walked until none is freed.
+		 */
+		void prune()
+		{
+			Genode::Lock::Guard guard(_lock);
+
+			for (;;) {
+				Entry *stale = nullptr;
+				_for_each(_entries.first(), [&] (Entry &e) {
+					if (e.valid || e.referrers.count || e.outputs.count)
+						return;
+					e.stale = stale;
+					stale   = &e;
+				});
+
+				if (!stale)
+					return;
+
+				while (stale) {
+					Entry *next = stale->stale;
+					for (unsigned i = 0; i < stale->references.count; ++i)
+						stale->references.array[i]->referrers.remove(stale);
+					if (stale->deriver)
+						stale->deriver->outputs.remove(stale);
+					_entries.remove(stale);
+					stale->references.free(_alloc);
+					stale->referrers.free(_alloc);
+					stale->outputs.free(_alloc);
+					destroy(_alloc, stale);
+					stale = next;
+				}
+			}
+		}
+
+		bool valid(char const *name)
+		{
+			Genode::Lock::Guard guard(_lock);
+			Entry *e = _lookup(name);
+			return e && e->valid;
+		}
+
+		/**
+		 * Call 'fn' with each name that object 'from' refers to
+		 */
+		template <typename FUNC>
+		void for_each_reference(char const *from, FUNC const &fn)
+		{
+			Genode::Lock::Guard guard(_lock);
+			Entry *e = _lookup(from);
+			if (!e) return;
+			for (unsigned i = 0; i < e->references.count; ++i)
+				fn(e->references.array[i]->name.string());
+		}
+
+		bool reference(char const *from, unsigned index, Name &to)
+		{
+			Genode::Lock::Guard guard(_lock);
+			Entry *e = _lookup(from);
+			if (!e || index >= e->references.count)
+				return false;
+			to = e->references.array[index]->name;
+			return true;
+		}
+
+		/**
+		 * Return the valid object at 'index' that refers to 'to'
+		 */
+		bool referrer(char const *to, unsigned index, Name &from)
+		{
+			Genode::Lock::Guard guard(_lock);
+			Entry *e = _lookup(to);
+			if (!e || index >= e->referrers.count)
+				return false;
+			from = e->referrers.array[index]->name;
+			return true;
+		}
+
+		bool deriver(char const *output, Name &deriver)
+		{
+			Genode::Lock::Guard guard(_lock);
+			Entry *e = _lookup(output);
+			if (!e || !e->deriver)
+				return false;
+			deriver = e->deriver->name;
+			return true;
+		}
+
+		/**
+		 * Return the output at 'index' of a derivation
+		 */
+		bool output(char const *drv, unsigned index, Name &output)
+		{
+			Genode::Lock::Guard guard(_lock);
+			Entry *e = _lookup(drv);
+			if (!e || index >= e->outputs.count)
+				return false;
+			output = e->outputs.array[index]->name;
+			return true;
+		}
+
+		/**
+		 * Find a valid object by the hash part of its name
+		 */
+		bool from_hash_part(char const *part, Name &name)
+		{
+			part = _strip(part);
+			if (Genode::strlen(part) < Store_hash::HASH_PREFIX_LEN)
+				return false;
+
+			Genode::Lock::Guard guard(_lock);
+			Entry *first = _entries.first();
+			Entry *e = first ? first->find_hash_part(part) : nullptr;
+			if (!e) return false;
+			name = e->name;
+			return true;
+		}
+};
+
+#endif /* _NIX_STORE__PATH_INFO_DB_H_ */
@@ -0,0 +1,285 @@
+/*
+ * \brief  Scanning of ingested content for store references
+ * \author Emery Hemingway
+ * \date   2017-02-19
+ *
+ * An object refers to another object if the hash part of the other
+ * name appears in its content. The names that an ingest may refer
+ * to are known beforehand, so content is scanned for those hash
+ * parts as it is hashed, rather than being read again later.
+ *
+ * The scanner looks at each window of hash-part length and checks
+ * its characters from the end, a character outside of the base32
+ * alphabet moves the window past that character. Most content is
+ * not base32, so most windows are dismissed after one character.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _NIX_STORE__REFERENCE_SCANNER_H_
+#define _NIX_STORE__REFERENCE_SCANNER_H_
+
+/* Genode includes */
+#include <store_hash/encode.h>
+#include <base/allocator.h>
+#include <util/string.h>
+
+namespace Nix_store {
+
+	class Reference_set;
+	class Reference_scanner;
+}
+
+
+/**
+ * Names that an ingest may refer to, sorted by hash part
+ */
+class Nix_store::Reference_set
+{
+	public:
+
+		enum { HASH_LEN = Store_hash::HASH_PREFIX_LEN };
+
+		static bool is_base32(char c)
+		{
+			if (c >= '0' && c <= '9') return true;
+			if (c <  'a' || c >  'z') return false;
+			return c != 'e' && c != 'o' && c != 't' && c != 'u';
+		}
+
+	private:
+
+		struct Candidate
+		{
+			char           *name;
+			char const     *alias; /* name the candidate is also known by */
+			Genode::size_t  size;
+			bool            found;
+		};
+
+		Genode::Allocator &_alloc;
+
+		Candidate *_candidates = nullptr;
+		unsigned   _count      = 0;
+		unsigned   _capacity   = 0;
+
+		/**
+		 * Binary search for a hash part
+		 *
+		 * \return true if found, 'pos' is set to the position
+		 *         of the candidate or where it would be inserted
+		 */
+		bool _find(char const *part, unsigned &pos) const
+		{
+			unsigned lo = 0, hi = _count;
+			while (lo < hi) {
+				unsigned const mid = lo + (hi - lo) / 2;
+				int const n = Genode::memcmp(part, _candidates[mid].name, HASH_LEN);
+				if (n == 0) {
+					pos = mid;
+					return true;
+				}
+				if (n < 0) hi = mid; else lo = mid + 1;
+			}
+			pos = lo;
+			return false;
+		}
+
+		void _reserve()
+		{
+			if (_count < _capacity)
+				return;
+
+			unsigned const capacity = _capacity ? _capacity*2 : 8;
+			Candidate *candidates = (Candidate *)
+				_alloc.alloc(capacity*sizeof(Candidate));
+
+			Genode::memcpy(candidates, _candidates, _count*sizeof(Candidate));
+			if (_candidates)
+				_alloc.free(_candidates, _capacity*sizeof(Candidate));
+			_candidates = candidates;
+			_capacity   = capacity;
+		}
+
+	public:
+
+		Reference_set(Genode::Allocator &alloc) : _alloc(alloc) { }
+
+		~Reference_set()
+		{
+			for (unsigned i = 0; i < _count; ++i)
+				_alloc.free(_candidates[i].name, _candidates[i].size);
+			if (_candidates)
+				_alloc.free(_candidates, _capacity*sizeof(Candidate));
+		}
+
+		bool empty() const { return !_count; }
+
+		/**
+		 * Add a name that may be referred to
+		 *
+		 * \param alias  name under which a reference to 'name' is
+		 *               reported as well, such as the input-addressed
+		 *               path of a content-addressed object
+		 *
+		 * Names without a hash part are ignored.
+		 */
+		void add(char const *name, char const *alias = nullptr)
+		{
+			while (*name == '/') ++name;
+			if (alias) {
+				while (*alias == '/') ++alias;
+				if (!*alias || !Genode::strcmp(alias, name)) alias = nullptr;
+			}
+
+			for (unsigned i = 0; i < HASH_LEN; ++i)
+				if (!is_base32(name[i])) return;
+			if (name[HASH_LEN] != '-')
+				return;
+
+			unsigned pos;
+			bool const known = _find(name, pos);
+			if (known && (!alias || _candidates[pos].alias))
+				return;
+
+			/* the name and its alias share one allocation */
+			Genode::size_t const name_size  = Genode::strlen(name)+1;
+			Genode::size_t const alias_size = alias ? Genode::strlen(alias)+1 : 0;
+			Genode::size_t const size       = name_size + alias_size;
+
+			char *copy = (char *)_alloc.alloc(size);
+			Genode::strncpy(copy, name, name_size);
+			if (alias)
+				Genode::strncpy(copy+name_size, alias, alias_size);
+			char const *copy_alias = alias ? copy+name_size : nullptr;
+
+			if (known) {
+				Candidate &c = _candidates[pos];
+				_alloc.free(c.name, c.size);
+				c = Candidate { copy, copy_alias, size, c.found };
+				return;
+			}
+
+			_reserve();
+
+			Genode::memmove(&_candidates[pos+1], &_candidates[pos],
+			                (_count - pos)*sizeof(Candidate));
+			_candidates[pos] = Candidate { copy, copy_alias, size, false };
+			++_count;
+		}
+
+		/**
+		 * Note a hash part found in content
+		 */
+		void match(char const *part)
+		{
+			unsigned pos;
+			if (_find(part, pos))
+				_candidates[pos].found = true;
+		}
+
+		/**
+		 * Assume that every candidate is referred to
+		 *
+		 * Used when content was written without being scanned.
+		 */
+		void match_all()
+		{
+			for (unsigned i = 0; i < _count; ++i)
+				_candidates[i].found = true;
+		}
+
+		/**
+		 * Call 'fn' with the name and the alias of each candidate found
+		 */
+		template <typename FUNC>
+		void for_each_found(FUNC const &fn) const
+		{
+			for (unsigned i = 0; i < _count; ++i) {
+				Candidate const &c = _candidates[i];
+				if (!c.found) continue;
+				fn((char const *)c.name);
+				if (c.alias)
+					fn(c.alias);
+			}
+		}
+};
+
+
+/**
+ * Scanner of a single stream of content
+ *
+ * The tail of the content is carried over so that hash
+ * parts split between writes are found.
+ */
+class Nix_store::Reference_scanner
+{
+	private:
+
+		enum { HASH_LEN = Reference_set::HASH_LEN, CARRY_LEN = HASH_LEN-1 };
+
+		Reference_set  *_set = nullptr;
+		char            _carry[CARRY_LEN];
+		Genode::size_t  _carry_len = 0;
+
+		void _scan(char const *p, Genode::size_t n)
+		{
+			Genode::size_t i = 0;
+			while (i + HASH_LEN <= n) {
+				Genode::size_t j = HASH_LEN;
+				while (j && Reference_set::is_base32(p[i+j-1])) --j;
+				if (j) {
+					/* no window containing 'p[i+j-1]' can match */
+					i += j;
+					continue;
+				}
+				_set->match(p+i);
+				++i;
+			}
+		}
+
+	public:
+
+		void set(Reference_set *set) { _set = set; }
+
+		bool active() const { return _set && !_set->empty(); }
+
+		void reset() { _carry_len = 0; }
+
+		void update(Genode::uint8_t const *buf, Genode::size_t len)
+		{
+			if (!active() || !len)
+				return;
+
+			char const *p = (char const *)buf;
+
+			/* windows that start in the carry end in the first bytes */
+			if (_carry_len) {
+				char seam[CARRY_LEN*2];
+				Genode::size_t const head = Genode::min(len, (Genode::size_t)CARRY_LEN);
+				Genode::memcpy(seam, _carry, _carry_len);
+				Genode::memcpy(seam+_carry_len, p, head);
+				_scan(seam, _carry_len+head);
+			}
+
+			_scan(p, len);
+
+			/* keep the tail for the next write */
+			if (len >= CARRY_LEN) {
+				Genode::memcpy(_carry, p+len-CARRY_LEN, CARRY_LEN);
+				_carry_len = CARRY_LEN;
+			} else {
+				Genode::size_t const keep = Genode::min(_carry_len, CARRY_LEN-len);
+				Genode::memmove(_carry, _carry+_carry_len-keep, keep);
+				Genode::memcpy(_carry+keep, p, len);
+				_carry_len = keep+len;
+			}
+		}
+};
+
+#endif /* _NIX_STORE__REFERENCE_SCANNER_H_ */
@@ -0,0 +1,267 @@
+/*
+ * \brief  Incremental parser of bulk ingest streams
+ * \author Emery Hemingway
+ * \date   2017-02-14
+ *
+ * Records may be split across packets at any byte, so the
+ * parser keeps its position within a record between calls.
+ * Headers and paths are copied out of the packet before they
+ * are checked, the client may change its buffer at any time.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _NIX_STORE__STREAM_PARSER_H_
+#define _NIX_STORE__STREAM_PARSER_H_
+
+/* Genode includes */
+#include <file_system_session/file_system_session.h>
+#include <util/string.h>
+
+/* Nix includes */
+#include <nix_store/ingest_stream.h>
+
+namespace Nix_store { class Stream_parser; }
+
+
+class Nix_store::Stream_parser
+{
+	public:
+
+		typedef File_system::file_size_t file_size_t;
+		typedef File_system::seek_off_t  seek_off_t;
+
+		struct Malformed { };
+
+		/**
+		 * Receiver of the nodes of a stream, paths are relative to
+		 * the root and the root itself has an empty path
+		 */
+		struct Handler
+		{
+			virtual void directory(char const *path) = 0;
+			virtual void file(char const *path) = 0;
+			virtual void file_content(Genode::uint8_t const *buf, Genode::size_t len) = 0;
+			virtual void file_end() = 0;
+			virtual void symlink(char const *path, char const *target,
+			                     Genode::size_t len) = 0;
+
+			/**
+			 * End of the stream
+			 *
+			 * \param name  name of the object if the stream renames it,
+			 *              otherwise empty
+			 */
+			virtual void end(char const *name) = 0;
+		};
+
+	private:
+
+		enum State { HEADER, PATH, CONTENT, DONE };
+
+		Handler &_handler;
+
+		State                 _state = HEADER;
+		Ingest_stream::Record _record;
+		Genode::size_t        _have = 0; /* bytes of the current field */
+		file_size_t           _remaining = 0;
+		seek_off_t            _offset = 0;
+		bool                  _first = true;
+
+		char _path  [File_system::MAX_PATH_LEN];
+		char _target[File_system::MAX_PATH_LEN];
+
+		/**
+		 * Copy into a field until it is complete
+		 */
+		Genode::size_t _fill(void *field, Genode::size_t field_len,
+		                     Genode::uint8_t const *buf, Genode::size_t len)
+		{
+			Genode::size_t const n = Genode::min(len, field_len - _have);
+			Genode::memcpy((char *)field + _have, buf, n);
+			_have += n;
+			return n;
+		}
+
+		/**
+		 * Reject absolute paths and empty, '.', and '..' elements
+		 */
+		static bool _valid_path(char const *path)
+		{
+			char const *element = path;
+			for (char const *p = path;; ++p) {
+				if (*p != '/' && *p != '\0')
+					continue;
+
+				Genode::size_t const len = p - element;
+				if (len == 0
+				 || (len == 1 && element[0] == '.')
+				 || (len == 2 && element[0] == '.' && element[1] == '.'))
+					return false;
+
+				if (*p == '\0')
+					return true;
+				element = p+1;
+			}
+		}
+
+		void _header_complete()
+		{
+			using namespace Ingest_stream;
+
+			_have = 0;
+			_remaining = _record.size;
+
+			if (_record.path_len >= sizeof(_path))
+				throw Malformed();
+
+			if (_record.type == TYPE_END) {
+				if (_first || _record.size)
+					throw Malformed();
+				_state = PATH;
+				if (!_record.path_len)
+					_path_complete();
+				return;
+			}
+
+			/* the root must come first and only once */
+			if (_first != (_record.path_len == 0))
+				throw Malformed();
+
+			switch (_record.type) {
+			case TYPE_DIRECTORY:
+				if (_record.size) throw Malformed();
+				break;
+			case TYPE_FILE:
+				break;
+			case TYPE_SYMLINK:
+				if (_first || _record.size >= sizeof(_target))
+					throw Malformed();
+				break;
+			default:
+				throw Malformed();
+			}
+
+			_state = PATH;
+			if (!_record.path_len)
+				_path_complete();
+		}
+
+		void _path_complete()
+		{
+			using namespace Ingest_stream;
+
+			_path[_record.path_len] = '\0';
+			_have = 0;
+
+			/* the path of the end record is a single name */
+			if (_record.type == TYPE_END) {
+				for (char const *p = _path; *p; ++p)
+					if (*p == '/') throw Malformed();
+				if (*_path && !_valid_path(_path))
+					throw Malformed();
+				_handler.end(_path);
+				_state = DONE;
+				return;
+			}
+
+			if (!_first && !_valid_path(_path))
+				throw Malformed();
+			_first = false;
+
+			_state = CONTENT;
+			switch (_record.type) {
+			case TYPE_DIRECTORY:
+				_handler.directory(_path);
+				_state = HEADER;
+				break;
+			case TYPE_FILE:
+				_handler.file(_path);
+				if (!_remaining) {
+					_handler.file_end();
+					_state = HEADER;
+				}
+				break;
+			case TYPE_SYMLINK:
+				/* a link may have an empty target */
+				if (!_remaining) {
+					_handler.symlink(_path, _target, 0);
+					_state = HEADER;
+				}
+				break;
+			}
+		}
+
+	public:
+
+		Stream_parser(Handler &handler) : _handler(handler) { }
+
+		bool done() const { return _state == DONE; }
+
+		/**
+		 * Consume the next portion of the stream
+		 *
+		 * \throw Malformed
+		 */
+		void feed(Genode::uint8_t const *buf, Genode::size_t len, seek_off_t offset)
+		{
+			using namespace Ingest_stream;
+
+			/* the stream must be written in order */
+			if (offset != _offset)
+				throw Malformed();
+			_offset += len;
+
+			while (len) {
+				Genode::size_t n = 0;
+
+				switch (_state) {
+				case HEADER:
+					n = _fill(&_record, sizeof(_record), buf, len);
+					if (_have == sizeof(_record))
+						_header_complete();
+					break;
+
+				case PATH:
+					n = _fill(_path, _record.path_len, buf, len);
+					if (_have == _record.path_len)
+						_path_complete();
+					break;
+
+				case CONTENT:
+					if (_record.type == TYPE_SYMLINK) {
+						n = _fill(_target, _record.size, buf, len);
+						_remaining -= n;
+						if (!_remaining) {
+							_handler.symlink(_path, _target, _have);
+							_have = 0;
+							_state = HEADER;
+						}
+						break;
+					}
+
+					n = Genode::min((file_size_t)len, _remaining);
+					_handler.file_content(buf, n);
+					_remaining -= n;
+					if (!_remaining) {
+						_handler.file_end();
+						_state = HEADER;
+					}
+					break;
+
+				case DONE:
+					throw Malformed();
+				}
+
+				buf += n;
+				len -= n;
+			}
+		}
+};
+
+#endif /* _NIX_STORE__STREAM_PARSER_H_ */
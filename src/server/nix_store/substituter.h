@@ -0,0 +1,444 @@
+/*
+ * \brief  Substitution of derivation outputs from a binary cache
+ * \author Emery Hemingway
+ * \date   2017-02-21
+ *
+ * A binary cache is a File_system session labeled "cache" with the
+ * layout of a store, the outputs of a derivation are symlinks to the
+ * objects that hold their content, so a store may be served as the
+ * cache of another. Before a job is built its outputs are looked up
+ * at the cache, and if all are present they are copied into an
+ * ingest session and finalised as if the job had been built.
+ *
+ * Objects are hashed as they are copied, an object that does not
+ * hash to its name at the cache is rejected and the job is built.
+ * Copying is done in bounded steps, each step is a signal to the
+ * entrypoint so that sessions and the queueing of further jobs are
+ * not stalled by a large closure.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _NIX_STORE__SUBSTITUTER_H_
+#define _NIX_STORE__SUBSTITUTER_H_
+
+/* Genode includes */
+#include <file_system_session/connection.h>
+#include <file_system/util.h>
+#include <base/allocator_avl.h>
+#include <base/signal.h>
+#include <base/log.h>
+
+/* Nix includes */
+#include <nix_store/derivation.h>
+
+/* Local includes */
+#include "ingest_fs_service.h"
+#include "tree_walker.h"
+#include "util.h"
+
+namespace Nix_store {
+
+	class Substituter;
+	class Substitution;
+}
+
+
+/**
+ * Lookup of objects at the binary cache
+ */
+class Nix_store::Substituter
+{
+	private:
+
+		enum { TX_BUF_SIZE = 128*1024 };
+
+		Genode::Env          &_env;
+		Genode::Allocator_avl _tx_alloc;
+
+		Genode::Constructible<File_system::Connection> _cache;
+
+	public:
+
+		Substituter(Genode::Env &env, Genode::Allocator &alloc)
+		: _env(env), _tx_alloc(&alloc)
+		{
+			/* the cache is optional */
+			try { _cache.construct(env, _tx_alloc, "cache", "/", false, TX_BUF_SIZE); }
+			catch (...) { return; }
+			Genode::log("substituting from binary cache");
+		}
+
+		File_system::Session &cache() { return *_cache; }
+
+		/**
+		 * Return the object holding the content of a path at the cache
+		 *
+		 * \return empty path if the cache does not hold the path
+		 */
+		Object_path lookup(char const *path)
+		{
+			if (!_cache.constructed())
+				return Object_path();
+
+			while (*path == '/') ++path;
+			if (!*path || File_system::string_contains(path, '/'))
+				return Object_path();
+
+			try { return dereference(*_cache, path); }
+			catch (...) { }
+			return Object_path();
+		}
+
+		/**
+		 * Return true if every output of a derivation is at the cache
+		 */
+		bool substitutable(char const *drv_name)
+		{
+			if (!_cache.constructed())
+				return false;
+
+			bool result = true;
+			try {
+				Derivation drv(_env, drv_name);
+
+				/* the derivation may ask to always be built */
+				drv.environment([&] (Aterm::Parser &parser) {
+					Name              key;
+					Genode::String<4> value;
+					parser.string(&key);
+					parser.string(&value);
+					if (key == "allowSubstitutes" && value != "1")
+						result = false;
+				});
+
+				drv.outputs([&] (Aterm::Parser &parser) {
+					Name path;
+					parser.string(); /* Id */
+					parser.string(&path);
+					parser.string(); /* Algo */
+					parser.string(); /* Hash */
+					if (result && lookup(path.string()) == "")
+						result = false;
+				});
+			} catch (...) { return false; }
+
+			return result;
+		}
+};
+
+
+/**
+ * Copy of the outputs of a derivation from the cache
+ */
+class Nix_store::Substitution
+{
+	private:
+
+		enum { STEP_BUDGET = 64, READ_SIZE = 16*1024 };
+
+		enum State { OUTPUT, WALK, FILE, END_OUTPUT, FINALIZE, DONE };
+
+		struct Failed { };
+
+		Genode::Env          &_env;
+		File_system::Session &_fs;
+		Substituter          &_substituter;
+		File_system::Session &_cache = _substituter.cache();
+		Name const            _name;
+		Derivation            _drv { _env, _name.string() };
+		Ingest_service        _ingest;
+
+		Genode::Signal_context_capability _done_sigh;
+
+		State    _state   = OUTPUT;
+		bool     _walking = false;
+		bool     _success = false;
+		unsigned _output  = 0; /* index of the output being copied */
+
+		Name        _id;     /* id of the output being copied */
+		Object_path _object; /* object of the output at the cache */
+
+		Stream_parser::Handler *_handler = nullptr;
+		Tree_walker             _walker { _cache };
+
+		File_system::File_handle _file;
+		File_system::file_size_t _size   = 0;
+		File_system::seek_off_t  _offset = 0;
+		bool                     _file_open = false;
+
+		char _buf[READ_SIZE];
+
+		/**
+		 * Write the path of an entry relative to the object
+		 */
+		void _relative(char *dst, size_t len, char const *dir, char const *name)
+		{
+			char const *sub = dir + Genode::strlen(_object.string());
+			while (*sub == '/') ++sub;
+
+			if (*sub)
+				Genode::snprintf(dst, len, "%s/%s", sub, name);
+			else
+				Genode::snprintf(dst, len, "%s", name);
+		}
+
+		void _open_file(File_system::Dir_handle dir, char const *name)
+		{
+			using namespace File_system;
+
+			_file      = _cache.file(dir, name, READ_ONLY, false);
+			_file_open = true;
+			_size      = _cache.status(_file).size;
+			_offset    = 0;
+			_state     = FILE;
+		}
+
+		void _close_file()
+		{
+			if (_file_open)
+				_cache.close(_file);
+			_file_open = false;
+		}
+
+		void _copy_symlink(char const *dir, char const *name, char const *path)
+		{
+			using namespace File_system;
+
+			Dir_handle parent = _cache.dir(dir, false);
+			Handle_guard dir_guard(_cache, parent);
+
+			Symlink_handle link = _cache.symlink(parent, name, false);
+			Handle_guard link_guard(_cache, link);
+
+			size_t const n = read(_cache, link, _buf, sizeof(_buf));
+
+			/* links written by the store carry a terminating byte */
+			size_t len = 0;
+			while (len < n && _buf[len]) ++len;
+
+			_handler->symlink(path, _buf, len);
+		}
+
+		/**
+		 * Begin the copy of the output at '_output'
+		 *
+		 * \return false if there are no more outputs
+		 */
+		bool _next_output()
+		{
+			using namespace File_system;
+
+			Name     path;
+			bool     found = false;
+			unsigned i     = 0;
+
+			_drv.outputs([&] (Aterm::Parser &parser) {
+				Name id;
+				Name p;
+				parser.string(&id);
+				parser.string(&p);
+				parser.string(); /* Algo */
+				parser.string(); /* Hash */
+				if (i++ == _output) {
+					_id   = id;
+					path  = p;
+					found = true;
+				}
+			});
+			if (!found)
+				return false;
+
+			_object = _substituter.lookup(path.string());
+			if (_object == "") {
+				Genode::error(path, " is not at the cache");
+				throw Failed();
+			}
+
+			Status status;
+			{
+				Node_handle node = _cache.node(_object.string());
+				Handle_guard guard(_cache, node);
+				status = _cache.status(node);
+			}
+
+			_handler = &_ingest.stream(_id.string());
+
+			if (status.mode == Status::MODE_DIRECTORY) {
+				_handler->directory("");
+				_walker.restart(_object.string());
+				_walking = true;
+				_state   = WALK;
+
+			} else if (status.mode == Status::MODE_FILE) {
+				_handler->file("");
+				Dir_handle root = _cache.dir("/", false);
+				Handle_guard guard(_cache, root);
+				_open_file(root, _object.string()+1);
+				_walking = false;
+
+			} else {
+				Genode::error(_object, " at the cache is not a file or directory");
+				throw Failed();
+			}
+			return true;
+		}
+
+		void _visit(char const *dir, File_system::Directory_entry const &dirent,
+		            Tree_walker::Action &action)
+		{
+			using namespace File_system;
+
+			char path[MAX_PATH_LEN];
+			_relative(path, sizeof(path), dir, dirent.name);
+
+			switch (dirent.type) {
+			case Directory_entry::TYPE_DIRECTORY:
+				_handler->directory(path);
+				action = Tree_walker::DESCEND;
+				return;
+
+			case Directory_entry::TYPE_SYMLINK:
+				_copy_symlink(dir, dirent.name, path);
+				break;
+
+			case Directory_entry::TYPE_FILE: {
+				Dir_handle parent = _cache.dir(dir, false);
+				Handle_guard guard(_cache, parent);
+				_open_file(parent, dirent.name);
+				_handler->file(path);
+				break;
+			}}
+			action = Tree_walker::SKIP;
+		}
+
+		void _advance()
+		{
+			using namespace File_system;
+
+			switch (_state) {
+			case OUTPUT:
+				if (!_next_output())
+					_state = FINALIZE;
+				break;
+
+			case WALK: {
+				bool const more = _walker.step(1, [&] (char const *dir,
+				                                       Directory_entry const &dirent)
+				{
+					Tree_walker::Action action;
+					_visit(dir, dirent, action);
+					return action;
+				});
+
+				/* a file was opened by the visitor */
+				if (_state == WALK && !more)
+					_state = END_OUTPUT;
+				break;
+			}
+
+			case FILE: {
+				size_t const count =
+					Genode::min((file_size_t)sizeof(_buf), _size - _offset);
+				size_t const n = count
+					? read(_cache, _file, _buf, count, _offset) : 0;
+
+				if (count && !n) {
+					Genode::error("short read of ", _object, " at the cache");
+					throw Failed();
+				}
+
+				_handler->file_content((uint8_t const *)_buf, n);
+				_offset += n;
+
+				if (_offset >= _size) {
+					_close_file();
+					_handler->file_end();
+					_state = _walking ? WALK : END_OUTPUT;
+				}
+				break;
+			}
+
+			case END_OUTPUT: {
+				_handler->end("");
+
+				/* the object must hash to its name at the cache */
+				char const *final_name = _ingest.ingested(_id.string());
+				if (!final_name || Genode::strcmp(final_name, _object.string()+1)) {
+					Genode::error(_object, " at the cache does not match its content");
+					throw Failed();
+				}
+
+				++_output;
+				_state = OUTPUT;
+				break;
+			}
+
+			case FINALIZE:
+				_finish(_ingest.finalize(_fs, _drv, _name.string()));
+				break;
+
+			case DONE:
+				break;
+			}
+		}
+
+		void _finish(bool success)
+		{
+			_close_file();
+			_success = success;
+			_state   = DONE;
+
+			if (success)
+				Genode::log("\033[32m" "substituted: ", _name, "\033[0m");
+			else
+				Genode::log("\033[31m" "substitution failed: ", _name, "\033[0m");
+
+			Genode::Signal_transmitter(_done_sigh).submit();
+		}
+
+		void _step()
+		{
+			try {
+				for (unsigned budget = STEP_BUDGET; budget && _state != DONE; --budget)
+					_advance();
+			} catch (...) {
+				_finish(false);
+				return;
+			}
+
+			if (_state != DONE)
+				Genode::Signal_transmitter(_step_handler).submit();
+		}
+
+		Genode::Signal_handler<Substitution> _step_handler
+			{ _env.ep(), *this, &Substitution::_step };
+
+	public:
+
+		Substitution(char const                       *drv_name,
+		             Genode::Env                      &env,
+		             Genode::Allocator                &alloc,
+		             File_system::Session             &fs,
+		             Substituter                      &substituter,
+		             Ingest_registry                  &ingest_registry,
+		             Genode::Signal_context_capability done_sigh)
+		:
+			_env(env), _fs(fs), _substituter(substituter), _name(drv_name),
+			_ingest(_drv, fs, env, alloc, ingest_registry),
+			_done_sigh(done_sigh)
+		{
+			Genode::Signal_transmitter(_step_handler).submit();
+		}
+
+		~Substitution() { _close_file(); }
+
+		bool success() const { return _success; }
+};
+
+#endif /* _NIX_STORE__SUBSTITUTER_H_ */
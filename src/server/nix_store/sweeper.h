@@ -0,0 +1,323 @@
+/*
+ * \brief  Removal of stale ingest roots
+ * \author Emery Hemingway
+ * \date   2017-02-17
+ *
+ * Ingest roots left at the backend by a crashed store or by a
+ * finalisation that found its object already present are found
+ * by their 'ingest-' prefix and removed. Roots held by a session
+ * or referenced by the ingest journal are kept. A root of this
+ * instance is only removed once it is older than the previous
+ * pass, a session may be about to take it up. Finalisation moves
+ * its leftovers below the epoch of any generation, so they are
+ * removed by the next pass. The backend is
+ * scanned and trees are removed in bounded steps, each step is
+ * a signal to the entrypoint so that sessions are not stalled.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _NIX_STORE__SWEEPER_H_
+#define _NIX_STORE__SWEEPER_H_
+
+/* Genode includes */
+#include <file_system/util.h>
+#include <base/signal.h>
+#include <base/log.h>
+
+/* Local includes */
+#include "ingest_journal.h"
+#include "ingest_registry.h"
+#include "tree_remover.h"
+
+namespace Nix_store { class Sweeper; }
+
+
+class Nix_store::Sweeper
+{
+	private:
+
+		enum { STEP_BUDGET = 64 };
+
+		enum Phase { IDLE, JOURNAL, SCAN, REMOVE };
+
+		Genode::Allocator    &_alloc;
+		File_system::Session &_fs;
+		Ingest_registry      &_registry;
+
+		Phase    _phase = IDLE;
+		bool     _again = false; /* a sweep was requested during a pass */
+		unsigned _index = 0;     /* position in the directory being read */
+
+		/* nonces of the roots referenced by the journal */
+		Genode::uint64_t *_journaled          = nullptr;
+		unsigned          _journaled_count    = 0;
+		unsigned          _journaled_capacity = 0;
+
+		Tree_remover _remover { _fs };
+
+		unsigned _earlier = 0; /* roots from before this instance */
+		unsigned _orphans = 0; /* roots abandoned by this instance */
+
+		/* roots of this instance from before these nonces are old enough */
+		Genode::uint64_t _min_age_nonce = 0;
+		Genode::uint64_t _pass_nonce    = 0;
+
+		static bool _nonce(char const *name, Genode::uint64_t &nonce)
+		{
+			if (Genode::strcmp(name, "ingest-", 7))
+				return false;
+
+			char const *digits = name+7;
+			Genode::size_t const n = Genode::ascii_to_unsigned(digits, nonce, 10);
+			return n && digits[n] == '\0';
+		}
+
+		bool _is_journaled(Genode::uint64_t nonce) const
+		{
+			for (unsigned i = 0; i < _journaled_count; ++i)
+				if (_journaled[i] == nonce)
+					return true;
+			return false;
+		}
+
+		void _add_journaled(Genode::uint64_t nonce)
+		{
+			if (_journaled_count == _journaled_capacity) {
+				unsigned const capacity = _journaled_capacity
+					? _journaled_capacity*2 : 16;
+				Genode::uint64_t *journaled = (Genode::uint64_t *)
+					_alloc.alloc(capacity*sizeof(Genode::uint64_t));
+				for (unsigned i = 0; i < _journaled_count; ++i)
+					journaled[i] = _journaled[i];
+				_free_journaled();
+				_journaled          = journaled;
+				_journaled_capacity = capacity;
+			}
+			_journaled[_journaled_count++] = nonce;
+		}
+
+		void _free_journaled()
+		{
+			if (_journaled)
+				_alloc.free(_journaled, _journaled_capacity*sizeof(Genode::uint64_t));
+			_journaled = nullptr;
+			_journaled_capacity = 0;
+		}
+
+		bool _read_dirent(char const *path, File_system::Directory_entry &dirent)
+		{
+			using namespace File_system;
+
+			try {
+				Dir_handle dir = _fs.dir(path, false);
+				Handle_guard guard(_fs, dir);
+				return read(_fs, dir, &dirent, sizeof(dirent),
+				            _index*sizeof(dirent)) == sizeof(dirent);
+			} catch (...) { }
+			return false;
+		}
+
+		/**
+		 * Unlink a node, return false if it is a directory with content
+		 */
+		bool _unlink(char const *dir_path, char const *name)
+		{
+			using namespace File_system;
+
+			Dir_handle dir = _fs.dir(dir_path, false);
+			Handle_guard guard(_fs, dir);
+			try { _fs.unlink(dir, name); }
+			catch (Not_empty) { return false; }
+			return true;
+		}
+
+		/**
+		 * Collect the roots referenced by the journal,
+		 * entries without a root are removed
+		 */
+		void _step_journal(unsigned budget)
+		{
+			using namespace File_system;
+
+			char const *journal_path = Ingest_journal::directory();
+
+			while (budget--) {
+				Directory_entry dirent;
+				if (!_read_dirent(journal_path, dirent)) {
+					_phase = SCAN;
+					_index = 0;
+					return;
+				}
+
+				Journal_entry entry;
+				bool valid = false;
+				try {
+					Dir_handle dir = _fs.dir(journal_path, false);
+					Handle_guard dir_guard(_fs, dir);
+					File_handle file = _fs.file(dir, dirent.name, READ_ONLY, false);
+					Handle_guard file_guard(_fs, file);
+
+					valid = read(_fs, file, &entry, sizeof(entry)) == sizeof(entry)
+					     && entry.valid();
+				} catch (...) { }
+
+				Genode::uint64_t nonce = 0;
+				if (valid && _nonce(entry.filename, nonce)) try {
+					Genode::Path<File_system::MAX_NAME_LEN+1> root_path(entry.filename);
+					_fs.close(_fs.node(root_path.base()));
+					_add_journaled(nonce);
+					++_index;
+					continue;
+				} catch (Genode::Allocator::Out_of_memory) {
+					/* keep the entry, the pass cannot tell what is stale */
+					Genode::error("out of memory reading the ingest journal");
+					_free_journaled();
+					_phase = IDLE;
+					return;
+				} catch (...) { }
+
+				/* the entry is invalid or its root is gone */
+				try {
+					_unlink(journal_path, dirent.name);
+					continue;
+				} catch (...) { ++_index; }
+			}
+		}
+
+		void _step_scan(unsigned budget)
+		{
+			using namespace File_system;
+
+			while (budget--) {
+				Directory_entry dirent;
+				if (!_read_dirent("/", dirent)) {
+					_finish_pass();
+					return;
+				}
+
+				Genode::uint64_t nonce;
+				if (!_nonce(dirent.name, nonce)
+				 || _is_journaled(nonce)
+				 || _registry.live(dirent.name))
+				{
+					++_index;
+					continue;
+				}
+
+				if (!_registry.current(nonce))
+					++_earlier;
+				else if (nonce < _min_age_nonce)
+					++_orphans;
+				else {
+					++_index;
+					continue;
+				}
+
+				try {
+					if (_remover.remove(dirent))
+						continue;
+				} catch (...) {
+					Genode::error("failed to remove stale ingest ",
+					              (char const *)dirent.name);
+					++_index;
+					continue;
+				}
+
+				/* remove the content of the tree before the tree */
+				_phase = REMOVE;
+				return;
+			}
+		}
+
+		void _step_remove(unsigned budget)
+		{
+			if (_remover.step(budget))
+				return;
+
+			/* a tree that could not be removed is left in place */
+			if (_remover.failed())
+				++_index;
+			_phase = SCAN;
+		}
+
+		void _start_pass()
+		{
+			_again = false;
+			_journaled_count = 0;
+			_earlier = _orphans = 0;
+			_index = 0;
+			_phase = JOURNAL;
+
+			_min_age_nonce = _pass_nonce;
+			_pass_nonce    = _registry.last_nonce() + 1;
+			Genode::Signal_transmitter(_step_handler).submit();
+		}
+
+		void _finish_pass()
+		{
+			_phase = IDLE;
+			_free_journaled();
+			_journaled_count = 0;
+
+			if (_earlier || _orphans)
+				Genode::log("removed ", _earlier, " stale ingests from an earlier "
+				            "instance and ", _orphans, " from this instance");
+
+			if (_again)
+				_start_pass();
+		}
+
+		void _step()
+		{
+			switch (_phase) {
+			case JOURNAL: _step_journal(STEP_BUDGET); break;
+			case SCAN:    _step_scan(STEP_BUDGET);    break;
+			case REMOVE:  _step_remove(STEP_BUDGET);  break;
+			case IDLE:    return;
+			}
+
+			/* yield to other signals and RPCs before continuing */
+			if (_phase != IDLE)
+				Genode::Signal_transmitter(_step_handler).submit();
+		}
+
+		Genode::Signal_handler<Sweeper> _step_handler;
+		Genode::Signal_handler<Sweeper> _request_handler;
+
+	public:
+
+		Sweeper(Genode::Env &env, Genode::Allocator &alloc,
+		        File_system::Session &fs, Ingest_registry &registry)
+		:
+			_alloc(alloc), _fs(fs), _registry(registry),
+			_step_handler(env.ep(), *this, &Sweeper::_step),
+			_request_handler(env.ep(), *this, &Sweeper::start)
+		{
+			_registry.sweep_sigh(_request_handler);
+		}
+
+		~Sweeper()
+		{
+			_registry.sweep_sigh(Genode::Signal_context_capability());
+			_free_journaled();
+		}
+
+		/**
+		 * Start a pass, or another pass after the current one
+		 */
+		void start()
+		{
+			if (_phase == IDLE)
+				_start_pass();
+			else
+				_again = true;
+		}
+};
+
+#endif /* _NIX_STORE__SWEEPER_H_ */
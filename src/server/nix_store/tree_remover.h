@@ -0,0 +1,158 @@
+/*
+ * \brief  Incremental removal of backend trees
+ * \author Emery Hemingway
+ * \date   2017-02-18
+ *
+ * The File_system session only unlinks empty directories, so a
+ * tree is walked repeatedly, each walk removes the leaves and
+ * the directories emptied by the walk before it.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _NIX_STORE__TREE_REMOVER_H_
+#define _NIX_STORE__TREE_REMOVER_H_
+
+/* Genode includes */
+#include <file_system/util.h>
+#include <base/log.h>
+
+/* Local includes */
+#include "tree_walker.h"
+
+namespace Nix_store { class Tree_remover; }
+
+
+class Nix_store::Tree_remover
+{
+	private:
+
+		File_system::Session &_fs;
+
+		Tree_walker::Path _tree;
+		Tree_walker       _walker { _fs };
+		bool              _active   = false;
+		bool              _failed   = false;
+		unsigned          _unlinked = 0; /* nodes removed by the current walk */
+
+		File_system::file_size_t _freed = 0;
+
+		/**
+		 * Unlink a node, return false if it is a directory with content
+		 */
+		bool _unlink(char const *dir_path, File_system::Directory_entry const &dirent)
+		{
+			using namespace File_system;
+
+			Dir_handle dir = _fs.dir(dir_path, false);
+			Handle_guard guard(_fs, dir);
+
+			file_size_t size = 0;
+			if (dirent.type == Directory_entry::TYPE_FILE) try {
+				File_handle file = _fs.file(dir, dirent.name, READ_ONLY, false);
+				Handle_guard file_guard(_fs, file);
+				size = _fs.status(file).size;
+			} catch (...) { }
+
+			try { _fs.unlink(dir, dirent.name); }
+			catch (Not_empty) { return false; }
+
+			_freed += size;
+			return true;
+		}
+
+		Tree_walker::Action _visit(char const *dir_path,
+		                           File_system::Directory_entry const &dirent)
+		{
+			try {
+				if (_unlink(dir_path, dirent)) {
+					_walker.removed();
+					++_unlinked;
+					return Tree_walker::SKIP;
+				}
+				return Tree_walker::DESCEND;
+			} catch (...) { }
+			return Tree_walker::SKIP;
+		}
+
+	public:
+
+		Tree_remover(File_system::Session &fs) : _fs(fs) { }
+
+		bool active() const { return _active; }
+
+		/**
+		 * Return true if the last tree could not be removed
+		 */
+		bool failed() const { return _failed; }
+
+		/**
+		 * Bytes of file content removed since the last reset
+		 */
+		File_system::file_size_t freed() const { return _freed; }
+
+		void reset_freed() { _freed = 0; }
+
+		/**
+		 * Remove a node of the top-level directory
+		 *
+		 * \return true if the node was removed, false if the
+		 *         node is a tree that is removed by 'step'
+		 */
+		bool remove(File_system::Directory_entry const &dirent)
+		{
+			if (_unlink("/", dirent))
+				return true;
+
+			_tree.import(dirent.name, "/");
+			_walker.restart(_tree.base());
+			_unlinked = 0;
+			_active = true;
+			_failed = false;
+			return false;
+		}
+
+		/**
+		 * Visit at most 'budget' nodes of the tree
+		 *
+		 * \return true while the tree is not removed
+		 */
+		bool step(unsigned budget)
+		{
+			if (!_active)
+				return false;
+
+			if (_walker.step(budget, [&] (char const *dir_path,
+			                             File_system::Directory_entry const &dirent) {
+				return _visit(dir_path, dirent); }))
+				return true;
+
+			/* directories emptied by this walk are removed by the next */
+			bool removed = false;
+			try {
+				File_system::Directory_entry top;
+				Genode::strncpy(top.name, _tree.base()+1, sizeof(top.name));
+				top.type = File_system::Directory_entry::TYPE_DIRECTORY;
+				removed = _unlink("/", top);
+			} catch (...) { }
+
+			if (!removed && _unlinked) {
+				_walker.restart(_tree.base());
+				_unlinked = 0;
+				return true;
+			}
+
+			if (!removed)
+				Genode::error("failed to remove ", _tree.base());
+			_failed = !removed;
+			_active = false;
+			return false;
+		}
+};
+
+#endif /* _NIX_STORE__TREE_REMOVER_H_ */
@@ -0,0 +1,134 @@
+/*
+ * \brief  Incremental walk over a backend file system tree
+ * \author Emery Hemingway
+ * \date   2017-02-12
+ *
+ * Store maintenance must not stall the entrypoint, so
+ * the tree is walked in bounded steps. The position in
+ * the tree is kept as a stack of directory entry indices
+ * that survives between steps.
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#ifndef _NIX_STORE__TREE_WALKER_H_
+#define _NIX_STORE__TREE_WALKER_H_
+
+/* Genode includes */
+#include <file_system/util.h>
+#include <os/path.h>
+
+namespace Nix_store { class Tree_walker; }
+
+
+class Nix_store::Tree_walker
+{
+	public:
+
+		typedef Genode::Path<File_system::MAX_PATH_LEN> Path;
+
+		/**
+		 * Return value of the visitor
+		 */
+		enum Action { SKIP, DESCEND };
+
+	private:
+
+		enum { MAX_DEPTH = 32 };
+
+		File_system::Session &_fs;
+
+		Path     _path { "/" };
+		unsigned _index[MAX_DEPTH];
+		unsigned _depth = 0;
+		bool     _done  = false;
+
+		void _ascend()
+		{
+			if (_depth == 0) {
+				_done = true;
+				return;
+			}
+			_path.strip_last_element();
+			--_depth;
+		}
+
+	public:
+
+		Tree_walker(File_system::Session &fs) : _fs(fs) { _index[0] = 0; }
+
+		bool done() const { return _done; }
+
+		/**
+		 * Walk again from the top of the tree at 'path'
+		 */
+		void restart(char const *path = "/")
+		{
+			_path.import(path);
+			_depth = 0;
+			_index[0] = 0;
+			_done = false;
+		}
+
+		/**
+		 * Visit at most 'budget' directory entries
+		 *
+		 * The visitor is called with the directory path and the
+		 * entry, and returns 'DESCEND' to walk into a directory.
+		 * Entries removed by the visitor must be reported with
+		 * 'removed' so that the next entry is not skipped.
+		 *
+		 * \return true while the walk is not complete
+		 */
+		template <typename FUNC>
+		bool step(unsigned budget, FUNC const &func)
+		{
+			using namespace File_system;
+
+			while (budget-- && !_done) {
+				Directory_entry dirent;
+				size_t n = 0;
+
+				try {
+					Dir_handle dir = _fs.dir(_path.base(), false);
+					Handle_guard guard(_fs, dir);
+					n = read(_fs, dir, &dirent, sizeof(dirent),
+					         _index[_depth]*sizeof(dirent));
+				} catch (...) { n = 0; }
+
+				if (n != sizeof(dirent)) {
+					_ascend();
+					continue;
+				}
+
+				++_index[_depth];
+
+				bool const descend =
+					func(_path.base(), dirent) == DESCEND &&
+					dirent.type == Directory_entry::TYPE_DIRECTORY &&
+					_depth+1 < MAX_DEPTH;
+
+				if (descend) {
+					_path.append_element(dirent.name);
+					_index[++_depth] = 0;
+				}
+			}
+			return !_done;
+		}
+
+		/**
+		 * Account for an entry of the current directory removed by the visitor
+		 */
+		void removed()
+		{
+			if (_index[_depth])
+				--_index[_depth];
+		}
+};
+
+#endif /* _NIX_STORE__TREE_WALKER_H_ */
@@ -16,11 +16,15 @@
 
 /* Genode includes */
 #include <file_system_session/file_system_session.h>
+#include <file_system/util.h>
+#include <hash/hash.h>
 #include <os/path.h>
 
 
 namespace Nix_store {
 
+	using namespace File_system;
+
 	/* make this a path, not a string */
 	typedef Genode::String<Nix_store::MAX_PATH_LEN> Object_path;
 
@@ -71,6 +75,46 @@ namespace Nix_store {
 		return Genode::Cstring(path.base());
 	}
 
+	/**
+	 * Hash the content of an open file
+	 *
+	 * \return number of bytes hashed
+	 */
+	File_system::file_size_t hash_file(File_system::Session    &fs,
+	                                   File_system::File_handle handle,
+	                                   Hash::Function          &hash)
+	{
+		using namespace File_system;
+
+		File_system::Session::Tx::Source &source = *fs.tx();
+		collect_acknowledgements(source);
+
+		/* try to round to the nearest multiple of the hash block size */
+		size_t packet_size =
+		((source.bulk_buffer_size() / hash.block_size()) * hash.block_size()) / 2;
+		File_system::Packet_descriptor raw_packet = source.alloc_packet(packet_size);
+		Packet_guard guard(source, raw_packet);
+
+		while (packet_size > raw_packet.size())
+			packet_size /= 2;
+
+		size_t n = packet_size;
+		seek_off_t offset = 0;
+
+		do {
+			File_system::Packet_descriptor
+				packet(raw_packet, handle, File_system::Packet_descriptor::READ, n, offset);
+
+			source.submit_packet(packet);
+			packet = source.get_acked_packet();
+			n = packet.length();
+			hash.update((uint8_t *)source.packet_content(packet), n);
+			offset += n;
+		} while (n);
+
+		return offset;
+	}
+
 }
 
 #endif /* _NIX_STORE__UTIL_H_ */
\ No newline at end of file
@@ -0,0 +1,95 @@
+/*
+ * \brief  Benchmark of ingest directory nodes with many entries
+ * \author Emery Hemingway
+ * \date   2017-02-13
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+/* Genode includes */
+#include <timer_session/connection.h>
+#include <base/component.h>
+#include <base/heap.h>
+#include <base/snprintf.h>
+#include <base/log.h>
+
+/* Nix_store includes */
+#include <ingest_node.h>
+
+using namespace Genode;
+
+enum {
+	ENTRIES = 100000,
+	STRIDE  = 7919 /* coprime to ENTRIES, visits every entry once */
+};
+
+static void entry_name(char *buf, size_t len, unsigned i) {
+	snprintf(buf, len, "entry-%06u", (i * STRIDE) % ENTRIES); }
+
+
+static bool bench(Env &env, Allocator &alloc)
+{
+	Timer::Connection timer(env);
+
+	Nix_store::Directory dir("bench", alloc);
+	char name[16];
+
+	unsigned long start = timer.elapsed_ms();
+
+	for (unsigned i = 0; i < ENTRIES; ++i) {
+		entry_name(name, sizeof(name), i);
+		dir.file(name, true);
+	}
+
+	unsigned long inserted = timer.elapsed_ms();
+
+	for (unsigned i = 0; i < ENTRIES; ++i) {
+		entry_name(name, sizeof(name), i);
+		if (strcmp(dir.file(name, false).name(), name)) {
+			error("lookup of ", Cstring(name), " returned the wrong node");
+			return false;
+		}
+	}
+
+	unsigned long looked_up = timer.elapsed_ms();
+
+	log(ENTRIES, " entries inserted in ", inserted - start, " ms, "
+	    "looked up in ", looked_up - inserted, " ms");
+
+	/* names must be unique within a directory */
+	try {
+		dir.file("entry-000000", true);
+		error("duplicate entry was created");
+		return false;
+	} catch (File_system::Node_already_exists) { }
+
+	Nix_store::Hash_node *node = dir.remove("entry-050000");
+	if (!node) {
+		error("failed to remove entry");
+		return false;
+	}
+	destroy(alloc, node);
+
+	try {
+		dir.file("entry-050000", false);
+		error("removed entry was found");
+		return false;
+	} catch (File_system::Lookup_failed) { }
+
+	return true;
+}
+
+
+void Component::construct(Env &env)
+{
+	static Heap heap { &env.ram(), &env.rm() };
+
+	bool const ok = bench(env, heap);
+	if (ok) log("--- ingest directory benchmark finished ---");
+	env.parent().exit(ok ? 0 : ~0);
+}
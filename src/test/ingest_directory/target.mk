@@ -0,0 +1,6 @@
+TARGET   = test-ingest_directory
+SRC_CC   = main.cc
+LIBS     = base blake2s sha256
+INC_DIR += $(REP_DIR)/src/server/nix_store
+
+vpath main.cc $(PRG_DIR)
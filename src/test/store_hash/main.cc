@@ -0,0 +1,121 @@
+/*
+ * \brief  Test of the digest encoders and decoders
+ * \author Emery Hemingway
+ * \date   2017-02-22
+ */
+
+/*
+ * Copyright (C) 2017 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+/* Genode includes */
+#include <base/log.h>
+
+/* Nix includes */
+#include <store_hash/encode.h>
+
+using namespace Genode;
+
+/* SHA256 of the empty string */
+static char const *empty_base16 =
+	"e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+static char const *empty_nix_base32 =
+	"0mdqa9w1p6cmli6976v4wi0sw9r4p5prkj7lzfd1877wk11c9c73";
+
+/*
+ * Names and hashes of the empty string digest and of the bytes
+ * 0 to 31, as written by the encoders of earlier releases
+ */
+static char const *empty_name = "wsqc8hlqzzf196pvyz49jvxr49kswhg4-hello-1.0";
+static char const *count_name = "000h40q40130f209125hq38f138124hk-hello-1.0";
+static char const *empty_hash =
+	"1qxhqi19iz0w27dgpx68k7pvj917mb0y8r4vj56a95cr37w55f2m";
+static char const *count_hash =
+	"0001001h81860140j2hb136hw3qh2491650m25bih68s36f1s7hz";
+
+static int failed = 0;
+
+static void check(bool ok, char const *what)
+{
+	if (ok) {
+		log(what);
+	} else {
+		error(what);
+		++failed;
+	}
+}
+
+int main()
+{
+	using namespace Store_hash;
+
+	uint8_t a[32], b[32];
+
+	check(decode_base16(a, sizeof(a), empty_base16, strlen(empty_base16)),
+	      "decode base16");
+	check(decode_nix_base32(b, sizeof(b), empty_nix_base32, strlen(empty_nix_base32)),
+	      "decode Nix base32");
+	check(equal(a, b, sizeof(a)), "base16 and Nix base32 agree");
+
+	char text[65];
+	text[encode_base16(text, a, sizeof(a))] = 0;
+	check(strcmp(text, empty_base16) == 0, "encode base16");
+
+	/* names and hashes must not change */
+	uint8_t buf[64];
+
+	memcpy(buf, a, sizeof(a));
+	encode(buf, "hello-1.0", sizeof(buf));
+	check(strcmp((char *)buf, empty_name) == 0, "encode name");
+
+	memcpy(buf, a, sizeof(a));
+	encode_hash(buf, sizeof(buf));
+	check(strcmp((char *)buf, empty_hash) == 0, "encode hash");
+
+	for (size_t i = 0; i < sizeof(a); ++i)
+		buf[i] = i;
+	encode(buf, "hello-1.0", sizeof(buf));
+	check(strcmp((char *)buf, count_name) == 0, "encode name of counted bytes");
+
+	for (size_t i = 0; i < sizeof(a); ++i)
+		buf[i] = i;
+	encode_hash(buf, sizeof(buf));
+	check(strcmp((char *)buf, count_hash) == 0, "encode hash of counted bytes");
+
+	/* round trip of every length up to a digest */
+	bool round_trip = true;
+	for (size_t len = 1; len <= sizeof(a); ++len) {
+		for (size_t i = 0; i < len; ++i)
+			a[i] = i*37 + len;
+		size_t const n = encode_base32(text, a, len);
+		round_trip &= n == base32_len(len);
+		round_trip &= decode_base32(b, len, text, n);
+		round_trip &= equal(a, b, len);
+	}
+	check(round_trip, "base32 round trip");
+
+	/* invalid digits and lengths */
+	strncpy(text, empty_base16, sizeof(text));
+	text[7] = 'g';
+	check(!decode_base16(a, sizeof(a), text, strlen(text)), "reject base16 digit");
+	check(!decode_base16(a, sizeof(a), text, 63), "reject base16 length");
+
+	strncpy(text, empty_nix_base32, sizeof(text));
+	text[20] = 'e';
+	check(!decode_nix_base32(a, sizeof(a), text, strlen(text)), "reject base32 digit");
+
+	/* the first digit holds one bit past a 256 bit digest */
+	strncpy(text, empty_nix_base32, sizeof(text));
+	text[0] = 'z';
+	check(!decode_nix_base32(a, sizeof(a), text, strlen(text)), "reject base32 overflow");
+
+	b[31] ^= 1;
+	check(!equal(a, b, sizeof(a)), "unequal digests");
+
+	if (failed)
+		error(failed, " checks failed");
+	return failed;
+}
@@ -0,0 +1,3 @@
+TARGET = test-store_hash
+SRC_CC = main.cc
+LIBS   = base